@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dinamite_bloom.h"
+#include "dinamite_ht_numa.h"
+
+/*
+ * Round the number of blocks up to a power of two. The blocks go on the
+ * given NUMA node, or anywhere if it is -1.
+ */
+int
+dinamite_bloom_init(dinamite_bloom_t *bf, uint64_t capacity, int node) {
+
+	uint64_t num_blocks = 1;
+	void *blocks;
+
+	while(num_blocks * BLOOM_BLOCK_WORDS * 64 <
+	      capacity * BLOOM_BITS_PER_ENTRY)
+		num_blocks *= 2;
+
+	if(posix_memalign(&blocks, 64, num_blocks * sizeof(*bf->bf_blocks))
+	   != 0)
+		return -1;
+	__dinamite_numa_place(blocks, num_blocks * sizeof(*bf->bf_blocks), node);
+	memset(blocks, 0, num_blocks * sizeof(*bf->bf_blocks));
+
+	bf->bf_blocks = (uint64_t (*)[BLOOM_BLOCK_WORDS]) blocks;
+	bf->bf_mask = num_blocks - 1;
+	bf->bf_capacity = num_blocks * BLOOM_BLOCK_WORDS * 64 /
+		BLOOM_BITS_PER_ENTRY;
+	bf->bf_node = node;
+	return 0;
+}
+
+void
+dinamite_bloom_reset(dinamite_bloom_t *bf) {
+
+	memset(bf->bf_blocks, 0, dinamite_bloom_memory(bf));
+}
+
+void
+dinamite_bloom_free(dinamite_bloom_t *bf) {
+
+	free(bf->bf_blocks);
+	memset(bf, 0, sizeof(*bf));
+}
+
+uint64_t
+dinamite_bloom_memory(dinamite_bloom_t *bf) {
+
+	if(bf->bf_blocks == NULL)
+		return 0;
+	return (bf->bf_mask + 1) * sizeof(*bf->bf_blocks);
+}
+
+uint64_t
+dinamite_bloom_remote_pages(dinamite_bloom_t *bf) {
+
+	return __dinamite_numa_remote_pages(bf->bf_blocks,
+					    dinamite_bloom_memory(bf),
+					    bf->bf_node);
+}
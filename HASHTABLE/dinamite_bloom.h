@@ -0,0 +1,76 @@
+#ifndef DINAMITE_BLOOM_H
+#define DINAMITE_BLOOM_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#include "dinamite_ht_hash.h"
+
+/*
+ * A blocked Bloom filter in front of a table. Each value sets BLOOM_K bits
+ * within one 64-byte block, so a query costs one cache miss at most. The low
+ * bits of the value's hash pick the block and four 9-bit fields of the top
+ * 36 bits pick the bits in it. At BLOOM_BITS_PER_ENTRY bits per value the
+ * filter says "maybe" for about 2% of the values it has not seen; it never
+ * says "no" for a value it has seen.
+ *
+ * Like the HLL sketch, the filter hashes with the Murmur3 finalizer, so that
+ * it does not depend on the table's hash family.
+ */
+#define BLOOM_K 4
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_BITS_PER_ENTRY 10
+
+typedef struct __bloom {
+	uint64_t (*bf_blocks)[BLOOM_BLOCK_WORDS];   /* NULL if disabled */
+	uint64_t bf_mask;         /* Number of blocks - 1 */
+	uint64_t bf_capacity;     /* Values it holds at the intended rate */
+	int bf_node;              /* NUMA node of the blocks, or -1 */
+} dinamite_bloom_t;
+
+int dinamite_bloom_init(dinamite_bloom_t *bf, uint64_t capacity, int node);
+void dinamite_bloom_reset(dinamite_bloom_t *bf);
+void dinamite_bloom_free(dinamite_bloom_t *bf);
+uint64_t dinamite_bloom_memory(dinamite_bloom_t *bf);
+uint64_t dinamite_bloom_remote_pages(dinamite_bloom_t *bf);
+
+static inline uint64_t
+dinamite_bloom_hash(uint64_t value) {
+
+	return dinamite_ht_hash(DINAMITE_HT_HASH_MURMUR, value);
+}
+
+static inline void
+dinamite_bloom_prefetch(dinamite_bloom_t *bf, uint64_t hash) {
+
+	__builtin_prefetch(bf->bf_blocks[hash & bf->bf_mask]);
+}
+
+/* Returns 0 if the value was never added, 1 if it may have been */
+static inline int
+dinamite_bloom_maybe(dinamite_bloom_t *bf, uint64_t hash) {
+
+	uint64_t *block = bf->bf_blocks[hash & bf->bf_mask];
+
+	for(int i = 0; i < BLOOM_K; i++) {
+		unsigned bit = (hash >> (64 - 9 * (i + 1))) & 511;
+
+		if(!(block[bit >> 6] & (1ULL << (bit & 63))))
+			return 0;
+	}
+	return 1;
+}
+
+static inline void
+dinamite_bloom_add(dinamite_bloom_t *bf, uint64_t hash) {
+
+	uint64_t *block = bf->bf_blocks[hash & bf->bf_mask];
+
+	for(int i = 0; i < BLOOM_K; i++) {
+		unsigned bit = (hash >> (64 - 9 * (i + 1))) & 511;
+
+		block[bit >> 6] |= 1ULL << (bit & 63);
+	}
+}
+
+#endif
@@ -1,33 +1,243 @@
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "dinamite_bloom.h"
 #include "dinamite_hashtable.h"
+#include "dinamite_hll.h"
+#include "dinamite_ht_arena.h"
+#include "dinamite_ht_hash.h"
+#include "dinamite_ht_numa.h"
+#include "dinamite_ht_private.h"
+#include "dinamite_ht_stream.h"
+#include "dinamite_roaring.h"
+#include "dinamite_swisstable.h"
 
 #define MAX_THREADS 128
 #define HT_NUMBUCKETS 512
-#define INIT_BUCKET_SIZE 32
+#define INIT_BUCKET_SIZE DINAMITE_ARENA_MIN_ENTRIES
+#define INIT_BLOOM_ENTRIES 4096
+
+/*
+ * The chained layout doubles its number of buckets once the average bucket
+ * holds more than HT_MAX_LOAD_FACTOR entries. The entries are then moved
+ * to the new bucket array a few at a time, during the following puts: each put
+ * moves at most HT_REHASH_ENTRIES entries and visits at most
+ * HT_REHASH_BUCKETS old buckets.
+ */
+#define HT_MAX_LOAD_FACTOR 4
+#define HT_REHASH_ENTRIES 16
+#define HT_REHASH_BUCKETS 64
 
 /* Each hashtable bucket is a dynamic array. The number of entries tells us
  * how many entries are actually there; max entries tells us the maximum that
  * we can have. When the number of entries exceeds the maximum, we reallocate
  * the entries array doubling its size and copying the content of the old array
- * into the new one.
+ * into the new one. The arrays come from the table's arena, where the max
+ * entries is always a size class.
+ *
+ * A bucket whose epoch is not the table's is logically empty: resetting
+ * the table only bumps the table's epoch, and each bucket drops its stale
+ * entries, keeping its array, the next time it is written.
  */
 typedef struct __bucket {
 	int bct_num_entries;
 	int bct_max_entries;
 	uint64_t *bct_entries;
-	unsigned bct_iter_marker;
+	uint32_t bct_epoch;
 } dinamite_bucket_t;
 
-typedef struct __hashtable {
-	dinamite_bucket_t ht_buckets[HT_NUMBUCKETS];
-	unsigned ht_iter_marker;
-} dinamite_hashtable_t;
+/*
+ * Each table remembers the layout, hash family and granularity it was created
+ * with, so changing them only affects the tables allocated afterwards.
+ *
+ * While the chained layout is resizing, ht_old_buckets holds the previous
+ * bucket array. Old buckets below ht_rehash_marker have been moved to
+ * ht_buckets already; the rest may still hold values.
+ */
+struct __hashtable {
+	int ht_layout;
+	int ht_hash;
+	int ht_node;               /* NUMA node of its memory, or -1 */
+	uint64_t ht_gran_mask;     /* Applied to every value we are given */
+	dinamite_swisstable_t ht_swiss;
+	dinamite_roaring_t ht_roaring;
+	dinamite_hll_t *ht_hll;
+	dinamite_bloom_t ht_bloom;  /* For contains() on exact layouts, optional */
+	int ht_bloom_live;          /* The filter holds every value */
+	dinamite_bucket_t *ht_buckets;
+	uint32_t ht_num_buckets;
+	dinamite_arena_t ht_arena;  /* Entries arrays of both bucket arrays */
+	dinamite_bucket_t *ht_old_buckets;
+	uint32_t ht_old_num_buckets;
+	uint32_t ht_rehash_marker;
+	uint64_t ht_num_entries;
+	uint32_t ht_epoch;
+	unsigned ht_iter_marker;    /* Bucket and position of the iteration */
+	int ht_iter_pos;
+	int ht_thread_id;                  /* -1 for thread-local tables */
+	dinamite_stream_ring_t *ht_ring;   /* Once the table streams */
+	struct __hashtable *ht_tls_next;   /* Thread-local tables only */
+	struct __hashtable *ht_tls_prev;
+	dinamite_map_t *ht_tls_map;        /* The thread's map, if it has one */
+};
 
 dinamite_hashtable_t *per_thread_hashtables[MAX_THREADS];
 
+static int ht_layout = DINAMITE_HT_CHAINED;
+static int ht_hash = DINAMITE_HT_HASH_MULSHIFT;
+static uint64_t ht_gran_mask = ~0ULL;
+static int ht_use_bloom;
+static int ht_use_numa;
+
+/*
+ * Select the layout for hashtables allocated from now on. To switch all
+ * threads, call this before the first put or right after
+ * dinamite_hashtable_clear().
+ */
+int
+dinamite_hashtable_set_layout(int layout) {
+
+	if(layout != DINAMITE_HT_CHAINED && layout != DINAMITE_HT_SWISS &&
+	   layout != DINAMITE_HT_ROARING && layout != DINAMITE_HT_HLL) {
+		fprintf(stderr, "Warning: unknown hashtable layout %d\n",
+			layout);
+		return -1;
+	}
+	ht_layout = layout;
+	return 0;
+}
+
+int
+dinamite_hashtable_set_hash(int hash) {
+
+	if(hash < DINAMITE_HT_HASH_PAGE || hash > DINAMITE_HT_HASH_WYMIX) {
+		fprintf(stderr, "Warning: unknown hash family %d\n", hash);
+		return -1;
+	}
+	ht_hash = hash;
+	return 0;
+}
+
+int
+dinamite_hashtable_set_granularity(unsigned shift) {
+
+	if(shift > 63) {
+		fprintf(stderr, "Warning: granularity of 2^%u bytes is "
+			"too coarse\n", shift);
+		return -1;
+	}
+	ht_gran_mask = ~((1ULL << shift) - 1);
+	return 0;
+}
+
+/*
+ * Give the tables allocated from now on a Bloom filter, or not. Only
+ * contains() uses it: the first call fills the filter from the table, and
+ * a contains() of a value the filter has never seen then skips the search.
+ * Puts never consult it; once it exists, they only add the values they
+ * insert. The filter grows with the table, at about 1.25 bytes per value.
+ * Resetting the table only marks the filter stale, for the next contains()
+ * to refill. The HLL layout ignores this.
+ */
+void
+dinamite_hashtable_set_bloom(int enable) {
+
+	ht_use_bloom = enable;
+}
+
+/*
+ * Place the tables allocated from now on on the NUMA node of the thread
+ * that allocates them, or not. A table is allocated by the first put of its
+ * thread, so its memory then stays on that thread's node, even when another
+ * thread triggers an allocation later, such as an iteration that finishes
+ * a resize. Threads should be pinned to a node for this to help. Without
+ * NUMA support, it makes no difference.
+ */
+void
+dinamite_hashtable_set_numa(int enable) {
+
+	ht_use_numa = enable;
+}
+
+/*
+ * The table itself takes whole pages when it is placed on a node, so that
+ * it can be placed as well.
+ */
+static dinamite_hashtable_t *
+__dinamite_ht_struct_alloc(int node) {
+
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = (sizeof(dinamite_hashtable_t) + page - 1) & ~(page - 1);
+	void *ht;
+
+	if(node < 0)
+		return (dinamite_hashtable_t *)
+			malloc(sizeof(dinamite_hashtable_t));
+	if(posix_memalign(&ht, page, size) != 0)
+		return NULL;
+	__dinamite_numa_place(ht, size, node);
+	return (dinamite_hashtable_t *) ht;
+}
+
+/*
+ * Allocate a table with the current layout, hash family, granularity and
+ * placement.
+ */
+static dinamite_hashtable_t *
+__dinamite_ht_alloc(void) {
+
+	dinamite_hashtable_t *ht;
+	int node = ht_use_numa ? __dinamite_numa_node() : DINAMITE_NUMA_NONE;
+
+	if( (ht = __dinamite_ht_struct_alloc(node)) == NULL)
+		return NULL;
+	else
+		memset(ht, 0, sizeof(dinamite_hashtable_t));
+
+	ht->ht_layout = ht_layout;
+	ht->ht_hash = ht_hash;
+	ht->ht_gran_mask = ht_gran_mask;
+	ht->ht_node = node;
+
+	if(ht_use_bloom && ht_layout != DINAMITE_HT_HLL &&
+	   dinamite_bloom_init(&ht->ht_bloom, INIT_BLOOM_ENTRIES, node) != 0) {
+		free(ht);
+		return NULL;
+	}
+
+	if(ht_layout == DINAMITE_HT_SWISS) {
+		if(dinamite_swisstable_init(&ht->ht_swiss, ht_hash, node) == 0)
+			return ht;
+	}
+	else if(ht_layout == DINAMITE_HT_ROARING) {
+		if(dinamite_roaring_init(&ht->ht_roaring, ht_hash, node) == 0)
+			return ht;
+	}
+	else if(ht_layout == DINAMITE_HT_HLL) {
+		if( (ht->ht_hll = dinamite_hll_alloc()) != NULL)
+			return ht;
+	}
+	else {
+		ht->ht_buckets = (dinamite_bucket_t *)
+			calloc(HT_NUMBUCKETS, sizeof(dinamite_bucket_t));
+		ht->ht_num_buckets = HT_NUMBUCKETS;
+		dinamite_arena_init(&ht->ht_arena, node);
+		if(ht->ht_buckets != NULL) {
+			__dinamite_numa_place(ht->ht_buckets, HT_NUMBUCKETS *
+					      sizeof(dinamite_bucket_t), node);
+			return ht;
+		}
+	}
+
+	dinamite_bloom_free(&ht->ht_bloom);
+	free(ht);
+	return NULL;
+}
+
 /* A hashtable that stores 64-bit values. There is a hashtable per thread.
  * We assume that thread IDs are small monotonically increasing numbers.
  * For simplicity and to limit the overhead, we assume the limit on the number
@@ -36,21 +246,21 @@ dinamite_hashtable_t *per_thread_hashtables[MAX_THREADS];
  * On failure, either because the thread ID does not match our expectations
  * or if malloc fails, we report the problem to stdout, but do not crash.
  * We simply avoid future accesses to the broken hashtable.
+ *
+ * Threads that cannot provide such IDs use the dinamite_hashtable_tls_*
+ * functions instead, see below.
  */
 static int
 __dinamite_ht_init(int threadID) {
 
-	if( (per_thread_hashtables[threadID]
-	     = (dinamite_hashtable_t *) malloc(sizeof(dinamite_hashtable_t)))
+	if( (per_thread_hashtables[threadID] = __dinamite_ht_alloc())
 	    == NULL) {
 		fprintf(stderr, "Warning: malloc() returned NULL when "
 			"allocating a hashtable for threadID %d\n",
 			threadID);
 		return -1;
 	}
-	else
-		memset(per_thread_hashtables[threadID], 0,
-		       sizeof(dinamite_hashtable_t));
+	per_thread_hashtables[threadID]->ht_thread_id = threadID;
 	return 0;
 }
 
@@ -72,150 +282,1431 @@ inline int __dinamite_ht_checkinit(threadID) {
 		return 0;
 }
 
-/* Hash into a bucket. If it is full, just go through the array until we find
- * the next empty one. Wrap around. If we run out of space, double the size
- * of the hash table and rehash.
- *
- * A bucket is empty if its corresponding value is zero.
- * This hashtable is used for storing 64-bit values that are pointers, so we
- * can safely assume that zero is an invalid value here.
- *
- * If we need to allocate the memory but fail, we report a warning, but continue
- * running, so that the trace can be recorded at least partially.
- */
-void
-dinamite_hashtable_put(uint64_t value, int threadID) {
+#define HT_HASH(ht, value) dinamite_ht_hash((ht)->ht_hash, (value))
 
-	dinamite_bucket_t *bucket = NULL;
-	uint32_t hash, i;
+/* The number of entries the bucket holds in the table's current epoch */
+static inline int
+__dinamite_bucket_len(dinamite_hashtable_t *ht, dinamite_bucket_t *bucket) {
 
-	if(__dinamite_ht_checkinit(threadID) != 0)
-		return;
+	return bucket->bct_epoch == ht->ht_epoch ? bucket->bct_num_entries : 0;
+}
+
+/* Drop the entries of an earlier epoch before writing to the bucket */
+static inline void
+__dinamite_bucket_refresh(dinamite_hashtable_t *ht, dinamite_bucket_t *bucket) {
+
+	if(bucket->bct_epoch != ht->ht_epoch) {
+		bucket->bct_num_entries = 0;
+		bucket->bct_epoch = ht->ht_epoch;
+	}
+}
+
+static inline int
+__dinamite_bucket_find(dinamite_hashtable_t *ht, dinamite_bucket_t *bucket,
+		       uint64_t value) {
+
+	int i, len = __dinamite_bucket_len(ht, bucket);
+
+	for( i = 0; i < len; i++ )
+		if(bucket->bct_entries[i] == value)
+			return 1;
+	return 0;
+}
+
+/* The arena size class of an entries array with max_entries entries */
+static inline int
+__dinamite_bucket_class(int max_entries) {
+
+	return __builtin_ctz(max_entries) - __builtin_ctz(INIT_BUCKET_SIZE);
+}
 
-	hash = (((uint32_t)value & 0xFFFFF000 ) >> 12) % HT_NUMBUCKETS;
-	bucket = &(per_thread_hashtables[threadID]->ht_buckets[hash]);
+/*
+ * Append a value that is known not to be in the bucket, allocating or
+ * growing the bucket array as necessary. Only the entries in use are
+ * copied when the array grows; the rest is left uninitialized.
+ */
+static int
+__dinamite_bucket_append(dinamite_hashtable_t *ht, dinamite_bucket_t *bucket,
+			 uint64_t value) {
+
+	__dinamite_bucket_refresh(ht, bucket);
 
 	/* Check if this bucket has not yet been allocated */
 	if(bucket->bct_entries == NULL) {
-		bucket->bct_entries =
-			(uint64_t *)
-			malloc(sizeof(uint64_t) * INIT_BUCKET_SIZE);
-		if(bucket->bct_entries == NULL) {
-			fprintf(stderr, "Warning: failed to allocate a "
-				" bucket array for thread %d\n", threadID);
-			return;
-		}
+		bucket->bct_entries = dinamite_arena_alloc(&ht->ht_arena, 0);
+		if(bucket->bct_entries == NULL)
+			return -1;
 		else
 			bucket->bct_max_entries = INIT_BUCKET_SIZE;
 	}
 	/* Check if we have run out of space in the bucket */
 	else if(bucket->bct_num_entries == bucket->bct_max_entries) {
 
-		/* Reallocate */
-		fprintf(stderr, "\tReallocating the bucket array for thread %d "
-			"to %d entries.\n", threadID,
-			bucket->bct_max_entries * 2);
+		int size_class =
+			__dinamite_bucket_class(bucket->bct_max_entries);
+		uint64_t *new_entries =
+			dinamite_arena_alloc(&ht->ht_arena, size_class + 1);
 
-		uint64_t *new_entries = (uint64_t*)
-			malloc(sizeof(uint64_t) * bucket->bct_max_entries * 2);
-
-		if(new_entries == NULL) {
-			fprintf(stderr, "Warning: failed to allocate a "
-				" bucket array for thread %d\n", threadID);
-			return;
-		}
+		if(new_entries == NULL)
+			return -1;
 		else {
-			memset(new_entries, 0,
-			       sizeof(uint64_t) * bucket->bct_max_entries * 2);
 			memcpy(new_entries, bucket->bct_entries,
 			       sizeof(uint64_t) * bucket->bct_num_entries);
-			free(bucket->bct_entries);
+			dinamite_arena_free(&ht->ht_arena, bucket->bct_entries,
+					    size_class);
 			bucket->bct_entries = new_entries;
 			bucket->bct_max_entries = bucket->bct_max_entries * 2;
 		}
 	}
 
+	bucket->bct_entries[bucket->bct_num_entries++] = value;
+	return 0;
+}
+
+/*
+ * Move a bounded number of entries from the old bucket array to the new one.
+ * Entries are taken off the end of an old bucket, so a partially migrated
+ * bucket remains valid for lookups. Once a bucket is empty, we free its
+ * array and move on to the next one; once all old buckets are empty, the
+ * resize is complete.
+ */
+static int
+__dinamite_ht_rehash_step(dinamite_hashtable_t *ht, int max_entries) {
+
+	uint32_t new_mask = ht->ht_num_buckets - 1;
+	int moved = 0, visited = 0;
+
+	while(ht->ht_rehash_marker < ht->ht_old_num_buckets) {
+		dinamite_bucket_t *old =
+			&ht->ht_old_buckets[ht->ht_rehash_marker];
+
+		__dinamite_bucket_refresh(ht, old);
+		while(old->bct_num_entries > 0) {
+			uint64_t value =
+				old->bct_entries[old->bct_num_entries - 1];
+			dinamite_bucket_t *bucket = &ht->ht_buckets[
+				HT_HASH(ht, value) & new_mask];
+
+			if(moved == max_entries)
+				return 0;
+			if(__dinamite_bucket_append(ht, bucket, value) != 0)
+				return -1;
+			old->bct_num_entries--;
+			moved++;
+		}
+
+		if(old->bct_entries != NULL)
+			dinamite_arena_free(&ht->ht_arena, old->bct_entries,
+					    __dinamite_bucket_class(
+						    old->bct_max_entries));
+		old->bct_entries = NULL;
+		ht->ht_rehash_marker++;
+
+		if(++visited == HT_REHASH_BUCKETS)
+			return 0;
+	}
+
+	free(ht->ht_old_buckets);
+	ht->ht_old_buckets = NULL;
+	ht->ht_old_num_buckets = 0;
+	ht->ht_rehash_marker = 0;
+	return 0;
+}
+
+/*
+ * Start a resize by installing a new bucket array with twice as many buckets.
+ * If we cannot allocate it, we simply keep using the current one.
+ */
+static void
+__dinamite_ht_start_resize(dinamite_hashtable_t *ht) {
+
+	dinamite_bucket_t *new_buckets = (dinamite_bucket_t *)
+		calloc((size_t)ht->ht_num_buckets * 2, sizeof(dinamite_bucket_t));
+
+	if(new_buckets == NULL)
+		return;
+	__dinamite_numa_place(new_buckets, (size_t)ht->ht_num_buckets * 2 *
+			      sizeof(dinamite_bucket_t), ht->ht_node);
+
+	ht->ht_old_buckets = ht->ht_buckets;
+	ht->ht_old_num_buckets = ht->ht_num_buckets;
+	ht->ht_rehash_marker = 0;
+	ht->ht_buckets = new_buckets;
+	ht->ht_num_buckets *= 2;
+}
+
+/*
+ * Returns 1 if the value was inserted, 0 if it was already there and -1 if
+ * we failed to allocate memory. The caller has hashed the value.
+ */
+static int
+__dinamite_ht_chained_put(dinamite_hashtable_t *ht, uint64_t value,
+			  uint64_t hash) {
+
+	dinamite_bucket_t *bucket = NULL;
+
+	/* While resizing, the value may still be in its old bucket */
+	if(ht->ht_old_buckets != NULL) {
+		__dinamite_ht_rehash_step(ht, HT_REHASH_ENTRIES);
+		if(ht->ht_old_buckets != NULL &&
+		   __dinamite_bucket_find(ht, &ht->ht_old_buckets[
+			   hash & (ht->ht_old_num_buckets - 1)], value))
+			return 0;
+	}
+
+	bucket = &ht->ht_buckets[hash & (ht->ht_num_buckets - 1)];
+
 	/* Check if this value is already in the bucket */
-	for( i = 0; i < bucket->bct_num_entries; i++ )
-		if(bucket->bct_entries[i] == value)
-			return;
+	if(__dinamite_bucket_find(ht, bucket, value))
+		return 0;
 
 	/* The value is not there. Add it. */
-	bucket->bct_entries[bucket->bct_num_entries++] = value;
+	if(__dinamite_bucket_append(ht, bucket, value) != 0)
+		return -1;
+
+	if(++ht->ht_num_entries >
+	   (uint64_t)ht->ht_num_buckets * HT_MAX_LOAD_FACTOR &&
+	   ht->ht_old_buckets == NULL)
+		__dinamite_ht_start_resize(ht);
+
+	return 1;
 }
 
+static int
+__dinamite_ht_grow_bloom(dinamite_hashtable_t *ht, uint64_t capacity);
+
 /*
- * A call to this function resets the iteration markers for the hashtable.
- * This function must be called every time we begin iterating the hashtable
- * to ensure the iteration commences from the first item.
+ * Called with the result of every put. A value that was just inserted goes
+ * into the Bloom filter, once contains() has built one, and on to the
+ * streaming thread. The table gets its ring the first time it streams a
+ * value.
+ *
+ * Puts never consult the filter: buckets and groups are short, so the
+ * search it would save costs less than the filter's own cache miss.
  */
-void
-dinamite_hashtable_begin_iterate(int threadID) {
+static inline int
+__dinamite_ht_inserted(dinamite_hashtable_t *ht, int ret, uint64_t value) {
 
-	unsigned i;
-	if(__dinamite_ht_checkinit(threadID) != 0)
-		return;
-	per_thread_hashtables[threadID]->ht_iter_marker = 0;
+	if(ret != 1)
+		return ret;
+	if(ht->ht_bloom_live) {
+		dinamite_bloom_add(&ht->ht_bloom, dinamite_bloom_hash(value));
+		if(__dinamite_ht_num_entries(ht) > ht->ht_bloom.bf_capacity)
+			__dinamite_ht_grow_bloom(ht,
+						 ht->ht_bloom.bf_capacity * 4);
+	}
+	if(!__atomic_load_n(&__dinamite_stream_active, __ATOMIC_RELAXED))
+		return ret;
+	if(ht->ht_ring == NULL &&
+	   (ht->ht_ring = __dinamite_stream_ring_new(ht->ht_thread_id))
+	   == NULL) {
+		fprintf(stderr, "Warning: failed to allocate a stream ring "
+			"for thread %d\n", ht->ht_thread_id);
+		return ret;
+	}
+	dinamite_stream_push(ht->ht_ring, value);
+	return ret;
+}
+
+/* Hash into a bucket. If it is full, just go through the array until we find
+ * the next empty one. Wrap around. If we run out of space, double the size
+ * of the hash table and rehash.
+ *
+ * A bucket is empty if its corresponding value is zero.
+ * This hashtable is used for storing 64-bit values that are pointers, so we
+ * can safely assume that zero is an invalid value here.
+ *
+ * Returns 1 if the value was inserted, 0 if it was already there and -1 if
+ * we failed to allocate memory.
+ */
+static inline int
+__dinamite_ht_put(dinamite_hashtable_t *ht, uint64_t value) {
 
-	for( i = 0; i < HT_NUMBUCKETS; i++ )
-		per_thread_hashtables[threadID]->ht_buckets[i].bct_iter_marker
-			= 0;
+	int ret;
+
+	value &= ht->ht_gran_mask;
+
+	if(ht->ht_layout == DINAMITE_HT_SWISS)
+		ret = dinamite_swisstable_put(&ht->ht_swiss, value);
+	else if(ht->ht_layout == DINAMITE_HT_ROARING)
+		ret = dinamite_roaring_put(&ht->ht_roaring, value);
+	else if(ht->ht_layout == DINAMITE_HT_HLL) {
+		dinamite_hll_put(ht->ht_hll, value);
+		return 0;
+	}
+	else
+		ret = __dinamite_ht_chained_put(ht, value,
+						HT_HASH(ht, value));
+	return __dinamite_ht_inserted(ht, ret, value);
 }
 
 /*
- * This function returns the next item in the hashtable. The position of
- * the iteration is remembered by the iteration markers at the level of
- * the hashtable (to remember at what bucket we left of) and at the level
- * of the bucket.
+ * Insert a batch of values, HT_BATCH at a time. For each group we first
+ * compute all the hashes and prefetch the memory every value is going to
+ * touch, then insert them, so that the cache misses of the group overlap
+ * rather than being taken one after another. For the chained layout there
+ * are two dependent misses, the bucket and its entries array, so we
+ * prefetch in two rounds.
+ *
+ * The prefetches are only hints: if an insert resizes the table, the
+ * remaining values of the group are still inserted correctly, the hash does
+ * not depend on the table size.
  */
-int dinamite_hashtable_getnext(int threadID, uint64_t *value_ptr) {
+#define HT_BATCH 16
+
+static int
+__dinamite_ht_put_batch(dinamite_hashtable_t *ht, const uint64_t *values,
+			size_t n) {
+
+	uint64_t keys[HT_BATCH], hashes[HT_BATCH];
+	size_t base, i, m;
+	int ret = 0;
+
+	/* There is no single location to prefetch for a roaring table */
+	if(ht->ht_layout == DINAMITE_HT_ROARING) {
+		for(i = 0; i < n; i++) {
+			uint64_t value = values[i] & ht->ht_gran_mask;
+
+			if(__dinamite_ht_inserted(ht,
+				dinamite_roaring_put(&ht->ht_roaring, value),
+				value) < 0)
+				ret = -1;
+		}
+		return ret;
+	}
+	if(ht->ht_layout == DINAMITE_HT_HLL) {
+		for(i = 0; i < n; i++)
+			dinamite_hll_put(ht->ht_hll, values[i] & ht->ht_gran_mask);
+		return 0;
+	}
+
+	for(base = 0; base < n; base += m) {
+		m = (n - base < HT_BATCH) ? n - base : HT_BATCH;
+
+		for(i = 0; i < m; i++) {
+			keys[i] = values[base + i] & ht->ht_gran_mask;
+			hashes[i] = HT_HASH(ht, keys[i]);
+		}
+
+		if(ht->ht_layout == DINAMITE_HT_SWISS) {
+			for(i = 0; i < m; i++)
+				dinamite_swisstable_prefetch(&ht->ht_swiss,
+							     hashes[i]);
+			for(i = 0; i < m; i++)
+				if(__dinamite_ht_inserted(ht,
+					dinamite_swisstable_put_hash(
+						&ht->ht_swiss, keys[i],
+						hashes[i]),
+					keys[i]) < 0)
+					ret = -1;
+			continue;
+		}
+
+		for(i = 0; i < m; i++)
+			__builtin_prefetch(&ht->ht_buckets[
+				hashes[i] & (ht->ht_num_buckets - 1)]);
+		for(i = 0; i < m; i++)
+			__builtin_prefetch(ht->ht_buckets[
+				hashes[i] & (ht->ht_num_buckets - 1)]
+					   .bct_entries);
+		for(i = 0; i < m; i++)
+			if(__dinamite_ht_inserted(ht,
+				__dinamite_ht_chained_put(ht, keys[i],
+							  hashes[i]),
+				keys[i]) < 0)
+				ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * If a resize is in progress, we finish it here, so that the iteration
+ * only needs to look at one bucket array. Otherwise this takes constant
+ * time: the position of the iteration is kept in the table.
+ */
+static int
+__dinamite_ht_begin_iterate(dinamite_hashtable_t *ht) {
+
+	int ret = 0;
+
+	if(ht->ht_layout == DINAMITE_HT_SWISS) {
+		dinamite_swisstable_begin_iterate(&ht->ht_swiss);
+		return 0;
+	}
+	if(ht->ht_layout == DINAMITE_HT_ROARING) {
+		dinamite_roaring_begin_iterate(&ht->ht_roaring);
+		return 0;
+	}
+	if(ht->ht_layout == DINAMITE_HT_HLL)
+		return 0;
+
+	while(ht->ht_old_buckets != NULL)
+		if((ret = __dinamite_ht_rehash_step(ht, INT_MAX)) != 0)
+			break;
+
+	ht->ht_iter_marker = 0;
+	ht->ht_iter_pos = 0;
+
+	return ret;
+}
+
+/*
+ * The position of the iteration is remembered by the iteration marker (to
+ * remember at what bucket we left of) and the position within that bucket.
+ */
+static int
+__dinamite_ht_getnext(dinamite_hashtable_t *ht, uint64_t *value_ptr) {
 
 	dinamite_bucket_t * bucket;
-	unsigned ht_marker, bct_marker;
+	unsigned ht_marker;
 
-	if(__dinamite_ht_checkinit(threadID) != 0)
+	if(ht->ht_layout == DINAMITE_HT_SWISS)
+		return dinamite_swisstable_getnext(&ht->ht_swiss, value_ptr);
+	if(ht->ht_layout == DINAMITE_HT_ROARING)
+		return dinamite_roaring_getnext(&ht->ht_roaring, value_ptr);
+	if(ht->ht_layout == DINAMITE_HT_HLL)
 		return -1;
 
 encore:
-	ht_marker = per_thread_hashtables[threadID]->ht_iter_marker;
-	if(ht_marker > HT_NUMBUCKETS - 1)
+	ht_marker = ht->ht_iter_marker;
+	if(ht_marker > ht->ht_num_buckets - 1)
 		return -1;
 
-	bucket = &per_thread_hashtables[threadID]->ht_buckets[ht_marker];
+	bucket = &ht->ht_buckets[ht_marker];
 
 	if(bucket->bct_entries == NULL) {
-		per_thread_hashtables[threadID]->ht_iter_marker++;
+		ht->ht_iter_marker++;
 		goto encore;
 	}
 	else {
-		if(bucket->bct_iter_marker == bucket->bct_num_entries) {
-			per_thread_hashtables[threadID]->ht_iter_marker++;
+		if(ht->ht_iter_pos >= __dinamite_bucket_len(ht, bucket)) {
+			ht->ht_iter_marker++;
+			ht->ht_iter_pos = 0;
 			goto encore;
 		}
 		else {
-			*value_ptr =
-				bucket->bct_entries[bucket->bct_iter_marker++];
+			*value_ptr = bucket->bct_entries[ht->ht_iter_pos++];
 			return 0;
 		}
 	}
 }
 
-void dinamite_hashtable_clear(void) {
+/*
+ * Like getnext, but copies the rest of a bucket at once, up to max values.
+ */
+static size_t
+__dinamite_ht_getnext_bulk(dinamite_hashtable_t *ht, uint64_t *buf,
+			   size_t max) {
 
-	for(int i = 0; i < MAX_THREADS; i++)
-	{
-		dinamite_hashtable_t *cur_ht;
-		if( (cur_ht = per_thread_hashtables[i]) == NULL)
-			continue;
+	size_t n = 0;
+
+	if(ht->ht_layout == DINAMITE_HT_SWISS)
+		return dinamite_swisstable_getnext_bulk(&ht->ht_swiss, buf,
+							max);
+	if(ht->ht_layout == DINAMITE_HT_ROARING)
+		return dinamite_roaring_getnext_bulk(&ht->ht_roaring, buf,
+						     max);
+	if(ht->ht_layout == DINAMITE_HT_HLL)
+		return 0;
+
+	while(n < max && ht->ht_iter_marker < ht->ht_num_buckets) {
+		dinamite_bucket_t *bucket = &ht->ht_buckets[ht->ht_iter_marker];
+		size_t left = 0;
 
-		for(int j = 0; j < HT_NUMBUCKETS; j++) {
-			if(cur_ht->ht_buckets[j].bct_entries == NULL)
-				continue;
-			else
-				free(cur_ht->ht_buckets[j].bct_entries);
+		if(bucket->bct_entries != NULL &&
+		   ht->ht_iter_pos < __dinamite_bucket_len(ht, bucket))
+			left = __dinamite_bucket_len(ht, bucket) -
+				ht->ht_iter_pos;
+
+		if(left > max - n) {
+			memcpy(buf + n, bucket->bct_entries + ht->ht_iter_pos,
+			       (max - n) * sizeof(uint64_t));
+			ht->ht_iter_pos += max - n;
+			return max;
 		}
+		if(left > 0)
+			memcpy(buf + n, bucket->bct_entries + ht->ht_iter_pos,
+			       left * sizeof(uint64_t));
+		n += left;
+		ht->ht_iter_marker++;
+		ht->ht_iter_pos = 0;
+	}
+	return n;
+}
 
-		free(cur_ht);
-		per_thread_hashtables[i] = 0;
+typedef struct __sort_cursor {
+	uint64_t *sc_pos;
+	uint64_t sc_left;
+} sort_cursor_t;
+
+static void
+__dinamite_sort_copy(void *arg, const uint64_t *values, size_t n) {
+
+	sort_cursor_t *cursor = (sort_cursor_t *) arg;
+
+	if(n > cursor->sc_left)
+		n = cursor->sc_left;
+	memcpy(cursor->sc_pos, values, n * sizeof(uint64_t));
+	cursor->sc_pos += n;
+	cursor->sc_left -= n;
+}
+
+/*
+ * Copy all values of the table to a new array and radix sort them.
+ */
+static uint64_t *
+__dinamite_ht_sorted(dinamite_hashtable_t *ht, uint64_t *count) {
+
+	uint64_t n = __dinamite_ht_num_entries(ht);
+	sort_cursor_t cursor;
+	uint64_t *values;
+
+	*count = 0;
+	if( (values = (uint64_t *) malloc(sizeof(uint64_t) * (n + 1))) == NULL)
+		return NULL;
+
+	cursor.sc_pos = values;
+	cursor.sc_left = n;
+	__dinamite_ht_visit_chunks(ht, __dinamite_sort_copy, &cursor);
+	n -= cursor.sc_left;
+
+	if(__dinamite_radix_sort(values, n) != 0) {
+		free(values);
+		return NULL;
+	}
+	*count = n;
+	return values;
+}
+
+/*
+ * Make the table empty in constant time, keeping all of its memory. A Bloom
+ * filter is only marked stale: the next contains() refills it. When
+ * the epoch counter wraps around, a bucket might wrongly look current, so
+ * we then empty all buckets for real, once every 2^32 resets.
+ */
+static void
+__dinamite_ht_reset(dinamite_hashtable_t *ht) {
+
+	ht->ht_bloom_live = 0;
+
+	if(ht->ht_layout == DINAMITE_HT_SWISS) {
+		dinamite_swisstable_reset(&ht->ht_swiss);
+		return;
+	}
+	if(ht->ht_layout == DINAMITE_HT_ROARING) {
+		dinamite_roaring_reset(&ht->ht_roaring);
+		return;
+	}
+	if(ht->ht_layout == DINAMITE_HT_HLL) {
+		dinamite_hll_reset(ht->ht_hll);
+		return;
 	}
+
+	ht->ht_num_entries = 0;
+	ht->ht_iter_marker = 0;
+	ht->ht_iter_pos = 0;
+
+	if(++ht->ht_epoch == 0) {
+		for(uint32_t i = 0; i < ht->ht_num_buckets; i++)
+			ht->ht_buckets[i].bct_num_entries = 0;
+		for(uint32_t i = 0; i < ht->ht_old_num_buckets; i++)
+			ht->ht_old_buckets[i].bct_num_entries = 0;
+	}
+}
+
+static void
+__dinamite_ht_free(dinamite_hashtable_t *ht) {
+
+	if(ht->ht_layout == DINAMITE_HT_SWISS)
+		dinamite_swisstable_free(&ht->ht_swiss);
+	else if(ht->ht_layout == DINAMITE_HT_ROARING)
+		dinamite_roaring_free(&ht->ht_roaring);
+	else if(ht->ht_layout == DINAMITE_HT_HLL)
+		free(ht->ht_hll);
+	else {
+		/* All entries arrays go at once, with the arena */
+		dinamite_arena_release(&ht->ht_arena);
+		free(ht->ht_buckets);
+		free(ht->ht_old_buckets);
+	}
+
+	dinamite_bloom_free(&ht->ht_bloom);
+	if(ht->ht_ring != NULL)
+		__dinamite_stream_ring_close(ht->ht_ring);
+	free(ht);
+}
+
+static void
+__dinamite_stats_add(void *arg, uint64_t len) {
+
+	dinamite_ht_stats_t *stats = (dinamite_ht_stats_t *) arg;
+	int slot = 0;
+
+	while(len >> slot && slot < DINAMITE_HT_HIST_BUCKETS - 1)
+		slot++;
+	stats->hts_len_hist[slot]++;
+
+	if(len > 0)
+		stats->hts_nonempty_buckets++;
+	if(len > stats->hts_max_len)
+		stats->hts_max_len = len;
+}
+
+/*
+ * For the chained layout the lengths are bucket lengths; for the swiss layout
+ * a "bucket" is a slot and the lengths are the number of groups probed to
+ * find each entry; for the roaring layout a "bucket" is a slot in the
+ * directory and its length is the number of values in its container; for
+ * the HLL layout a "bucket" is a register and its length is the register's
+ * rank, and the number of entries is an estimate.
+ */
+static void
+__dinamite_ht_get_stats(dinamite_hashtable_t *ht, dinamite_ht_stats_t *stats) {
+
+	memset(stats, 0, sizeof(*stats));
+
+	if(ht->ht_layout == DINAMITE_HT_SWISS) {
+		dinamite_swisstable_probe_lengths(&ht->ht_swiss,
+						  __dinamite_stats_add, stats);
+		stats->hts_entries = ht->ht_swiss.st_num_entries;
+		stats->hts_buckets = dinamite_swisstable_capacity(&ht->ht_swiss);
+		/* Empty slots have no probe length, count them here */
+		stats->hts_len_hist[0] = stats->hts_buckets - stats->hts_entries;
+		/* A control byte and a value per slot, an epoch per group */
+		stats->hts_memory = stats->hts_buckets * (1 + sizeof(uint64_t)) +
+			ht->ht_swiss.st_num_groups * sizeof(uint32_t);
+		stats->hts_remote_pages =
+			dinamite_swisstable_remote_pages(&ht->ht_swiss);
+	}
+	else if(ht->ht_layout == DINAMITE_HT_ROARING) {
+		dinamite_roaring_container_sizes(&ht->ht_roaring,
+						 __dinamite_stats_add, stats);
+		stats->hts_entries = ht->ht_roaring.rr_num_entries;
+		stats->hts_buckets = ht->ht_roaring.rr_dir_size;
+		stats->hts_memory = dinamite_roaring_memory(&ht->ht_roaring);
+		stats->hts_remote_pages =
+			dinamite_roaring_remote_pages(&ht->ht_roaring);
+	}
+	else if(ht->ht_layout == DINAMITE_HT_HLL) {
+		for(int i = 0; i < HLL_REGISTERS; i++)
+			__dinamite_stats_add(stats, ht->ht_hll->hl_regs[i]);
+		stats->hts_entries = dinamite_hll_estimate(ht->ht_hll);
+		stats->hts_buckets = HLL_REGISTERS;
+		stats->hts_memory = sizeof(dinamite_hll_t);
+	}
+	else {
+		for(uint32_t i = 0; i < ht->ht_num_buckets; i++)
+			__dinamite_stats_add(stats, __dinamite_bucket_len(
+						     ht, &ht->ht_buckets[i]));
+		stats->hts_entries = ht->ht_num_entries;
+		stats->hts_buckets = ht->ht_num_buckets;
+		stats->hts_resizing = (ht->ht_old_buckets != NULL);
+		stats->hts_memory = ht->ht_arena.da_reserved +
+			sizeof(dinamite_bucket_t) *
+			((uint64_t)ht->ht_num_buckets + ht->ht_old_num_buckets);
+		stats->hts_remote_pages =
+			dinamite_arena_remote_pages(&ht->ht_arena) +
+			__dinamite_numa_remote_pages(
+				ht->ht_buckets, sizeof(dinamite_bucket_t) *
+				ht->ht_num_buckets, ht->ht_node) +
+			__dinamite_numa_remote_pages(
+				ht->ht_old_buckets, sizeof(dinamite_bucket_t) *
+				ht->ht_old_num_buckets, ht->ht_node);
+	}
+
+	stats->hts_memory += dinamite_bloom_memory(&ht->ht_bloom);
+	stats->hts_node = ht->ht_node;
+	stats->hts_remote_pages += dinamite_bloom_remote_pages(&ht->ht_bloom) +
+		__dinamite_numa_remote_pages(ht, sizeof(*ht), ht->ht_node);
+
+	if(stats->hts_buckets > 0)
+		stats->hts_load_factor =
+			(double)stats->hts_entries / stats->hts_buckets;
+}
+
+int
+__dinamite_ht_thread_id(dinamite_hashtable_t *ht) {
+
+	return ht->ht_thread_id;
+}
+
+/* The number of values the table holds; a sketch holds none */
+uint64_t
+__dinamite_ht_num_entries(dinamite_hashtable_t *ht) {
+
+	if(ht->ht_layout == DINAMITE_HT_SWISS)
+		return ht->ht_swiss.st_num_entries;
+	else if(ht->ht_layout == DINAMITE_HT_ROARING)
+		return ht->ht_roaring.rr_num_entries;
+	else if(ht->ht_layout == DINAMITE_HT_HLL)
+		return 0;
+	else
+		return ht->ht_num_entries;
+}
+
+/*
+ * Hand all values of a table to the callback, a bucket at a time. This does
+ * not touch the iteration markers or finish a resize (it visits the old
+ * buckets too), so several threads can visit different tables at once.
+ */
+void
+__dinamite_ht_visit_chunks(dinamite_hashtable_t *ht,
+			   dinamite_ht_chunk_cb_t cb, void *arg) {
+
+	uint32_t i;
+
+	if(ht->ht_layout == DINAMITE_HT_SWISS) {
+		dinamite_swisstable_visit_chunks(&ht->ht_swiss, cb, arg);
+		return;
+	}
+	if(ht->ht_layout == DINAMITE_HT_ROARING) {
+		dinamite_roaring_visit_chunks(&ht->ht_roaring, cb, arg);
+		return;
+	}
+	if(ht->ht_layout == DINAMITE_HT_HLL)
+		return;
+
+	for(i = 0; i < ht->ht_num_buckets; i++) {
+		int len = __dinamite_bucket_len(ht, &ht->ht_buckets[i]);
+
+		if(len > 0)
+			cb(arg, ht->ht_buckets[i].bct_entries, len);
+	}
+
+	for(i = 0; i < ht->ht_old_num_buckets; i++) {
+		int len = __dinamite_bucket_len(ht, &ht->ht_old_buckets[i]);
+
+		if(len > 0)
+			cb(arg, ht->ht_old_buckets[i].bct_entries, len);
+	}
+}
+
+static void
+__dinamite_bloom_add_chunk(void *arg, const uint64_t *values, size_t n) {
+
+	for(size_t i = 0; i < n; i++)
+		dinamite_bloom_add((dinamite_bloom_t *) arg,
+				   dinamite_bloom_hash(values[i]));
+}
+
+/*
+ * Rebuild the Bloom filter larger once the table outgrows it. If we cannot,
+ * we keep the old one, which only makes it less selective.
+ */
+static int
+__dinamite_ht_grow_bloom(dinamite_hashtable_t *ht, uint64_t capacity) {
+
+	dinamite_bloom_t bloom;
+
+	if(dinamite_bloom_init(&bloom, capacity, ht->ht_node) != 0)
+		return -1;
+
+	__dinamite_ht_visit_chunks(ht, __dinamite_bloom_add_chunk, &bloom);
+	dinamite_bloom_free(&ht->ht_bloom);
+	ht->ht_bloom = bloom;
+	return 0;
+}
+
+/*
+ * Fill the Bloom filter with the values of the table, the first time
+ * contains() is called and after each reset. From then on, puts keep it
+ * up to date.
+ */
+static void
+__dinamite_ht_fill_bloom(dinamite_hashtable_t *ht) {
+
+	uint64_t num_entries = __dinamite_ht_num_entries(ht);
+
+	if(num_entries <= ht->ht_bloom.bf_capacity ||
+	   __dinamite_ht_grow_bloom(ht, num_entries * 4) != 0) {
+		dinamite_bloom_reset(&ht->ht_bloom);
+		__dinamite_ht_visit_chunks(ht, __dinamite_bloom_add_chunk,
+					   &ht->ht_bloom);
+	}
+	ht->ht_bloom_live = 1;
+}
+
+/*
+ * Returns 1 if the table holds the value, 0 if not, and -1 for the HLL
+ * layout, which cannot tell.
+ */
+static int
+__dinamite_ht_contains(dinamite_hashtable_t *ht, uint64_t value) {
+
+	uint64_t hash;
+
+	value &= ht->ht_gran_mask;
+
+	if(ht->ht_layout == DINAMITE_HT_HLL)
+		return -1;
+	if(ht->ht_bloom.bf_blocks != NULL) {
+		if(!ht->ht_bloom_live)
+			__dinamite_ht_fill_bloom(ht);
+		if(!dinamite_bloom_maybe(&ht->ht_bloom,
+					 dinamite_bloom_hash(value)))
+			return 0;
+	}
+
+	if(ht->ht_layout == DINAMITE_HT_SWISS)
+		return dinamite_swisstable_contains(&ht->ht_swiss, value);
+	if(ht->ht_layout == DINAMITE_HT_ROARING)
+		return dinamite_roaring_contains(&ht->ht_roaring, value);
+
+	hash = HT_HASH(ht, value);
+	if(ht->ht_old_buckets != NULL &&
+	   __dinamite_bucket_find(ht, &ht->ht_old_buckets[
+		   hash & (ht->ht_old_num_buckets - 1)], value))
+		return 1;
+	return __dinamite_bucket_find(ht, &ht->ht_buckets[
+					      hash & (ht->ht_num_buckets - 1)],
+				      value);
+}
+
+/*
+ * If we need to allocate the memory but fail, we report a warning, but continue
+ * running, so that the trace can be recorded at least partially.
+ */
+void
+dinamite_hashtable_put(uint64_t value, int threadID) {
+
+	if(__dinamite_ht_checkinit(threadID) != 0)
+		return;
+
+	if(__dinamite_ht_put(per_thread_hashtables[threadID], value) < 0)
+		fprintf(stderr, "Warning: failed to allocate memory for "
+			"the hashtable of thread %d\n", threadID);
+}
+
+/*
+ * Insert n values at once. This is faster than n calls to
+ * dinamite_hashtable_put(), because the cache misses of different values
+ * overlap.
+ */
+void
+dinamite_hashtable_put_batch(const uint64_t *values, size_t n, int threadID) {
+
+	if(__dinamite_ht_checkinit(threadID) != 0)
+		return;
+
+	if(__dinamite_ht_put_batch(per_thread_hashtables[threadID], values, n)
+	   < 0)
+		fprintf(stderr, "Warning: failed to allocate memory for "
+			"the hashtable of thread %d\n", threadID);
+}
+
+/*
+ * A call to this function resets the iteration markers for the hashtable.
+ * This function must be called every time we begin iterating the hashtable
+ * to ensure the iteration commences from the first item.
+ */
+void
+dinamite_hashtable_begin_iterate(int threadID) {
+
+	if(__dinamite_ht_checkinit(threadID) != 0)
+		return;
+
+	if(__dinamite_ht_begin_iterate(per_thread_hashtables[threadID]) != 0)
+		fprintf(stderr, "Warning: failed to finish resizing "
+			"the hashtable of thread %d\n", threadID);
+}
+
+/*
+ * This function returns the next item in the hashtable.
+ */
+int dinamite_hashtable_getnext(int threadID, uint64_t *value_ptr) {
+
+	if(__dinamite_ht_checkinit(threadID) != 0)
+		return -1;
+
+	return __dinamite_ht_getnext(per_thread_hashtables[threadID],
+				     value_ptr);
+}
+
+/*
+ * Whether the thread has put the value. A thread that has not put anything
+ * yet has no table, and we do not allocate one to say no.
+ */
+int
+dinamite_hashtable_contains(int threadID, uint64_t value) {
+
+	if(threadID < 0 || threadID > MAX_THREADS - 1)
+		return -1;
+	if(per_thread_hashtables[threadID] == NULL)
+		return 0;
+
+	return __dinamite_ht_contains(per_thread_hashtables[threadID], value);
+}
+
+/*
+ * Copy up to max values to buf, continuing the iteration. Returns the number
+ * of values copied, 0 once the iteration is over.
+ */
+size_t
+dinamite_hashtable_getnext_bulk(int threadID, uint64_t *buf, size_t max) {
+
+	if(__dinamite_ht_checkinit(threadID) != 0)
+		return 0;
+
+	return __dinamite_ht_getnext_bulk(per_thread_hashtables[threadID], buf,
+					  max);
+}
+
+/*
+ * Hand all values of the table to the visitor, a run at a time. The table
+ * must not change while we visit it.
+ */
+void
+dinamite_hashtable_visit(int threadID, dinamite_ht_visitor_t visitor,
+			 void *arg) {
+
+	if(__dinamite_ht_checkinit(threadID) != 0)
+		return;
+
+	__dinamite_ht_visit_chunks(per_thread_hashtables[threadID], visitor,
+				   arg);
+}
+
+uint64_t *
+dinamite_hashtable_sorted(int threadID, uint64_t *count) {
+
+	uint64_t *values;
+
+	*count = 0;
+	if(__dinamite_ht_checkinit(threadID) != 0)
+		return NULL;
+
+	if( (values = __dinamite_ht_sorted(per_thread_hashtables[threadID],
+					   count)) == NULL)
+		fprintf(stderr, "Warning: malloc() returned NULL when sorting "
+			"the hashtable of thread %d\n", threadID);
+	return values;
+}
+
+void dinamite_hashtable_clear(void) {
+
+	for(int i = 0; i < MAX_THREADS; i++)
+	{
+		dinamite_hashtable_t *cur_ht;
+		if( (cur_ht = per_thread_hashtables[i]) == NULL)
+			continue;
+
+		__dinamite_ht_free(cur_ht);
+		per_thread_hashtables[i] = 0;
+	}
+}
+
+/*
+ * Empty the thread's hashtable in constant time, keeping its memory for the
+ * next trace interval. Only the thread that owns the table may call this
+ * while puts are going on.
+ */
+void
+dinamite_hashtable_reset(int threadID) {
+
+	if(threadID < 0 || threadID > MAX_THREADS - 1 ||
+	   per_thread_hashtables[threadID] == NULL)
+		return;
+
+	__dinamite_ht_reset(per_thread_hashtables[threadID]);
+}
+
+/*
+ * Reset the tables of all threads. Like dinamite_hashtable_clear(), this
+ * must not run concurrently with puts.
+ */
+void
+dinamite_hashtable_reset_all(void) {
+
+	for(int i = 0; i < MAX_THREADS; i++)
+		if(per_thread_hashtables[i] != NULL)
+			__dinamite_ht_reset(per_thread_hashtables[i]);
+}
+
+/*
+ * Report the size and shape of the thread's hashtable.
+ */
+int
+dinamite_hashtable_get_stats(int threadID, dinamite_ht_stats_t *stats) {
+
+	if(__dinamite_ht_checkinit(threadID) != 0)
+		return -1;
+
+	__dinamite_ht_get_stats(per_thread_hashtables[threadID], stats);
+	return 0;
+}
+
+static uint64_t
+__dinamite_ht_distinct(dinamite_hashtable_t *ht) {
+
+	if(ht->ht_layout == DINAMITE_HT_HLL)
+		return dinamite_hll_estimate(ht->ht_hll);
+	return __dinamite_ht_num_entries(ht);
+}
+
+uint64_t
+dinamite_hashtable_distinct(int threadID) {
+
+	if(__dinamite_ht_checkinit(threadID) != 0)
+		return 0;
+
+	return __dinamite_ht_distinct(per_thread_hashtables[threadID]);
+}
+
+/*
+ * Thread-local registration. The calling thread's table is found with a
+ * single TLS load, so there is neither a thread ID to pass around nor a
+ * limit on the number of threads. A table is allocated on the first call
+ * a thread makes, registered on a global list (taking a mutex once per
+ * thread), and released when the thread exits, through the destructor of
+ * a pthread key. A thread can also release its table early by calling
+ * dinamite_hashtable_tls_release(). The thread's map, if it upserted into
+ * one, goes with its table.
+ *
+ * dinamite_hashtable_clear() does not touch these tables: they belong to
+ * live threads that may still be using them.
+ */
+static __thread dinamite_hashtable_t *tls_hashtable
+	__attribute__((tls_model("initial-exec")));
+
+static pthread_key_t tls_key;
+static pthread_once_t tls_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t tls_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static dinamite_hashtable_t *tls_list;
+static int tls_list_count;
+
+static void
+__dinamite_ht_tls_unregister(dinamite_hashtable_t *ht) {
+
+	pthread_mutex_lock(&tls_list_lock);
+	if(ht->ht_tls_prev != NULL)
+		ht->ht_tls_prev->ht_tls_next = ht->ht_tls_next;
+	else
+		tls_list = ht->ht_tls_next;
+	if(ht->ht_tls_next != NULL)
+		ht->ht_tls_next->ht_tls_prev = ht->ht_tls_prev;
+	tls_list_count--;
+	pthread_mutex_unlock(&tls_list_lock);
+}
+
+static void
+__dinamite_ht_tls_destructor(void *arg) {
+
+	dinamite_hashtable_t *ht = (dinamite_hashtable_t *) arg;
+
+	__dinamite_ht_tls_unregister(ht);
+	if(ht->ht_tls_map != NULL)
+		__dinamite_map_release(ht->ht_tls_map);
+	__dinamite_ht_free(ht);
+	tls_hashtable = NULL;
+}
+
+static void
+__dinamite_ht_tls_key_create(void) {
+
+	if(pthread_key_create(&tls_key, __dinamite_ht_tls_destructor) != 0)
+		fprintf(stderr, "Warning: could not create the pthread key "
+			"for thread-local hashtables; they will not be "
+			"released at thread exit\n");
+}
+
+static dinamite_hashtable_t *
+__dinamite_ht_tls_init(void) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_alloc()) == NULL) {
+		fprintf(stderr, "Warning: malloc() returned NULL when "
+			"allocating a thread-local hashtable\n");
+		return NULL;
+	}
+
+	ht->ht_thread_id = -1;
+	pthread_once(&tls_key_once, __dinamite_ht_tls_key_create);
+	pthread_setspecific(tls_key, ht);
+
+	pthread_mutex_lock(&tls_list_lock);
+	ht->ht_tls_next = tls_list;
+	if(tls_list != NULL)
+		tls_list->ht_tls_prev = ht;
+	tls_list = ht;
+	tls_list_count++;
+	pthread_mutex_unlock(&tls_list_lock);
+
+	tls_hashtable = ht;
+	return ht;
+}
+
+static inline dinamite_hashtable_t *
+__dinamite_ht_tls_get(void) {
+
+	dinamite_hashtable_t *ht = tls_hashtable;
+
+	if(ht == NULL)
+		ht = __dinamite_ht_tls_init();
+	return ht;
+}
+
+dinamite_map_t **
+__dinamite_ht_tls_map_slot(void) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return NULL;
+	return &ht->ht_tls_map;
+}
+
+dinamite_map_t *
+__dinamite_ht_tls_map(void) {
+
+	return tls_hashtable != NULL ? tls_hashtable->ht_tls_map : NULL;
+}
+
+void
+dinamite_hashtable_tls_put(uint64_t value) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return;
+
+	if(__dinamite_ht_put(ht, value) < 0)
+		fprintf(stderr, "Warning: failed to allocate memory for "
+			"a thread-local hashtable\n");
+}
+
+void
+dinamite_hashtable_tls_put_batch(const uint64_t *values, size_t n) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return;
+
+	if(__dinamite_ht_put_batch(ht, values, n) < 0)
+		fprintf(stderr, "Warning: failed to allocate memory for "
+			"a thread-local hashtable\n");
+}
+
+void
+dinamite_hashtable_tls_begin_iterate(void) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return;
+
+	if(__dinamite_ht_begin_iterate(ht) != 0)
+		fprintf(stderr, "Warning: failed to finish resizing "
+			"a thread-local hashtable\n");
+}
+
+int
+dinamite_hashtable_tls_getnext(uint64_t *value_ptr) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return -1;
+
+	return __dinamite_ht_getnext(ht, value_ptr);
+}
+
+int
+dinamite_hashtable_tls_contains(uint64_t value) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return -1;
+
+	return __dinamite_ht_contains(ht, value);
+}
+
+size_t
+dinamite_hashtable_tls_getnext_bulk(uint64_t *buf, size_t max) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return 0;
+
+	return __dinamite_ht_getnext_bulk(ht, buf, max);
+}
+
+void
+dinamite_hashtable_tls_visit(dinamite_ht_visitor_t visitor, void *arg) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return;
+
+	__dinamite_ht_visit_chunks(ht, visitor, arg);
+}
+
+uint64_t *
+dinamite_hashtable_tls_sorted(uint64_t *count) {
+
+	dinamite_hashtable_t *ht;
+	uint64_t *values;
+
+	*count = 0;
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return NULL;
+
+	if( (values = __dinamite_ht_sorted(ht, count)) == NULL)
+		fprintf(stderr, "Warning: malloc() returned NULL when sorting "
+			"a thread-local hashtable\n");
+	return values;
+}
+
+int
+dinamite_hashtable_tls_get_stats(dinamite_ht_stats_t *stats) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return -1;
+
+	__dinamite_ht_get_stats(ht, stats);
+	return 0;
+}
+
+uint64_t
+dinamite_hashtable_tls_distinct(void) {
+
+	dinamite_hashtable_t *ht;
+
+	if( (ht = __dinamite_ht_tls_get()) == NULL)
+		return 0;
+
+	return __dinamite_ht_distinct(ht);
+}
+
+void
+dinamite_hashtable_tls_reset(void) {
+
+	if(tls_hashtable != NULL)
+		__dinamite_ht_reset(tls_hashtable);
+}
+
+void
+dinamite_hashtable_tls_release(void) {
+
+	dinamite_hashtable_t *ht = tls_hashtable;
+
+	if(ht == NULL)
+		return;
+
+	pthread_setspecific(tls_key, NULL);
+	__dinamite_ht_tls_destructor(ht);
+}
+
+/*
+ * The number of live thread-local tables.
+ */
+int
+dinamite_hashtable_tls_count(void) {
+
+	int count;
+
+	pthread_mutex_lock(&tls_list_lock);
+	count = tls_list_count;
+	pthread_mutex_unlock(&tls_list_lock);
+	return count;
+}
+
+/*
+ * Return a malloc'd array with every live table: those indexed by thread ID
+ * followed by the thread-local ones. The caller must make sure that no
+ * thread-local table is released while it uses the array.
+ */
+dinamite_hashtable_t **
+__dinamite_ht_all_tables(int *count) {
+
+	dinamite_hashtable_t **tables, *ht;
+	int i, n = 0;
+
+	pthread_mutex_lock(&tls_list_lock);
+
+	tables = (dinamite_hashtable_t **)
+		malloc(sizeof(dinamite_hashtable_t *) *
+		       (MAX_THREADS + tls_list_count));
+	if(tables != NULL) {
+		for(i = 0; i < MAX_THREADS; i++)
+			if(per_thread_hashtables[i] != NULL)
+				tables[n++] = per_thread_hashtables[i];
+		for(ht = tls_list; ht != NULL; ht = ht->ht_tls_next)
+			tables[n++] = ht;
+	}
+
+	pthread_mutex_unlock(&tls_list_lock);
+
+	*count = n;
+	return tables;
+}
+
+/* The settings that a newly allocated table would capture */
+void
+__dinamite_ht_settings(int *hash, uint64_t *gran_mask) {
+
+	*hash = ht_hash;
+	*gran_mask = ht_gran_mask;
+}
+
+static void
+__dinamite_hll_put_chunk(void *arg, const uint64_t *values, size_t n) {
+
+	for(size_t i = 0; i < n; i++)
+		dinamite_hll_put((dinamite_hll_t *) arg, values[i]);
+}
+
+/*
+ * Sketches merge register by register. The values of exact tables go
+ * through a sketch too, so that a value seen by several threads, whatever
+ * their layouts, is counted once.
+ */
+uint64_t
+dinamite_hashtable_distinct_all(void) {
+
+	dinamite_hashtable_t **tables;
+	dinamite_hll_t *all;
+	uint64_t estimate;
+	int i, num_tables;
+
+	tables = __dinamite_ht_all_tables(&num_tables);
+	if(tables == NULL || (all = dinamite_hll_alloc()) == NULL) {
+		fprintf(stderr, "Warning: malloc() returned NULL when "
+			"counting distinct values\n");
+		free(tables);
+		return 0;
+	}
+
+	for(i = 0; i < num_tables; i++) {
+		if(tables[i]->ht_layout == DINAMITE_HT_HLL)
+			dinamite_hll_merge(all, tables[i]->ht_hll);
+		else
+			__dinamite_ht_visit_chunks(tables[i],
+						   __dinamite_hll_put_chunk,
+						   all);
+	}
+
+	estimate = dinamite_hll_estimate(all);
+	free(all);
+	free(tables);
+	return estimate;
+}
+
+/*
+ * The node-local drain: one worker per NUMA node that has tables, running
+ * on that node's CPUs. Tables that are not placed go to the nodes in turn.
+ */
+typedef struct numa_drain {
+	pthread_t nd_tid;
+	int nd_node;
+	int nd_num_nodes;
+	dinamite_hashtable_t **nd_tables;
+	int nd_num_tables;
+	dinamite_ht_stream_cb_t nd_cb;
+	void *nd_arg;
+	int nd_reset;
+	int nd_has_tables;
+	int nd_move;               /* Run on the node's CPUs */
+	int nd_thread_id;          /* Of the table being visited */
+} numa_drain_t;
+
+static int
+__dinamite_drain_node(dinamite_hashtable_t *ht, int i, int num_nodes) {
+
+	return (ht->ht_node >= 0 ? ht->ht_node : i) % num_nodes;
+}
+
+static void
+__dinamite_drain_chunk(void *arg, const uint64_t *values, size_t n) {
+
+	numa_drain_t *d = (numa_drain_t *) arg;
+
+	d->nd_cb(d->nd_arg, d->nd_thread_id, values, n);
+}
+
+static void *
+__dinamite_drain_worker(void *arg) {
+
+	numa_drain_t *d = (numa_drain_t *) arg;
+
+	/* If we cannot move there, we still do the work */
+	if(d->nd_move)
+		__dinamite_numa_run_on_node(d->nd_node);
+
+	for(int i = 0; i < d->nd_num_tables; i++) {
+		dinamite_hashtable_t *ht = d->nd_tables[i];
+
+		if(__dinamite_drain_node(ht, i, d->nd_num_nodes) != d->nd_node)
+			continue;
+		d->nd_thread_id = ht->ht_thread_id;
+		__dinamite_ht_visit_chunks(ht, __dinamite_drain_chunk, d);
+		if(d->nd_reset)
+			__dinamite_ht_reset(ht);
+	}
+	return NULL;
+}
+
+/*
+ * If we cannot start a worker, the calling thread does its share once the
+ * others are done, without moving to its node.
+ */
+int
+dinamite_hashtable_drain_numa(dinamite_ht_stream_cb_t cb, void *arg,
+			      int reset) {
+
+	dinamite_hashtable_t **tables;
+	numa_drain_t *drains;
+	int i, num_tables, num_nodes = __dinamite_numa_num_nodes();
+
+	tables = __dinamite_ht_all_tables(&num_tables);
+	drains = (numa_drain_t *) calloc(num_nodes, sizeof(numa_drain_t));
+	if(tables == NULL || drains == NULL) {
+		fprintf(stderr, "Warning: malloc() returned NULL when "
+			"draining the hashtables\n");
+		free(tables);
+		free(drains);
+		return -1;
+	}
+
+	for(i = 0; i < num_nodes; i++) {
+		drains[i].nd_node = i;
+		drains[i].nd_num_nodes = num_nodes;
+		drains[i].nd_tables = tables;
+		drains[i].nd_num_tables = num_tables;
+		drains[i].nd_cb = cb;
+		drains[i].nd_arg = arg;
+		drains[i].nd_reset = reset;
+		drains[i].nd_move = 1;
+	}
+	for(i = 0; i < num_tables; i++)
+		drains[__dinamite_drain_node(tables[i], i, num_nodes)]
+			.nd_has_tables = 1;
+
+	for(i = 0; i < num_nodes; i++) {
+		if(!drains[i].nd_has_tables)
+			continue;
+		if(pthread_create(&drains[i].nd_tid, NULL,
+				  __dinamite_drain_worker, &drains[i]) != 0) {
+			drains[i].nd_move = 0;
+			drains[i].nd_tid = pthread_self();
+		}
+	}
+	for(i = 0; i < num_nodes; i++) {
+		if(!drains[i].nd_has_tables)
+			continue;
+		if(!drains[i].nd_move)
+			__dinamite_drain_worker(&drains[i]);
+		else
+			pthread_join(drains[i].nd_tid, NULL);
+	}
+
+	free(drains);
+	free(tables);
+	return 0;
 }
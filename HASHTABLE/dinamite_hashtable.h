@@ -4,14 +4,280 @@
 #include <sys/types.h>
 #include <inttypes.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  * A hashtable with per-thread paritions and dynamically sized buckets.
+ * The number of buckets grows with the number of entries; entries are moved
+ * to the larger bucket array incrementally, by the puts that follow.
  * The hashtable behaves like a set: duplicate items are discarded.
  * The hashtable stores unsigned 64-bit values.
  */
+
+/*
+ * Table layouts. The chained layout hashes values into dynamically sized
+ * buckets that are scanned linearly. The swiss layout is
+ * an open-addressing table probed a group of slots at a time with SIMD
+ * instructions. The roaring layout trades put speed for memory: it keeps
+ * values that share their top 48 bits together, in a sorted array of their
+ * low 16 bits or a bitmap, which takes a few times less memory than 8 bytes
+ * per value for clustered addresses. All are used through the same
+ * put/iterate/clear API.
+ *
+ * The HLL layout does not keep the values at all, only a HyperLogLog sketch
+ * of 4KB per table that estimates how many distinct values were put, within
+ * a few percent. Its tables iterate as empty; read the estimate with
+ * dinamite_hashtable_distinct() or in the stats.
+ */
+#define DINAMITE_HT_CHAINED 0
+#define DINAMITE_HT_SWISS   1
+#define DINAMITE_HT_ROARING 2
+#define DINAMITE_HT_HLL     3
+
+int dinamite_hashtable_set_layout(int layout);
+
+/*
+ * Hash families. The page hash is the original one: it only looks at
+ * address bits 12-31, so all pointers within a page share a bucket. The
+ * others mix all 64 bits. Like the layout, the hash family and the
+ * granularity are captured by each table when it is allocated.
+ */
+#define DINAMITE_HT_HASH_PAGE     0
+#define DINAMITE_HT_HASH_MULSHIFT 1
+#define DINAMITE_HT_HASH_MURMUR   2
+#define DINAMITE_HT_HASH_WYMIX    3
+
+int dinamite_hashtable_set_hash(int hash);
+
+/*
+ * Key granularity, as the number of low address bits to ignore. Values are
+ * rounded down to the granule before they are stored, so the table records
+ * distinct cache lines or pages rather than distinct addresses.
+ */
+#define DINAMITE_HT_GRAN_BYTE      0
+#define DINAMITE_HT_GRAN_CACHELINE 6
+#define DINAMITE_HT_GRAN_PAGE      12
+
+int dinamite_hashtable_set_granularity(unsigned shift);
+
+/*
+ * An optional Bloom filter in front of each table, captured like the layout
+ * when a table is allocated. Lookups of values the table has never seen
+ * then skip the search of their bucket or group. Puts do not consult it;
+ * it is filled by the first lookup and kept up to date from then on.
+ */
+void dinamite_hashtable_set_bloom(int enable);
+
+/*
+ * Place each table's memory on the NUMA node where its thread runs when the
+ * table is allocated, or not (the default). Captured like the layout.
+ */
+void dinamite_hashtable_set_numa(int enable);
+
+/*
+ * Size and shape of one thread's table, to check that it stays flat.
+ * hts_len_hist[0] counts empty buckets and hts_len_hist[i] counts buckets
+ * whose length is in [2^(i-1), 2^i); the last slot also takes everything
+ * longer. For the swiss layout, buckets are slots and lengths are probe
+ * lengths in groups; for the roaring layout, buckets are containers; for
+ * the HLL layout, buckets are registers and hts_entries is the estimate.
+ * hts_memory is the memory the table holds, in bytes. hts_node is the
+ * NUMA node the table is placed on, -1 if it is not, and hts_remote_pages
+ * counts its pages that are on another node all the same.
+ */
+#define DINAMITE_HT_HIST_BUCKETS 16
+
+typedef struct __dinamite_ht_stats {
+	uint64_t hts_entries;
+	uint64_t hts_buckets;
+	double hts_load_factor;       /* Entries per bucket */
+	uint64_t hts_nonempty_buckets;
+	uint64_t hts_max_len;
+	uint64_t hts_len_hist[DINAMITE_HT_HIST_BUCKETS];
+	int hts_resizing;             /* Entries are still being migrated */
+	uint64_t hts_memory;
+	int hts_node;
+	uint64_t hts_remote_pages;
+} dinamite_ht_stats_t;
+
+int dinamite_hashtable_get_stats(int threadID, dinamite_ht_stats_t *stats);
 void dinamite_hashtable_put(uint64_t value, int threadID);
+void dinamite_hashtable_put_batch(const uint64_t *values, size_t n,
+				  int threadID);
 void dinamite_hashtable_begin_iterate(int threadID);
 int dinamite_hashtable_getnext(int threadID, uint64_t *value_ptr);
 void dinamite_hashtable_clear(void);
 
+/*
+ * Returns 1 if the thread has put the value (rounded to the granularity),
+ * 0 if not, and -1 if the thread ID is out of range or the table has the
+ * HLL layout, which cannot tell.
+ */
+int dinamite_hashtable_contains(int threadID, uint64_t value);
+
+/*
+ * The number of distinct values put into the thread's table: exact for
+ * the layouts that keep the values, an estimate for the HLL layout.
+ * distinct_all() estimates the number of distinct values over all tables,
+ * per-thread and thread-local, of any layout; it must not run concurrently
+ * with puts.
+ */
+uint64_t dinamite_hashtable_distinct(int threadID);
+uint64_t dinamite_hashtable_distinct_all(void);
+
+/*
+ * Faster ways to drain a table. getnext_bulk continues the iteration
+ * started by begin_iterate, copying up to max values per call; it returns
+ * the number of values copied, 0 at the end. A visitor gets all values in
+ * one pass, a run at a time, without touching the iteration. sorted returns
+ * all values in ascending order, in an array that the caller frees, and
+ * their number in *count; it returns NULL if we run out of memory.
+ */
+typedef void (*dinamite_ht_visitor_t)(void *arg, const uint64_t *values,
+				      size_t n);
+
+size_t dinamite_hashtable_getnext_bulk(int threadID, uint64_t *buf,
+				       size_t max);
+void dinamite_hashtable_visit(int threadID, dinamite_ht_visitor_t visitor,
+			      void *arg);
+uint64_t *dinamite_hashtable_sorted(int threadID, uint64_t *count);
+
+/*
+ * Empty tables in constant time, for tracing in intervals. Unlike
+ * dinamite_hashtable_clear(), a table keeps its memory, so the next
+ * interval does not have to allocate it again. A thread can reset its own
+ * table while the others keep going; dinamite_hashtable_reset_all() must
+ * not run concurrently with puts.
+ */
+void dinamite_hashtable_reset(int threadID);
+void dinamite_hashtable_reset_all(void);
+
+/*
+ * Merge the tables of all threads, both those indexed by thread ID and the
+ * thread-local ones, into one process-wide set, using num_workers threads.
+ * The tables must not change while the merge runs; they are left intact.
+ * The merged set is iterated like a per-thread table and lives until the
+ * next merge or dinamite_hashtable_merged_clear().
+ */
+int dinamite_hashtable_merge(int num_workers);
+uint64_t dinamite_hashtable_merged_size(void);
+void dinamite_hashtable_merged_begin_iterate(void);
+int dinamite_hashtable_merged_getnext(uint64_t *value_ptr);
+size_t dinamite_hashtable_merged_getnext_bulk(uint64_t *buf, size_t max);
+void dinamite_hashtable_merged_visit(dinamite_ht_visitor_t visitor,
+				     void *arg);
+uint64_t *dinamite_hashtable_merged_sorted(uint64_t *count);
+void dinamite_hashtable_merged_clear(void);
+
+/*
+ * Stream the values the tables insert, as they are inserted, to a callback
+ * on a background thread, for consumers that want the set as it grows
+ * rather than once tracing ends. Each table pushes the values it has not
+ * seen before into a ring of its own; the callback gets them in batches,
+ * with the thread ID of the table (-1 for thread-local tables). Puts never
+ * wait for the consumer: when a ring is full, the value is only counted as
+ * dropped, and it stays in the table. HLL tables stream nothing.
+ *
+ * stream_to_file writes records of a 32-bit thread ID and a 32-bit count,
+ * followed by that many 64-bit values. stream_stop hands over what the
+ * rings still hold before it returns.
+ */
+typedef void (*dinamite_ht_stream_cb_t)(void *arg, int threadID,
+					const uint64_t *values, size_t n);
+
+int dinamite_hashtable_stream_start(dinamite_ht_stream_cb_t cb, void *arg);
+int dinamite_hashtable_stream_to_file(const char *path);
+int dinamite_hashtable_stream_stop(void);
+void dinamite_hashtable_stream_stats(uint64_t *streamed, uint64_t *dropped);
+
+/*
+ * Drain all tables, per-thread and thread-local, with a thread per NUMA
+ * node that runs on that node and visits the tables placed there, so that
+ * no table is read across the interconnect; tables that are not placed are
+ * spread over the nodes. cb gets the values of each table a run at a time,
+ * with the table's thread ID, as for streaming, but from several threads
+ * at once. With reset, each table is also reset, by its node's thread. The
+ * tables must not change while this runs. Returns -1 if we run out of
+ * memory.
+ */
+int dinamite_hashtable_drain_numa(dinamite_ht_stream_cb_t cb, void *arg,
+				  int reset);
+
+/*
+ * Per-thread maps from a 64-bit key to a fixed-size payload, for attaching
+ * data to each address (a size, a timestamp, a counter) in a single lookup.
+ * The payload is stored inline after its key. Upsert returns a pointer to
+ * the payload, zeroed if the key is new, which the caller updates in place;
+ * the pointer stays valid until the thread's next upsert of a new key.
+ * Iteration returns each key with a pointer to its payload.
+ *
+ * All maps have the same payload size, 8 bytes unless set before the first
+ * upsert or after dinamite_hashtable_map_clear(). The maps use the hash
+ * family and granularity in effect when they are allocated, and the same
+ * thread IDs as the sets.
+ *
+ * Threads that cannot provide such IDs use the dinamite_hashtable_tls_map_*
+ * functions, declared with the other thread-local ones below.
+ */
+int dinamite_hashtable_map_set_payload(size_t size);
+void *dinamite_hashtable_map_upsert(uint64_t key, int threadID,
+				    int *inserted);
+void *dinamite_hashtable_map_find(uint64_t key, int threadID);
+uint64_t dinamite_hashtable_map_size(int threadID);
+void dinamite_hashtable_map_begin_iterate(int threadID);
+int dinamite_hashtable_map_getnext(int threadID, uint64_t *key_ptr,
+				   void **payload_ptr);
+void dinamite_hashtable_map_clear(void);
+
+/*
+ * A single set shared by all threads, for when only the process-wide set of
+ * values is needed. Any number of threads can put concurrently, without
+ * locks, and there is no thread ID or merge step. Like the merged set, it
+ * is read back only once the puts have stopped, and it lives until
+ * dinamite_hashtable_shared_clear(). It takes the hash family and the
+ * granularity in effect when it is first used.
+ */
+void dinamite_hashtable_shared_put(uint64_t value);
+uint64_t dinamite_hashtable_shared_size(void);
+void dinamite_hashtable_shared_begin_iterate(void);
+int dinamite_hashtable_shared_getnext(uint64_t *value_ptr);
+void dinamite_hashtable_shared_clear(void);
+
+/*
+ * The same operations on the calling thread's own table, found through
+ * thread-local storage instead of a thread ID. There is no limit on the
+ * number of threads; each thread's table is released when the thread
+ * exits or calls dinamite_hashtable_tls_release().
+ */
+void dinamite_hashtable_tls_put(uint64_t value);
+void dinamite_hashtable_tls_put_batch(const uint64_t *values, size_t n);
+void dinamite_hashtable_tls_begin_iterate(void);
+int dinamite_hashtable_tls_getnext(uint64_t *value_ptr);
+size_t dinamite_hashtable_tls_getnext_bulk(uint64_t *buf, size_t max);
+void dinamite_hashtable_tls_visit(dinamite_ht_visitor_t visitor, void *arg);
+uint64_t *dinamite_hashtable_tls_sorted(uint64_t *count);
+int dinamite_hashtable_tls_get_stats(dinamite_ht_stats_t *stats);
+uint64_t dinamite_hashtable_tls_distinct(void);
+int dinamite_hashtable_tls_contains(uint64_t value);
+void dinamite_hashtable_tls_reset(void);
+void dinamite_hashtable_tls_release(void);
+int dinamite_hashtable_tls_count(void);
+
+/*
+ * The calling thread's own map, found the same way. It is released with
+ * the thread's table, and the payload size cannot change while any exists;
+ * dinamite_hashtable_map_clear() does not touch it.
+ */
+void *dinamite_hashtable_tls_map_upsert(uint64_t key, int *inserted);
+void *dinamite_hashtable_tls_map_find(uint64_t key);
+uint64_t dinamite_hashtable_tls_map_size(void);
+void dinamite_hashtable_tls_map_begin_iterate(void);
+int dinamite_hashtable_tls_map_getnext(uint64_t *key_ptr, void **payload_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
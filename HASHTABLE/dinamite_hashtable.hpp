@@ -0,0 +1,417 @@
+#ifndef DINAMITE_HASHTABLE_HPP
+#define DINAMITE_HASHTABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "dinamite_ht_hash.h"
+
+/*
+ * The chained hashtable as a header-only C++ template, for callers that want
+ * its parameters fixed at compile time: the key type, the hash, the initial
+ * number of buckets and when to grow. The sizes derived from them are
+ * constants, so the bucket scans are generated for the key width: with
+ * 32-bit keys, such as offsets into a region, a bucket holds twice as many
+ * keys per cache line and a vector compare checks twice as many at once.
+ *
+ * Like the C layout, a table is a set. Each bucket is an array of keys that
+ * doubles when full, and the number of buckets doubles when the growth
+ * policy says so. Unlike the C layout, the buckets are rehashed all at once.
+ * A table belongs to one thread; per_thread<> gives each thread its own, as
+ * the C API does, and c_hashtable is the instantiation with the parameters
+ * of the C API's chained layout.
+ */
+namespace dinamite {
+
+/* Hash policies, the hash families of dinamite_ht_hash.h */
+struct page_hash {
+	static uint64_t hash(uint64_t key) { return __dinamite_hash_page(key); }
+};
+
+struct mulshift_hash {
+	static uint64_t hash(uint64_t key) {
+		return __dinamite_hash_mulshift(key);
+	}
+};
+
+struct murmur_hash {
+	static uint64_t hash(uint64_t key) {
+		return __dinamite_hash_murmur(key);
+	}
+};
+
+struct wymix_hash {
+	static uint64_t hash(uint64_t key) { return __dinamite_hash_wymix(key); }
+};
+
+/*
+ * Growth policies. grow_at_load doubles the buckets once they hold more
+ * than MaxLoad keys on average, like HT_MAX_LOAD_FACTOR; grow_never keeps
+ * the initial number, for tables whose size is known in advance.
+ */
+template<unsigned MaxLoad>
+struct grow_at_load {
+	static_assert(MaxLoad > 0, "the load factor must be positive");
+	static constexpr bool must_grow(uint64_t keys, uint64_t buckets) {
+		return keys > buckets * MaxLoad;
+	}
+};
+
+struct grow_never {
+	static constexpr bool must_grow(uint64_t, uint64_t) { return false; }
+};
+
+namespace detail {
+
+#if defined(__AVX2__)
+constexpr std::size_t vector_bytes = 32;
+#elif defined(__SSE2__)
+constexpr std::size_t vector_bytes = 16;
+#else
+constexpr std::size_t vector_bytes = sizeof(uint64_t);
+#endif
+
+/*
+ * A bit per key of the vector at keys that equals key. The vector may run
+ * past the keys in use, but not past the array, which is a whole number of
+ * vectors.
+ */
+template<class Key>
+static inline unsigned
+match(const Key *keys, Key key) {
+
+#if defined(__AVX2__)
+	__m256i v = _mm256_loadu_si256((const __m256i *)keys);
+
+	if constexpr (sizeof(Key) == 4)
+		return (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(
+			_mm256_cmpeq_epi32(v, _mm256_set1_epi32((int)key))));
+	else
+		return (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(
+			_mm256_cmpeq_epi64(v,
+					   _mm256_set1_epi64x((long long)key))));
+#elif defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *)keys);
+
+	if constexpr (sizeof(Key) == 4)
+		return (unsigned)_mm_movemask_ps(_mm_castsi128_ps(
+			_mm_cmpeq_epi32(v, _mm_set1_epi32((int)key))));
+	else {
+		/* No 64-bit compare before SSE4.1: both halves must match */
+		__m128i eq = _mm_cmpeq_epi32(v,
+					     _mm_set1_epi64x((long long)key));
+
+		eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, 0xb1));
+		return (unsigned)_mm_movemask_pd(_mm_castsi128_pd(eq));
+	}
+#else
+	unsigned mask = 0;
+
+	for(std::size_t i = 0; i < vector_bytes / sizeof(Key); i++)
+		mask |= (unsigned)(keys[i] == key) << i;
+	return mask;
+#endif
+}
+
+} /* namespace detail */
+
+template<class Key = uint64_t, class Hash = mulshift_hash,
+	 std::size_t Buckets = 512, class Growth = grow_at_load<4>>
+class hashtable {
+
+	static_assert(std::is_same<Key, uint32_t>::value ||
+		      std::is_same<Key, uint64_t>::value,
+		      "keys are 32-bit or 64-bit unsigned integers");
+	static_assert(Buckets > 0 && (Buckets & (Buckets - 1)) == 0,
+		      "the number of buckets must be a power of two");
+
+public:
+	typedef Key key_type;
+
+	/*
+	 * Keys per vector compare, and per bucket to begin with: as many as
+	 * INIT_BUCKET_SIZE, so that 32-bit buckets take half the memory.
+	 */
+	static constexpr std::size_t lanes = detail::vector_bytes / sizeof(Key);
+	static constexpr std::size_t init_bucket_keys = (8 > lanes) ? 8 : lanes;
+	static_assert(init_bucket_keys % lanes == 0,
+		      "buckets must hold whole vectors");
+
+	hashtable() {}
+	hashtable(const hashtable &) = delete;
+	hashtable &operator=(const hashtable &) = delete;
+	~hashtable() { release(); }
+
+	/*
+	 * Returns 1 if the key was inserted, 0 if it was already there and -1
+	 * if we failed to allocate memory.
+	 */
+	int put(Key key) {
+
+		if(buckets_ == nullptr && alloc_buckets(Buckets) != 0)
+			return -1;
+
+		bucket *b = &buckets_[index(key)];
+
+		if(find(b, key))
+			return 0;
+		if(b->num == b->max && grow_bucket(b) != 0)
+			return -1;
+		b->keys[b->num++] = key;
+		num_keys_++;
+
+		/* If we cannot grow, the buckets just get longer */
+		if(Growth::must_grow(num_keys_, mask_ + 1))
+			rehash();
+		return 1;
+	}
+
+	bool contains(Key key) const {
+
+		return buckets_ != nullptr && find(&buckets_[index(key)], key);
+	}
+
+	uint64_t size() const { return num_keys_; }
+	uint64_t num_buckets() const { return buckets_ ? mask_ + 1 : 0; }
+
+	/* The memory the table holds, in bytes */
+	uint64_t memory() const {
+
+		uint64_t bytes = 0;
+
+		for(uint64_t i = 0; buckets_ && i <= mask_; i++)
+			bytes += sizeof(bucket) + buckets_[i].max * sizeof(Key);
+		return bytes;
+	}
+
+	/* Hand all keys to f(const Key *keys, size_t n), a bucket at a time */
+	template<class F>
+	void visit(F f) const {
+
+		for(uint64_t i = 0; buckets_ && i <= mask_; i++)
+			if(buckets_[i].num > 0)
+				f((const Key *)buckets_[i].keys,
+				  (std::size_t)buckets_[i].num);
+	}
+
+	void begin_iterate() { iter_bucket_ = 0; iter_pos_ = 0; }
+
+	int getnext(Key *key_ptr) {
+
+		for(; buckets_ && iter_bucket_ <= mask_; iter_bucket_++,
+			    iter_pos_ = 0)
+			if(iter_pos_ < buckets_[iter_bucket_].num) {
+				*key_ptr =
+					buckets_[iter_bucket_].keys[iter_pos_++];
+				return 0;
+			}
+		return -1;
+	}
+
+	/* Empty the table, keeping its memory */
+	void reset() {
+
+		for(uint64_t i = 0; buckets_ && i <= mask_; i++)
+			buckets_[i].num = 0;
+		num_keys_ = 0;
+		begin_iterate();
+	}
+
+private:
+	struct bucket {
+		Key *keys;
+		uint32_t num;
+		uint32_t max;
+	};
+
+	bucket *buckets_ = nullptr;
+	uint64_t mask_ = 0;
+	uint64_t num_keys_ = 0;
+	uint64_t iter_bucket_ = 0;
+	uint32_t iter_pos_ = 0;
+
+	uint64_t index(Key key) const {
+
+		return Hash::hash((uint64_t)key) & mask_;
+	}
+
+	static bool find(const bucket *b, Key key) {
+
+		for(uint32_t i = 0; i < b->num; i += lanes) {
+			unsigned mask = detail::match(b->keys + i, key);
+
+			/* Lanes past the last key hold garbage */
+			if(b->num - i < lanes)
+				mask &= (1u << (b->num - i)) - 1;
+			if(mask != 0)
+				return true;
+		}
+		return false;
+	}
+
+	int alloc_buckets(uint64_t n) {
+
+		if( (buckets_ = (bucket *) std::calloc(n, sizeof(bucket)))
+		    == nullptr)
+			return -1;
+		mask_ = n - 1;
+		return 0;
+	}
+
+	static int grow_bucket(bucket *b) {
+
+		uint32_t max = b->max ? b->max * 2 : (uint32_t)init_bucket_keys;
+		Key *keys = (Key *) std::realloc(b->keys, max * sizeof(Key));
+
+		if(keys == nullptr)
+			return -1;
+		b->keys = keys;
+		b->max = max;
+		return 0;
+	}
+
+	/*
+	 * Double the buckets. The keys are distinct, so they are appended
+	 * without a search; each new bucket is sized for its keys up front.
+	 */
+	void rehash() {
+
+		bucket *old = buckets_;
+		uint64_t old_num = mask_ + 1, i;
+
+		if(alloc_buckets(old_num * 2) != 0) {
+			buckets_ = old;
+			mask_ = old_num - 1;
+			return;
+		}
+		for(i = 0; i < old_num; i++)
+			for(uint32_t j = 0; j < old[i].num; j++)
+				buckets_[index(old[i].keys[j])].num++;
+		for(i = 0; i <= mask_; i++) {
+			uint32_t max = (uint32_t)init_bucket_keys;
+
+			while(max < buckets_[i].num)
+				max *= 2;
+			buckets_[i].keys = (Key *) std::malloc(max * sizeof(Key));
+			buckets_[i].max = max;
+			buckets_[i].num = 0;
+			if(buckets_[i].keys == nullptr) {
+				/* Put everything back the way it was */
+				for(uint64_t k = 0; k < i; k++)
+					std::free(buckets_[k].keys);
+				std::free(buckets_);
+				buckets_ = old;
+				mask_ = old_num - 1;
+				return;
+			}
+		}
+		for(i = 0; i < old_num; i++) {
+			for(uint32_t j = 0; j < old[i].num; j++) {
+				bucket *b = &buckets_[index(old[i].keys[j])];
+
+				b->keys[b->num++] = old[i].keys[j];
+			}
+			std::free(old[i].keys);
+		}
+		std::free(old);
+		begin_iterate();
+	}
+
+	void release() {
+
+		for(uint64_t i = 0; buckets_ && i <= mask_; i++)
+			std::free(buckets_[i].keys);
+		std::free(buckets_);
+		buckets_ = nullptr;
+		num_keys_ = 0;
+	}
+};
+
+/*
+ * A table per thread, indexed by a small thread ID, allocated on the
+ * thread's first put. The operations mirror those of the C API.
+ */
+template<class Table, int MaxThreads = 128>
+class per_thread {
+
+	static_assert(MaxThreads > 0, "there must be room for a thread");
+
+public:
+	typedef typename Table::key_type key_type;
+	static constexpr int max_threads = MaxThreads;
+
+	/* The thread's table, allocated if need be; nullptr if we cannot */
+	Table *table(int threadID) {
+
+		if(threadID < 0 || threadID > MaxThreads - 1) {
+			std::fprintf(stderr, "Warning: threadID %d is greater "
+				     "than the MAX_THREADS value of %d. "
+				     "Hashtable could not be allocated. \n",
+				     threadID, MaxThreads);
+			return nullptr;
+		}
+		if(!tables_[threadID])
+			tables_[threadID].reset(new (std::nothrow) Table());
+		return tables_[threadID].get();
+	}
+
+	int put(key_type key, int threadID) {
+
+		Table *t = table(threadID);
+
+		return t ? t->put(key) : -1;
+	}
+
+	void begin_iterate(int threadID) {
+
+		if(Table *t = find(threadID))
+			t->begin_iterate();
+	}
+
+	int getnext(int threadID, key_type *key_ptr) {
+
+		Table *t = find(threadID);
+
+		return t ? t->getnext(key_ptr) : -1;
+	}
+
+	/* Free all tables */
+	void clear() {
+
+		for(int i = 0; i < MaxThreads; i++)
+			tables_[i].reset();
+	}
+
+private:
+	std::unique_ptr<Table> tables_[MaxThreads];
+
+	Table *find(int threadID) {
+
+		if(threadID < 0 || threadID > MaxThreads - 1)
+			return nullptr;
+		return tables_[threadID].get();
+	}
+};
+
+/*
+ * The parameters of the C API's chained layout: 64-bit keys, the default
+ * multiply-shift hash, HT_NUMBUCKETS buckets to begin with, growth at
+ * HT_MAX_LOAD_FACTOR and MAX_THREADS threads.
+ */
+typedef per_thread<hashtable<uint64_t, mulshift_hash, 512,
+			     grow_at_load<4>>, 128> c_hashtable;
+
+} /* namespace dinamite */
+
+#endif
@@ -0,0 +1,55 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dinamite_hll.h"
+
+/* The registers of a sketch share cache lines with nothing else */
+dinamite_hll_t *
+dinamite_hll_alloc(void) {
+
+	dinamite_hll_t *hl;
+
+	if(posix_memalign((void **) &hl, 64, sizeof(dinamite_hll_t)) != 0)
+		return NULL;
+	memset(hl, 0, sizeof(dinamite_hll_t));
+	return hl;
+}
+
+void
+dinamite_hll_merge(dinamite_hll_t *dst, const dinamite_hll_t *src) {
+
+	for(int i = 0; i < HLL_REGISTERS; i++)
+		if(src->hl_regs[i] > dst->hl_regs[i])
+			dst->hl_regs[i] = src->hl_regs[i];
+}
+
+/*
+ * The raw HyperLogLog estimate, with the linear counting correction of
+ * Flajolet et al. for small sets, when registers are still at zero. With a
+ * 64-bit hash, there is no need for a large range correction.
+ */
+uint64_t
+dinamite_hll_estimate(const dinamite_hll_t *hl) {
+
+	const double m = HLL_REGISTERS;
+	double sum = 0, estimate;
+	int zeros = 0;
+
+	for(int i = 0; i < HLL_REGISTERS; i++) {
+		sum += ldexp(1.0, -hl->hl_regs[i]);
+		if(hl->hl_regs[i] == 0)
+			zeros++;
+	}
+
+	estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+	if(estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log(m / zeros);
+	return (uint64_t)(estimate + 0.5);
+}
+
+void
+dinamite_hll_reset(dinamite_hll_t *hl) {
+
+	memset(hl->hl_regs, 0, sizeof(hl->hl_regs));
+}
@@ -0,0 +1,48 @@
+#ifndef DINAMITE_HLL_H
+#define DINAMITE_HLL_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#include "dinamite_ht_hash.h"
+
+/*
+ * A HyperLogLog sketch: an estimate of the number of distinct values put,
+ * in HLL_REGISTERS bytes however many values there are. A value's hash picks
+ * a register by its top HLL_PRECISION bits, and the register keeps the
+ * longest run of leading zeros seen in the rest of the hash, plus one. The
+ * standard error of the estimate is 1.04 / sqrt(HLL_REGISTERS), about 1.6%.
+ *
+ * The sketch always hashes with the Murmur3 finalizer: the estimate needs
+ * all 64 bits well mixed. The page and multiply-shift hashes do not mix
+ * them, and the single multiply of the wyhash mixer leaves the top bits of
+ * strided addresses correlated, which throws the estimate off by 2x.
+ * Two sketches merge by taking the larger of each pair of registers, and the
+ * result estimates the size of the union of their sets.
+ */
+#define HLL_PRECISION 12
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
+typedef struct __hll {
+	uint8_t hl_regs[HLL_REGISTERS];
+} dinamite_hll_t;
+
+static inline void
+dinamite_hll_put(dinamite_hll_t *hl, uint64_t value) {
+
+	uint64_t hash = dinamite_ht_hash(DINAMITE_HT_HASH_MURMUR, value);
+	uint32_t reg = hash >> (64 - HLL_PRECISION);
+	/* The guard bit bounds the rank at 64 - HLL_PRECISION + 1 */
+	uint8_t rank = __builtin_clzll((hash << HLL_PRECISION) |
+				       (1ULL << (HLL_PRECISION - 1))) + 1;
+
+	if(rank > hl->hl_regs[reg])
+		hl->hl_regs[reg] = rank;
+}
+
+dinamite_hll_t *dinamite_hll_alloc(void);
+void dinamite_hll_merge(dinamite_hll_t *dst, const dinamite_hll_t *src);
+uint64_t dinamite_hll_estimate(const dinamite_hll_t *hl);
+void dinamite_hll_reset(dinamite_hll_t *hl);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dinamite_ht_arena.h"
+#include "dinamite_ht_numa.h"
+
+/*
+ * The first chunk is small, so that the thousands of tables of a program
+ * with many short-lived threads stay cheap. Each chunk after that is twice
+ * the size of the previous one, up to ARENA_MAX_CHUNK; an array larger than
+ * that gets a chunk of its own.
+ */
+#define ARENA_FIRST_CHUNK (64 * 1024)
+#define ARENA_MAX_CHUNK (64 * 1024 * 1024)
+
+struct __dinamite_arena_chunk {
+	dinamite_arena_chunk_t *dac_next;
+	size_t dac_size;
+	/* Aligned so that the arrays start on a 16-byte boundary */
+	char dac_data[] __attribute__((aligned(16)));
+};
+
+/* Chunks go on the given NUMA node, or anywhere if it is -1 */
+void
+dinamite_arena_init(dinamite_arena_t *arena, int node) {
+
+	memset(arena, 0, sizeof(*arena));
+	arena->da_next_chunk_size = ARENA_FIRST_CHUNK;
+	arena->da_node = node;
+}
+
+static int
+__dinamite_arena_grow(dinamite_arena_t *arena, size_t bytes) {
+
+	dinamite_arena_chunk_t *chunk;
+	size_t size = arena->da_next_chunk_size;
+
+	if(size < bytes)
+		size = bytes;
+
+	if( (chunk = (dinamite_arena_chunk_t *)
+	     malloc(sizeof(dinamite_arena_chunk_t) + size)) == NULL)
+		return -1;
+	__dinamite_numa_place(chunk->dac_data, size, arena->da_node);
+
+	/*
+	 * What is left of the current chunk is not worth tracking; it is
+	 * less than one array of the class that did not fit.
+	 */
+	chunk->dac_next = arena->da_chunks;
+	chunk->dac_size = size;
+	arena->da_chunks = chunk;
+	arena->da_next = chunk->dac_data;
+	arena->da_end = chunk->dac_data + size;
+	arena->da_reserved += size;
+
+	if(arena->da_next_chunk_size < ARENA_MAX_CHUNK)
+		arena->da_next_chunk_size *= 2;
+	return 0;
+}
+
+/*
+ * Return an uninitialized array with room for
+ * dinamite_arena_class_entries(size_class) entries, or NULL.
+ */
+uint64_t *
+dinamite_arena_alloc(dinamite_arena_t *arena, int size_class) {
+
+	size_t bytes;
+	void *entries;
+
+	if(size_class < 0 || size_class >= DINAMITE_ARENA_NUM_CLASSES)
+		return NULL;
+
+	if( (entries = arena->da_free[size_class]) != NULL) {
+		arena->da_free[size_class] = *(void **) entries;
+		return (uint64_t *) entries;
+	}
+
+	bytes = sizeof(uint64_t) * dinamite_arena_class_entries(size_class);
+	if((size_t)(arena->da_end - arena->da_next) < bytes &&
+	   __dinamite_arena_grow(arena, bytes) != 0)
+		return NULL;
+
+	entries = arena->da_next;
+	arena->da_next += bytes;
+	return (uint64_t *) entries;
+}
+
+/* Give an array back, for reuse by the next allocation of its class */
+void
+dinamite_arena_free(dinamite_arena_t *arena, uint64_t *entries,
+		    int size_class) {
+
+	if(entries == NULL)
+		return;
+
+	*(void **) entries = arena->da_free[size_class];
+	arena->da_free[size_class] = entries;
+}
+
+/* Free all arrays at once; the arena is empty and usable afterwards */
+void
+dinamite_arena_release(dinamite_arena_t *arena) {
+
+	dinamite_arena_chunk_t *chunk, *next;
+
+	for(chunk = arena->da_chunks; chunk != NULL; chunk = next) {
+		next = chunk->dac_next;
+		free(chunk);
+	}
+	dinamite_arena_init(arena, arena->da_node);
+}
+
+uint64_t
+dinamite_arena_remote_pages(dinamite_arena_t *arena) {
+
+	dinamite_arena_chunk_t *chunk;
+	uint64_t remote = 0;
+
+	for(chunk = arena->da_chunks; chunk != NULL; chunk = chunk->dac_next)
+		remote += __dinamite_numa_remote_pages(chunk->dac_data,
+						       chunk->dac_size,
+						       arena->da_node);
+	return remote;
+}
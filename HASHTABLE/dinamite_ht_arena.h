@@ -0,0 +1,49 @@
+#ifndef DINAMITE_HT_ARENA_H
+#define DINAMITE_HT_ARENA_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+/*
+ * A per-table allocator for the entry arrays of the chained layout.
+ *
+ * Arrays come in power-of-two size classes, starting at
+ * DINAMITE_ARENA_MIN_ENTRIES entries. They are carved off large chunks by
+ * bumping a pointer, and an array that is given back goes on the free list
+ * of its class, to be reused by the next bucket that grows into that class.
+ * Nothing is ever zeroed. Chunks grow geometrically, so releasing the whole
+ * arena takes a handful of free() calls no matter how many buckets there
+ * are.
+ *
+ * An arena belongs to one table and is not thread-safe.
+ */
+#define DINAMITE_ARENA_MIN_ENTRIES 8
+#define DINAMITE_ARENA_NUM_CLASSES 32
+
+typedef struct __dinamite_arena_chunk dinamite_arena_chunk_t;
+
+typedef struct __dinamite_arena {
+	dinamite_arena_chunk_t *da_chunks;   /* Most recent chunk first */
+	char *da_next;                       /* Bump pointer in da_chunks */
+	char *da_end;
+	size_t da_next_chunk_size;
+	void *da_free[DINAMITE_ARENA_NUM_CLASSES];
+	uint64_t da_reserved;                /* Bytes in all chunks */
+	int da_node;                         /* NUMA node of the chunks */
+} dinamite_arena_t;
+
+void dinamite_arena_init(dinamite_arena_t *arena, int node);
+uint64_t *dinamite_arena_alloc(dinamite_arena_t *arena, int size_class);
+void dinamite_arena_free(dinamite_arena_t *arena, uint64_t *entries,
+			 int size_class);
+void dinamite_arena_release(dinamite_arena_t *arena);
+uint64_t dinamite_arena_remote_pages(dinamite_arena_t *arena);
+
+/* The number of entries that an array of the given class holds */
+static inline uint32_t
+dinamite_arena_class_entries(int size_class) {
+
+	return (uint32_t)DINAMITE_ARENA_MIN_ENTRIES << size_class;
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef DINAMITE_HT_HASH_H
+#define DINAMITE_HT_HASH_H
+
+#include <inttypes.h>
+
+#include "dinamite_hashtable.h"
+
+/*
+ * The hash functions shared by all table layouts. Every function returns
+ * 64 bits; the layouts take their bucket or group index from the low bits
+ * and the swiss layout takes its control-byte tag from the top bits, so
+ * both ends need to be well mixed. The legacy page hash mixes nothing and
+ * leaves the top bits at zero; it is only kept for comparison.
+ */
+
+#define DINAMITE_HT_GOLDEN 0x9e3779b97f4a7c15ULL
+
+/* Address bits 12-31: the page number, truncated to 20 bits */
+static inline uint64_t
+__dinamite_hash_page(uint64_t value) {
+
+	return ((uint32_t)value & 0xFFFFF000 ) >> 12;
+}
+
+/*
+ * Fibonacci multiply-shift. The best bits of the product are the high ones,
+ * so we byte-swap them down to where the bucket index is taken from. The
+ * swap brings the low bits of the product up to the top, where the swiss
+ * layout takes its tag, but those only depend on the low bits of the value,
+ * which aligned pointers share; so we fold the high half of the product
+ * into the top half as well, which leaves the index bits as they were.
+ */
+static inline uint64_t
+__dinamite_hash_mulshift(uint64_t value) {
+
+	uint64_t product = value * DINAMITE_HT_GOLDEN;
+
+	return __builtin_bswap64(product) ^ (product & 0xFFFFFFFF00000000ULL);
+}
+
+/* The 64-bit finalizer from MurmurHash3 */
+static inline uint64_t
+__dinamite_hash_murmur(uint64_t value) {
+
+	value ^= value >> 33;
+	value *= 0xff51afd7ed558ccdULL;
+	value ^= value >> 33;
+	value *= 0xc4ceb9fe1a85ec53ULL;
+	value ^= value >> 33;
+	return value;
+}
+
+/*
+ * The wyhash mixer: a full 64x64->128 bit multiply, folding the two halves
+ * of the product together.
+ */
+static inline uint64_t
+__dinamite_hash_wymix(uint64_t value) {
+
+	__uint128_t r = (__uint128_t)(value ^ 0xa0761d6478bd642fULL) *
+		0xe7037ed1a0b428dbULL;
+
+	return (uint64_t)(r >> 64) ^ (uint64_t)r;
+}
+
+static inline uint64_t
+dinamite_ht_hash(int family, uint64_t value) {
+
+	switch(family) {
+	case DINAMITE_HT_HASH_PAGE:
+		return __dinamite_hash_page(value);
+	case DINAMITE_HT_HASH_MULSHIFT:
+		return __dinamite_hash_mulshift(value);
+	case DINAMITE_HT_HASH_MURMUR:
+		return __dinamite_hash_murmur(value);
+	default:
+		return __dinamite_hash_wymix(value);
+	}
+}
+
+#endif
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dinamite_hashtable.h"
+#include "dinamite_ht_hash.h"
+#include "dinamite_ht_private.h"
+
+/*
+ * The per-thread maps: open addressing with linear probing, where each
+ * entry is a key followed by its payload, so that finding a key brings its
+ * payload into the cache with it. The entry size is 8 bytes plus the payload
+ * rounded up to 8 bytes.
+ *
+ * Key zero marks an empty entry, so its payload lives on the side, in
+ * mp_zero. Like the sets, a map captures the hash family and the granularity
+ * in effect when it is allocated.
+ *
+ * A thread can also have a map found through thread-local storage: it hangs
+ * off the thread's registration as a thread-local table, and is released
+ * with it.
+ */
+#define MAP_MAX_THREADS 128       /* As for the sets */
+#define MAP_INIT_ENTRIES 1024
+#define MAP_MAX_PAYLOAD 256
+#define MAP_EMPTY 0ULL
+
+struct __map {
+	char *mp_entries;
+	uint64_t mp_mask;         /* Number of entries - 1 */
+	uint64_t mp_num_keys;     /* Not counting zero */
+	uint64_t mp_max_keys;     /* Grow beyond 3/4 full */
+	size_t mp_entry_size;
+	int mp_hash;
+	uint64_t mp_gran_mask;
+	int mp_has_zero;
+	char *mp_zero;            /* Payload of key zero */
+	uint64_t mp_iter_pos;     /* Entry index; one past the end is zero */
+};
+
+static dinamite_map_t *per_thread_maps[MAP_MAX_THREADS];
+static size_t map_payload_size = sizeof(uint64_t);
+static int tls_map_count;       /* Live thread-local maps */
+
+#define MAP_ENTRY(mp, i) ((mp)->mp_entries + (i) * (mp)->mp_entry_size)
+#define MAP_KEY(entry) (*(uint64_t *) (entry))
+#define MAP_PAYLOAD(entry) ((entry) + sizeof(uint64_t))
+
+/*
+ * Set the payload size of the maps. It can only change while no maps exist,
+ * before the first upsert or after dinamite_hashtable_map_clear(), with
+ * every thread-local map released.
+ */
+int
+dinamite_hashtable_map_set_payload(size_t size) {
+
+	if(size == 0 || size > MAP_MAX_PAYLOAD) {
+		fprintf(stderr, "Warning: map payloads must be 1 to %d bytes, "
+			"not %zu\n", MAP_MAX_PAYLOAD, size);
+		return -1;
+	}
+	if(__atomic_load_n(&tls_map_count, __ATOMIC_RELAXED) != 0)
+		goto busy;
+	for(int i = 0; i < MAP_MAX_THREADS; i++)
+		if(per_thread_maps[i] != NULL)
+			goto busy;
+	map_payload_size = size;
+	return 0;
+
+busy:
+	fprintf(stderr, "Warning: cannot change the map payload size while "
+		"maps exist\n");
+	return -1;
+}
+
+static int
+__map_alloc_entries(dinamite_map_t *mp, uint64_t num_entries) {
+
+	if( (mp->mp_entries = (char *) calloc(num_entries, mp->mp_entry_size))
+	    == NULL)
+		return -1;
+	mp->mp_mask = num_entries - 1;
+	mp->mp_max_keys = num_entries / 4 * 3;
+	return 0;
+}
+
+static dinamite_map_t *
+__map_alloc(void) {
+
+	dinamite_map_t *mp;
+
+	if( (mp = (dinamite_map_t *) calloc(1, sizeof(dinamite_map_t))) == NULL)
+		return NULL;
+
+	mp->mp_entry_size = sizeof(uint64_t) +
+		((map_payload_size + 7) & ~(size_t)7);
+	__dinamite_ht_settings(&mp->mp_hash, &mp->mp_gran_mask);
+
+	if( (mp->mp_zero = (char *) calloc(1, mp->mp_entry_size)) == NULL ||
+	    __map_alloc_entries(mp, MAP_INIT_ENTRIES) != 0) {
+		free(mp->mp_zero);
+		free(mp);
+		return NULL;
+	}
+	return mp;
+}
+
+static void
+__map_free(dinamite_map_t *mp) {
+
+	free(mp->mp_entries);
+	free(mp->mp_zero);
+	free(mp);
+}
+
+/* The entry holding key, or the empty entry where it would go */
+static inline char *
+__map_find(dinamite_map_t *mp, uint64_t key) {
+
+	uint64_t i = dinamite_ht_hash(mp->mp_hash, key) & mp->mp_mask;
+	char *entry;
+
+	for(;;) {
+		entry = MAP_ENTRY(mp, i);
+		if(MAP_KEY(entry) == key || MAP_KEY(entry) == MAP_EMPTY)
+			return entry;
+		i = (i + 1) & mp->mp_mask;
+	}
+}
+
+/* Double the entries; the keys are distinct, so we just move them */
+static int
+__map_grow(dinamite_map_t *mp) {
+
+	dinamite_map_t old = *mp;
+
+	if(__map_alloc_entries(mp, (old.mp_mask + 1) * 2) != 0) {
+		*mp = old;
+		return -1;
+	}
+	for(uint64_t i = 0; i <= old.mp_mask; i++) {
+		char *entry = MAP_ENTRY(&old, i);
+
+		if(MAP_KEY(entry) != MAP_EMPTY)
+			memcpy(__map_find(mp, MAP_KEY(entry)), entry,
+			       mp->mp_entry_size);
+	}
+	free(old.mp_entries);
+	return 0;
+}
+
+static dinamite_map_t *
+__map_checkinit(int threadID) {
+
+	if(threadID < 0 || threadID > MAP_MAX_THREADS - 1) {
+		fprintf(stderr, "Warning: threadID %d is greater than "
+			"the MAX_THREADS value of %d. Map could "
+			"not be allocated. \n", threadID, MAP_MAX_THREADS);
+		return NULL;
+	}
+	if(per_thread_maps[threadID] == NULL &&
+	   (per_thread_maps[threadID] = __map_alloc()) == NULL)
+		fprintf(stderr, "Warning: malloc() returned NULL when "
+			"allocating a map for threadID %d\n", threadID);
+	return per_thread_maps[threadID];
+}
+
+/*
+ * Find the key's payload, inserting the key with a zeroed payload if it is
+ * not there. Returns NULL if we cannot grow the map.
+ */
+static void *
+__map_upsert(dinamite_map_t *mp, uint64_t key, int *inserted) {
+
+	char *entry;
+
+	key &= mp->mp_gran_mask;
+	if(key == MAP_EMPTY) {
+		if(inserted != NULL)
+			*inserted = !mp->mp_has_zero;
+		mp->mp_has_zero = 1;
+		return mp->mp_zero;
+	}
+
+	entry = __map_find(mp, key);
+	if(MAP_KEY(entry) == key) {
+		if(inserted != NULL)
+			*inserted = 0;
+		return MAP_PAYLOAD(entry);
+	}
+
+	if(mp->mp_num_keys + 1 > mp->mp_max_keys) {
+		if(__map_grow(mp) != 0)
+			return NULL;
+		entry = __map_find(mp, key);
+	}
+	MAP_KEY(entry) = key;
+	mp->mp_num_keys++;
+	if(inserted != NULL)
+		*inserted = 1;
+	return MAP_PAYLOAD(entry);
+}
+
+static void *
+__map_lookup(dinamite_map_t *mp, uint64_t key) {
+
+	char *entry;
+
+	key &= mp->mp_gran_mask;
+	if(key == MAP_EMPTY)
+		return mp->mp_has_zero ? mp->mp_zero : NULL;
+
+	entry = __map_find(mp, key);
+	return MAP_KEY(entry) == key ? MAP_PAYLOAD(entry) : NULL;
+}
+
+static int
+__map_getnext(dinamite_map_t *mp, uint64_t *key_ptr, void **payload_ptr) {
+
+	while(mp->mp_iter_pos <= mp->mp_mask) {
+		char *entry = MAP_ENTRY(mp, mp->mp_iter_pos++);
+
+		if(MAP_KEY(entry) != MAP_EMPTY) {
+			*key_ptr = MAP_KEY(entry);
+			*payload_ptr = MAP_PAYLOAD(entry);
+			return 0;
+		}
+	}
+	if(mp->mp_iter_pos++ == mp->mp_mask + 1 && mp->mp_has_zero) {
+		*key_ptr = MAP_EMPTY;
+		*payload_ptr = mp->mp_zero;
+		return 0;
+	}
+	mp->mp_iter_pos = mp->mp_mask + 2;
+	return -1;
+}
+
+/*
+ * Find the key's payload, inserting the key with a zeroed payload if it is
+ * not there, and return a pointer to the payload, for the caller to read or
+ * update in place. *inserted tells whether the key is new; it may be NULL.
+ * Returns NULL if we run out of memory.
+ */
+void *
+dinamite_hashtable_map_upsert(uint64_t key, int threadID, int *inserted) {
+
+	dinamite_map_t *mp;
+	void *payload;
+
+	if( (mp = __map_checkinit(threadID)) == NULL)
+		return NULL;
+
+	if( (payload = __map_upsert(mp, key, inserted)) == NULL)
+		fprintf(stderr, "Warning: failed to allocate memory "
+			"for the map of thread %d\n", threadID);
+	return payload;
+}
+
+/* The key's payload, or NULL if the thread never upserted the key */
+void *
+dinamite_hashtable_map_find(uint64_t key, int threadID) {
+
+	if(threadID < 0 || threadID > MAP_MAX_THREADS - 1 ||
+	   per_thread_maps[threadID] == NULL)
+		return NULL;
+	return __map_lookup(per_thread_maps[threadID], key);
+}
+
+uint64_t
+dinamite_hashtable_map_size(int threadID) {
+
+	dinamite_map_t *mp;
+
+	if(threadID < 0 || threadID > MAP_MAX_THREADS - 1 ||
+	   (mp = per_thread_maps[threadID]) == NULL)
+		return 0;
+	return mp->mp_num_keys + mp->mp_has_zero;
+}
+
+void
+dinamite_hashtable_map_begin_iterate(int threadID) {
+
+	if(threadID < 0 || threadID > MAP_MAX_THREADS - 1 ||
+	   per_thread_maps[threadID] == NULL)
+		return;
+	per_thread_maps[threadID]->mp_iter_pos = 0;
+}
+
+/*
+ * Return the next key and a pointer to its payload. The payload can still
+ * be updated in place; upserting a new key may move it.
+ */
+int
+dinamite_hashtable_map_getnext(int threadID, uint64_t *key_ptr,
+			       void **payload_ptr) {
+
+	if(threadID < 0 || threadID > MAP_MAX_THREADS - 1 ||
+	   per_thread_maps[threadID] == NULL)
+		return -1;
+	return __map_getnext(per_thread_maps[threadID], key_ptr, payload_ptr);
+}
+
+void
+dinamite_hashtable_map_clear(void) {
+
+	for(int i = 0; i < MAP_MAX_THREADS; i++)
+		if(per_thread_maps[i] != NULL) {
+			__map_free(per_thread_maps[i]);
+			per_thread_maps[i] = NULL;
+		}
+}
+
+/*
+ * The calling thread's own map, allocated on its first upsert. The slot is
+ * in the thread's registration as a thread-local table, whose destructor
+ * calls __dinamite_map_release() at thread exit.
+ */
+static dinamite_map_t *
+__map_tls_checkinit(void) {
+
+	dinamite_map_t **slot;
+
+	if( (slot = __dinamite_ht_tls_map_slot()) == NULL)
+		return NULL;
+	if(*slot == NULL) {
+		if( (*slot = __map_alloc()) == NULL) {
+			fprintf(stderr, "Warning: malloc() returned NULL when "
+				"allocating a thread-local map\n");
+			return NULL;
+		}
+		__atomic_add_fetch(&tls_map_count, 1, __ATOMIC_RELAXED);
+	}
+	return *slot;
+}
+
+void
+__dinamite_map_release(dinamite_map_t *mp) {
+
+	__map_free(mp);
+	__atomic_sub_fetch(&tls_map_count, 1, __ATOMIC_RELAXED);
+}
+
+void *
+dinamite_hashtable_tls_map_upsert(uint64_t key, int *inserted) {
+
+	dinamite_map_t *mp;
+	void *payload;
+
+	if( (mp = __map_tls_checkinit()) == NULL)
+		return NULL;
+
+	if( (payload = __map_upsert(mp, key, inserted)) == NULL)
+		fprintf(stderr, "Warning: failed to allocate memory "
+			"for a thread-local map\n");
+	return payload;
+}
+
+void *
+dinamite_hashtable_tls_map_find(uint64_t key) {
+
+	dinamite_map_t *mp = __dinamite_ht_tls_map();
+
+	if(mp == NULL)
+		return NULL;
+	return __map_lookup(mp, key);
+}
+
+uint64_t
+dinamite_hashtable_tls_map_size(void) {
+
+	dinamite_map_t *mp = __dinamite_ht_tls_map();
+
+	if(mp == NULL)
+		return 0;
+	return mp->mp_num_keys + mp->mp_has_zero;
+}
+
+void
+dinamite_hashtable_tls_map_begin_iterate(void) {
+
+	dinamite_map_t *mp = __dinamite_ht_tls_map();
+
+	if(mp != NULL)
+		mp->mp_iter_pos = 0;
+}
+
+int
+dinamite_hashtable_tls_map_getnext(uint64_t *key_ptr, void **payload_ptr) {
+
+	dinamite_map_t *mp = __dinamite_ht_tls_map();
+
+	if(mp == NULL)
+		return -1;
+	return __map_getnext(mp, key_ptr, payload_ptr);
+}
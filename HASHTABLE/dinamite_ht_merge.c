@@ -0,0 +1,380 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dinamite_hashtable.h"
+#include "dinamite_ht_hash.h"
+#include "dinamite_ht_numa.h"
+#include "dinamite_ht_private.h"
+#include "dinamite_swisstable.h"
+
+/*
+ * Merge all per-thread tables into one process-wide set, in parallel.
+ *
+ * The hash space is split into one partition per worker, by the top bits of
+ * a hash that is independent of the one the tables use. The merge runs in
+ * two phases, separated by a barrier:
+ *
+ * 1. Workers take source tables off a shared counter and scatter their
+ *    values into private buffers, one buffer per partition.
+ * 2. Worker p inserts the contents of every worker's buffer for partition p
+ *    into its own swiss table, which drops the duplicates.
+ *
+ * No two workers ever write to the same memory, so there are no locks, and
+ * the result is a set of disjoint partitions that we iterate one after
+ * another.
+ *
+ * The source tables must not be modified or released during the merge.
+ */
+#define MERGE_PART_HASH DINAMITE_HT_HASH_MURMUR
+#define MERGE_SET_HASH  DINAMITE_HT_HASH_WYMIX
+#define MERGE_INIT_BUF  1024
+#define MERGE_BATCH     16
+
+typedef struct __merge_buf {
+	uint64_t *mb_values;
+	size_t mb_num;
+	size_t mb_max;
+} merge_buf_t;
+
+struct __merge;
+
+typedef struct __merge_worker {
+	pthread_t mw_tid;
+	int mw_id;
+	int mw_failed;
+	merge_buf_t *mw_bufs;    /* One buffer per partition */
+	struct __merge *mw_merge;
+} merge_worker_t;
+
+typedef struct __merge {
+	dinamite_hashtable_t **m_tables;
+	int m_num_tables;
+	int m_next_table;
+	int m_num_workers;
+	merge_worker_t *m_workers;
+	dinamite_swisstable_t *m_parts;
+} merge_t;
+
+/* The result of the last merge */
+static dinamite_swisstable_t *merged_parts;
+static int merged_num_parts;
+static int merged_iter_part;
+
+static inline int
+__merge_partition(uint64_t value, int num_parts) {
+
+	uint64_t h = dinamite_ht_hash(MERGE_PART_HASH, value) >> 32;
+
+	return (int)((h * (uint64_t)num_parts) >> 32);
+}
+
+static int
+__merge_buf_append(merge_buf_t *buf, uint64_t value) {
+
+	if(buf->mb_num == buf->mb_max) {
+		size_t new_max = buf->mb_max ? buf->mb_max * 2 : MERGE_INIT_BUF;
+		uint64_t *new_values = (uint64_t *)
+			realloc(buf->mb_values, sizeof(uint64_t) * new_max);
+
+		if(new_values == NULL)
+			return -1;
+		buf->mb_values = new_values;
+		buf->mb_max = new_max;
+	}
+	buf->mb_values[buf->mb_num++] = value;
+	return 0;
+}
+
+static void
+__merge_scatter(void *arg, const uint64_t *values, size_t n) {
+
+	merge_worker_t *w = (merge_worker_t *) arg;
+	int num_parts = w->mw_merge->m_num_workers;
+
+	for(size_t i = 0; i < n; i++)
+		if(__merge_buf_append(&w->mw_bufs[
+			    __merge_partition(values[i], num_parts)],
+				      values[i]) != 0)
+			w->mw_failed = 1;
+}
+
+/*
+ * Insert a buffer into the partition's set, prefetching the home groups
+ * of MERGE_BATCH values before inserting them.
+ */
+static int
+__merge_insert(dinamite_swisstable_t *st, const uint64_t *values, size_t n) {
+
+	uint64_t hashes[MERGE_BATCH];
+	size_t base, i, m;
+
+	for(base = 0; base < n; base += m) {
+		m = (n - base < MERGE_BATCH) ? n - base : MERGE_BATCH;
+
+		for(i = 0; i < m; i++) {
+			hashes[i] =
+				dinamite_swisstable_hash(st, values[base + i]);
+			dinamite_swisstable_prefetch(st, hashes[i]);
+		}
+		for(i = 0; i < m; i++)
+			if(dinamite_swisstable_put_hash(st, values[base + i],
+							hashes[i]) < 0)
+				return -1;
+	}
+	return 0;
+}
+
+/* Phase 1: scatter */
+static void *
+__merge_scatter_worker(void *arg) {
+
+	merge_worker_t *w = (merge_worker_t *) arg;
+	merge_t *m = w->mw_merge;
+	int i;
+
+	while( (i = __atomic_fetch_add(&m->m_next_table, 1, __ATOMIC_RELAXED))
+	       < m->m_num_tables)
+		__dinamite_ht_visit_chunks(m->m_tables[i], __merge_scatter, w);
+	return NULL;
+}
+
+/*
+ * Phase 2: dedup our partition. The largest buffer is a lower bound for
+ * the number of distinct values, so we size the table for it.
+ */
+static void *
+__merge_dedup_worker(void *arg) {
+
+	merge_worker_t *w = (merge_worker_t *) arg;
+	merge_t *m = w->mw_merge;
+	dinamite_swisstable_t *part = &m->m_parts[w->mw_id];
+	uint64_t largest = 0;
+	int i;
+
+	for(i = 0; i < m->m_num_workers; i++)
+		if(m->m_workers[i].mw_bufs[w->mw_id].mb_num > largest)
+			largest = m->m_workers[i].mw_bufs[w->mw_id].mb_num;
+
+	if(dinamite_swisstable_init_size(part, MERGE_SET_HASH, largest,
+					 DINAMITE_NUMA_NONE) != 0) {
+		w->mw_failed = 1;
+		return NULL;
+	}
+
+	for(i = 0; i < m->m_num_workers; i++) {
+		merge_buf_t *buf = &m->m_workers[i].mw_bufs[w->mw_id];
+
+		if(__merge_insert(part, buf->mb_values, buf->mb_num) != 0)
+			w->mw_failed = 1;
+		free(buf->mb_values);
+		memset(buf, 0, sizeof(*buf));
+	}
+	return NULL;
+}
+
+/*
+ * Run one phase on all workers. If we cannot start a thread, the calling
+ * thread does that worker's share once the others are done.
+ */
+static void
+__merge_run_phase(merge_t *m, void *(*fn)(void *)) {
+
+	int i;
+
+	for(i = 0; i < m->m_num_workers; i++)
+		if(pthread_create(&m->m_workers[i].mw_tid, NULL, fn,
+				  &m->m_workers[i]) != 0)
+			m->m_workers[i].mw_tid = pthread_self();
+
+	for(i = 0; i < m->m_num_workers; i++)
+		if(pthread_equal(m->m_workers[i].mw_tid, pthread_self()))
+			fn(&m->m_workers[i]);
+		else
+			pthread_join(m->m_workers[i].mw_tid, NULL);
+}
+
+void
+dinamite_hashtable_merged_clear(void) {
+
+	for(int i = 0; i < merged_num_parts; i++)
+		dinamite_swisstable_free(&merged_parts[i]);
+	free(merged_parts);
+	merged_parts = NULL;
+	merged_num_parts = 0;
+	merged_iter_part = 0;
+}
+
+/*
+ * Build the process-wide set of all values in all per-thread tables, using
+ * num_workers threads. It replaces the result of any previous merge.
+ * Returns 0 on success and -1 if the merge failed, in which case there is
+ * no merged set.
+ */
+int
+dinamite_hashtable_merge(int num_workers) {
+
+	merge_t m;
+	int i, ret = 0;
+
+	dinamite_hashtable_merged_clear();
+
+	if(num_workers < 1) {
+		fprintf(stderr, "Warning: cannot merge with %d workers\n",
+			num_workers);
+		return -1;
+	}
+
+	memset(&m, 0, sizeof(m));
+	m.m_num_workers = num_workers;
+	m.m_tables = __dinamite_ht_all_tables(&m.m_num_tables);
+	m.m_workers = (merge_worker_t *)
+		calloc(num_workers, sizeof(merge_worker_t));
+	m.m_parts = (dinamite_swisstable_t *)
+		calloc(num_workers, sizeof(dinamite_swisstable_t));
+	if(m.m_tables == NULL || m.m_workers == NULL || m.m_parts == NULL)
+		goto nomem;
+
+	for(i = 0; i < num_workers; i++) {
+		m.m_workers[i].mw_id = i;
+		m.m_workers[i].mw_merge = &m;
+		m.m_workers[i].mw_bufs = (merge_buf_t *)
+			calloc(num_workers, sizeof(merge_buf_t));
+		if(m.m_workers[i].mw_bufs == NULL)
+			goto nomem;
+	}
+
+	__merge_run_phase(&m, __merge_scatter_worker);
+	__merge_run_phase(&m, __merge_dedup_worker);
+
+	for(i = 0; i < num_workers; i++)
+		if(m.m_workers[i].mw_failed)
+			ret = -1;
+
+	if(ret == 0) {
+		merged_parts = m.m_parts;
+		merged_num_parts = num_workers;
+		m.m_parts = NULL;
+	}
+	else
+		fprintf(stderr, "Warning: failed to merge the per-thread "
+			"hashtables\n");
+
+	goto done;
+
+nomem:
+	fprintf(stderr, "Warning: malloc() returned NULL when merging the "
+		"per-thread hashtables\n");
+	ret = -1;
+
+done:
+	if(m.m_parts != NULL) {
+		for(i = 0; i < num_workers; i++)
+			dinamite_swisstable_free(&m.m_parts[i]);
+		free(m.m_parts);
+	}
+	if(m.m_workers != NULL) {
+		for(i = 0; i < num_workers; i++) {
+			if(m.m_workers[i].mw_bufs == NULL)
+				continue;
+			for(int p = 0; p < num_workers; p++)
+				free(m.m_workers[i].mw_bufs[p].mb_values);
+			free(m.m_workers[i].mw_bufs);
+		}
+		free(m.m_workers);
+	}
+	free(m.m_tables);
+	return ret;
+}
+
+uint64_t
+dinamite_hashtable_merged_size(void) {
+
+	uint64_t size = 0;
+
+	for(int i = 0; i < merged_num_parts; i++)
+		size += merged_parts[i].st_num_entries;
+	return size;
+}
+
+void
+dinamite_hashtable_merged_begin_iterate(void) {
+
+	merged_iter_part = 0;
+	for(int i = 0; i < merged_num_parts; i++)
+		dinamite_swisstable_begin_iterate(&merged_parts[i]);
+}
+
+int
+dinamite_hashtable_merged_getnext(uint64_t *value_ptr) {
+
+	while(merged_iter_part < merged_num_parts) {
+		if(dinamite_swisstable_getnext(&merged_parts[merged_iter_part],
+					       value_ptr) == 0)
+			return 0;
+		merged_iter_part++;
+	}
+	return -1;
+}
+
+size_t
+dinamite_hashtable_merged_getnext_bulk(uint64_t *buf, size_t max) {
+
+	size_t n = 0;
+
+	while(merged_iter_part < merged_num_parts && n < max) {
+		size_t got = dinamite_swisstable_getnext_bulk(
+			&merged_parts[merged_iter_part], buf + n, max - n);
+
+		if(got == 0)
+			merged_iter_part++;
+		n += got;
+	}
+	return n;
+}
+
+void
+dinamite_hashtable_merged_visit(dinamite_ht_visitor_t visitor, void *arg) {
+
+	for(int i = 0; i < merged_num_parts; i++)
+		dinamite_swisstable_visit_chunks(&merged_parts[i], visitor, arg);
+}
+
+static void
+__merged_copy(void *arg, const uint64_t *values, size_t n) {
+
+	uint64_t **pos = (uint64_t **) arg;
+
+	memcpy(*pos, values, n * sizeof(uint64_t));
+	*pos += n;
+}
+
+/*
+ * The partitions hold disjoint values, so we only need to concatenate them
+ * before sorting.
+ */
+uint64_t *
+dinamite_hashtable_merged_sorted(uint64_t *count) {
+
+	uint64_t n = dinamite_hashtable_merged_size();
+	uint64_t *values, *pos;
+
+	*count = 0;
+	if( (values = (uint64_t *) malloc(sizeof(uint64_t) * (n + 1))) == NULL)
+		goto nomem;
+
+	pos = values;
+	dinamite_hashtable_merged_visit(__merged_copy, &pos);
+	if(__dinamite_radix_sort(values, n) != 0) {
+		free(values);
+		goto nomem;
+	}
+	*count = n;
+	return values;
+
+nomem:
+	fprintf(stderr, "Warning: malloc() returned NULL when sorting "
+		"the merged hashtable\n");
+	return NULL;
+}
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dinamite_ht_numa.h"
+
+/* From <numaif.h>, which comes with libnuma */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+#define NUMA_SYSFS "/sys/devices/system/node"
+#define NUMA_MAX_NODES 1024
+#define NUMA_QUERY_PAGES 64
+
+static int numa_warned;
+
+/* The node of the CPU we run on, 0 if the kernel does not say */
+int
+__dinamite_numa_node(void) {
+
+	unsigned cpu, node;
+
+	if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		return 0;
+	return (int)node;
+}
+
+/*
+ * Parse a sysfs list such as "0-3,8,10-11" and call cb for each number.
+ * Returns the number of numbers, or -1 if the file cannot be read.
+ */
+static int
+__numa_read_list(const char *path, void (*cb)(void *arg, int n), void *arg) {
+
+	char buf[4096], *p;
+	int count = 0;
+	FILE *file;
+
+	if( (file = fopen(path, "r")) == NULL)
+		return -1;
+	if(fgets(buf, sizeof(buf), file) == NULL) {
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+
+	for(p = buf; *p >= '0' && *p <= '9'; ) {
+		long first = strtol(p, &p, 10), last = first;
+
+		if(*p == '-')
+			last = strtol(p + 1, &p, 10);
+		for(long n = first; n <= last; n++, count++)
+			cb(arg, (int)n);
+		if(*p == ',')
+			p++;
+	}
+	return count;
+}
+
+static void
+__numa_max(void *arg, int n) {
+
+	if(n > *(int *) arg)
+		*(int *) arg = n;
+}
+
+/*
+ * The number of nodes, counting from node 0 to the highest online node;
+ * 1 without NUMA support.
+ */
+int
+__dinamite_numa_num_nodes(void) {
+
+	static int num_nodes;
+	int max = 0;
+
+	if(num_nodes > 0)
+		return num_nodes;
+	if(__numa_read_list(NUMA_SYSFS "/online", __numa_max, &max) <= 0 ||
+	   max >= NUMA_MAX_NODES)
+		max = 0;
+	num_nodes = max + 1;
+	return num_nodes;
+}
+
+static void
+__numa_warn(const char *call) {
+
+	if(__atomic_exchange_n(&numa_warned, 1, __ATOMIC_RELAXED))
+		return;
+	fprintf(stderr, "Warning: %s failed: %s. NUMA placement falls back "
+		"to first touch\n", call, strerror(errno));
+}
+
+/* The whole pages in [addr, addr + len) */
+static int
+__numa_pages(const void *addr, size_t len, uintptr_t *start, size_t *pages) {
+
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t end = ((uintptr_t)addr + len) & ~(page - 1);
+
+	*start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+	if(addr == NULL || end <= *start)
+		return -1;
+	*pages = (end - *start) / page;
+	return 0;
+}
+
+/*
+ * Prefer the node for the pages of the range, and move those already
+ * touched. Pages not touched yet are allocated on the node when they are,
+ * whichever thread touches them.
+ */
+void
+__dinamite_numa_place(void *addr, size_t len, int node) {
+
+	unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+	uintptr_t start;
+	size_t pages;
+
+	if(node < 0 || node >= NUMA_MAX_NODES ||
+	   __numa_pages(addr, len, &start, &pages) != 0)
+		return;
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] |=
+		1UL << (node % (8 * sizeof(unsigned long)));
+
+	if(syscall(SYS_mbind, start, pages * sysconf(_SC_PAGESIZE),
+		   MPOL_PREFERRED, mask, (unsigned long)NUMA_MAX_NODES + 1,
+		   MPOL_MF_MOVE) != 0)
+		__numa_warn("mbind");
+}
+
+/*
+ * The number of pages of the range that are on another node than the given
+ * one. Pages that were never touched are on no node and do not count.
+ */
+uint64_t
+__dinamite_numa_remote_pages(const void *addr, size_t len, int node) {
+
+	void *page_addrs[NUMA_QUERY_PAGES];
+	int status[NUMA_QUERY_PAGES];
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE), start;
+	uint64_t remote = 0;
+	size_t pages, done, n, i;
+
+	if(node < 0 || __numa_pages(addr, len, &start, &pages) != 0)
+		return 0;
+
+	for(done = 0; done < pages; done += n) {
+		n = pages - done < NUMA_QUERY_PAGES ?
+			pages - done : NUMA_QUERY_PAGES;
+		for(i = 0; i < n; i++)
+			page_addrs[i] = (void *)(start + (done + i) * page);
+
+		/* With no target nodes, move_pages only tells where pages are */
+		if(syscall(SYS_move_pages, 0, n, page_addrs, NULL, status, 0)
+		   != 0) {
+			__numa_warn("move_pages");
+			return 0;
+		}
+		for(i = 0; i < n; i++)
+			if(status[i] >= 0 && status[i] != node)
+				remote++;
+	}
+	return remote;
+}
+
+static void
+__numa_add_cpu(void *arg, int cpu) {
+
+	if(cpu < CPU_SETSIZE)
+		CPU_SET(cpu, (cpu_set_t *) arg);
+}
+
+/* Restrict the calling thread to the CPUs of the node */
+int
+__dinamite_numa_run_on_node(int node) {
+
+	char path[64];
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/cpulist", node);
+	if(__numa_read_list(path, __numa_add_cpu, &cpus) <= 0)
+		return -1;
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0 ?
+		0 : -1;
+}
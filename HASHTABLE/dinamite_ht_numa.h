@@ -0,0 +1,26 @@
+#ifndef DINAMITE_HT_NUMA_H
+#define DINAMITE_HT_NUMA_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+/*
+ * NUMA placement for the memory of the tables, through the mbind and
+ * move_pages system calls, so there is no dependence on libnuma. A node of
+ * -1 means no placement: the memory goes wherever it is first touched.
+ *
+ * Placement only covers the pages that lie entirely within a range, so
+ * that a small malloc'd array does not move the data around it. When the
+ * kernel has no NUMA support, or a container forbids the calls, we warn
+ * once and fall back to first touch; as the owner of a table is also the
+ * thread that fills it, that mostly puts the memory in the same place.
+ */
+#define DINAMITE_NUMA_NONE (-1)
+
+int __dinamite_numa_node(void);
+int __dinamite_numa_num_nodes(void);
+void __dinamite_numa_place(void *addr, size_t len, int node);
+uint64_t __dinamite_numa_remote_pages(const void *addr, size_t len, int node);
+int __dinamite_numa_run_on_node(int node);
+
+#endif
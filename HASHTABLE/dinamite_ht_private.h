@@ -0,0 +1,40 @@
+#ifndef DINAMITE_HT_PRIVATE_H
+#define DINAMITE_HT_PRIVATE_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#include "dinamite_hashtable.h"
+
+/*
+ * Interfaces shared between the modules of the hashtable library. They are
+ * not part of the API in dinamite_hashtable.h.
+ */
+typedef struct __hashtable dinamite_hashtable_t;
+typedef struct __map dinamite_map_t;
+
+/*
+ * A chunk visitor gets the values of a table a run at a time: a bucket for
+ * the chained layout, a buffer of slots for the swiss layout. It is the
+ * public visitor type.
+ */
+typedef dinamite_ht_visitor_t dinamite_ht_chunk_cb_t;
+
+dinamite_hashtable_t **__dinamite_ht_all_tables(int *count);
+int __dinamite_ht_thread_id(dinamite_hashtable_t *ht);
+uint64_t __dinamite_ht_num_entries(dinamite_hashtable_t *ht);
+void __dinamite_ht_visit_chunks(dinamite_hashtable_t *ht,
+				dinamite_ht_chunk_cb_t cb, void *arg);
+void __dinamite_ht_settings(int *hash, uint64_t *gran_mask);
+int __dinamite_radix_sort(uint64_t *values, size_t n);
+
+/*
+ * The slot for the calling thread's map in its thread-local registration,
+ * registering the thread if needed, and the map in it, or NULL if there is
+ * none yet. The registration releases the map with __dinamite_map_release().
+ */
+dinamite_map_t **__dinamite_ht_tls_map_slot(void);
+dinamite_map_t *__dinamite_ht_tls_map(void);
+void __dinamite_map_release(dinamite_map_t *mp);
+
+#endif
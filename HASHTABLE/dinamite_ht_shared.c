@@ -0,0 +1,377 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dinamite_hashtable.h"
+#include "dinamite_ht_hash.h"
+#include "dinamite_ht_private.h"
+
+/*
+ * The shared set: one open-addressing table with linear probing that all
+ * threads insert into with compare-and-swap. A slot is either empty, holds
+ * a value, or has moved to the next table during a resize. A slot never goes
+ * back to empty, so two threads inserting the same value always meet in the
+ * same slot, and a value is never stored twice.
+ *
+ * Resizing is cooperative. The thread that finds the table too full
+ * allocates a table twice the size and publishes it as t_next. From then on,
+ * every thread that wants to insert first helps with the migration: it
+ * claims chunks of SHARED_CHUNK slots off a shared counter, and for each
+ * slot in the chunk either freezes the empty slot by swapping in
+ * SHARED_MOVED, or copies the value to the new table and then marks the slot
+ * as moved. A thread that is still inserting into the old table either wins
+ * the race for an empty slot, and its value gets copied, or sees the slot
+ * moved and starts over in the new table. Once every chunk has been claimed,
+ * the inserters wait for the chunks still in flight and carry on in the new
+ * table; the thread that migrates the last chunk makes the new table the
+ * current one. This is the only point where an insert can wait for another
+ * thread.
+ *
+ * The old tables are kept until dinamite_hashtable_shared_clear(), as a
+ * thread may still be reading one. They add up to less than the size of the
+ * current table.
+ *
+ * The number of entries is kept in SHARED_COUNTERS counters, each on its own
+ * cache line, so that threads do not all write the same line. A thread adds
+ * them up every SHARED_CHECK_EVERY inserts of its own, to see whether the
+ * table needs to grow; a table that fills up before that grows too.
+ *
+ * Zero marks an empty slot and ~0 a moved one, so these two values are
+ * recorded separately.
+ */
+#define SHARED_INIT_SLOTS (1 << 16)
+#define SHARED_CHUNK 1024
+#define SHARED_COUNTERS 64
+#define SHARED_CHECK_EVERY 64
+#define SHARED_EMPTY 0ULL
+#define SHARED_MOVED (~0ULL)
+#define SHARED_RETRY (-2)
+
+typedef struct __shared_counter {
+	uint64_t sc_count;
+} __attribute__((aligned(64))) shared_counter_t;
+
+typedef struct __shared_table {
+	uint64_t *t_slots;
+	uint64_t t_mask;
+	uint64_t t_max_entries;     /* Grow beyond 3/4 full */
+	uint64_t t_num_chunks;
+	int t_hash;
+	uint64_t t_gran_mask;
+	struct __shared_table *t_next;   /* The table we are migrating to */
+	uint64_t t_migrate_next;    /* The next chunk to claim */
+	uint64_t t_migrate_done;    /* The number of chunks migrated */
+	struct __shared_table *t_retired_next;
+	shared_counter_t t_counts[SHARED_COUNTERS];
+} shared_table_t;
+
+static shared_table_t *shared_current;
+static shared_table_t *shared_retired;
+static int shared_has_empty, shared_has_moved;
+
+static int shared_next_counter;
+static __thread int shared_counter = -1;
+static __thread unsigned shared_inserts;
+
+static uint64_t shared_iter_slot;
+static int shared_iter_special;
+
+static shared_table_t *
+__shared_alloc(uint64_t num_slots, int hash, uint64_t gran_mask) {
+
+	shared_table_t *t;
+
+	if(posix_memalign((void **) &t, 64, sizeof(shared_table_t)) != 0)
+		return NULL;
+	memset(t, 0, sizeof(shared_table_t));
+
+	if( (t->t_slots = (uint64_t *) calloc(num_slots, sizeof(uint64_t)))
+	    == NULL) {
+		free(t);
+		return NULL;
+	}
+	t->t_mask = num_slots - 1;
+	t->t_max_entries = num_slots / 4 * 3;
+	t->t_num_chunks = num_slots / SHARED_CHUNK;
+	t->t_hash = hash;
+	t->t_gran_mask = gran_mask;
+	return t;
+}
+
+static void
+__shared_free(shared_table_t *t) {
+
+	free(t->t_slots);
+	free(t);
+}
+
+static shared_table_t *
+__shared_get_current(void) {
+
+	shared_table_t *t, *expected = NULL;
+	uint64_t gran_mask;
+	int hash;
+
+	if( (t = __atomic_load_n(&shared_current, __ATOMIC_ACQUIRE)) != NULL)
+		return t;
+
+	__dinamite_ht_settings(&hash, &gran_mask);
+	if( (t = __shared_alloc(SHARED_INIT_SLOTS, hash, gran_mask)) == NULL) {
+		fprintf(stderr, "Warning: malloc() returned NULL when "
+			"allocating the shared hashtable\n");
+		return NULL;
+	}
+	if(!__atomic_compare_exchange_n(&shared_current, &expected, t, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		__shared_free(t);
+		t = expected;
+	}
+	return t;
+}
+
+static uint64_t
+__shared_count(shared_table_t *t) {
+
+	uint64_t count = 0;
+
+	for(int i = 0; i < SHARED_COUNTERS; i++)
+		count += __atomic_load_n(&t->t_counts[i].sc_count,
+					 __ATOMIC_RELAXED);
+	return count;
+}
+
+/*
+ * Returns 1 if we inserted the value, 0 if it was already there, and
+ * SHARED_RETRY if we ran into a slot that has moved or if the table is full.
+ */
+static int
+__shared_table_insert(shared_table_t *t, uint64_t value, uint64_t hash) {
+
+	uint64_t i = hash & t->t_mask, n;
+
+	for(n = 0; n <= t->t_mask; n++, i = (i + 1) & t->t_mask) {
+		uint64_t slot = __atomic_load_n(&t->t_slots[i],
+						__ATOMIC_ACQUIRE);
+
+		if(slot == SHARED_EMPTY) {
+			if(__atomic_compare_exchange_n(&t->t_slots[i], &slot,
+						       value, 0,
+						       __ATOMIC_ACQ_REL,
+						       __ATOMIC_ACQUIRE)) {
+				__atomic_fetch_add(
+					&t->t_counts[shared_counter].sc_count,
+					1, __ATOMIC_RELAXED);
+				return 1;
+			}
+			/* Somebody beat us to it; slot is what they wrote */
+		}
+		if(slot == value)
+			return 0;
+		if(slot == SHARED_MOVED)
+			return SHARED_RETRY;
+	}
+	return SHARED_RETRY;
+}
+
+static int
+__shared_start_resize(shared_table_t *t) {
+
+	shared_table_t *next, *expected = NULL;
+
+	if(__atomic_load_n(&t->t_next, __ATOMIC_ACQUIRE) != NULL)
+		return 0;
+
+	if( (next = __shared_alloc((t->t_mask + 1) * 2, t->t_hash,
+				   t->t_gran_mask)) == NULL) {
+		fprintf(stderr, "Warning: malloc() returned NULL when "
+			"resizing the shared hashtable\n");
+		return -1;
+	}
+	if(!__atomic_compare_exchange_n(&t->t_next, &expected, next, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		__shared_free(next);
+	return 0;
+}
+
+/* Make the table we migrated to the current one, and retire the old one */
+static void
+__shared_finish_migration(shared_table_t *t) {
+
+	shared_table_t *expected = t;
+
+	if(!__atomic_compare_exchange_n(&shared_current, &expected, t->t_next,
+					0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+
+	t->t_retired_next = __atomic_load_n(&shared_retired,
+					    __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&shared_retired,
+					   &t->t_retired_next, t, 0,
+					   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Migrate chunks of t until none are left to claim, then wait for those
+ * that other threads are still migrating.
+ */
+static void
+__shared_migrate(shared_table_t *t) {
+
+	shared_table_t *next = __atomic_load_n(&t->t_next, __ATOMIC_ACQUIRE);
+	uint64_t chunk, i;
+
+	while( (chunk = __atomic_fetch_add(&t->t_migrate_next, 1,
+					   __ATOMIC_RELAXED))
+	       < t->t_num_chunks) {
+
+		for(i = chunk * SHARED_CHUNK; i < (chunk + 1) * SHARED_CHUNK;
+		    i++) {
+			uint64_t slot = SHARED_EMPTY;
+
+			/* Freeze an empty slot, nobody may insert there now */
+			if(__atomic_compare_exchange_n(&t->t_slots[i], &slot,
+						       SHARED_MOVED, 0,
+						       __ATOMIC_ACQ_REL,
+						       __ATOMIC_ACQUIRE))
+				continue;
+
+			/*
+			 * The slot holds a value, which will not change. The
+			 * new table is twice as large and only gets inserts
+			 * from the migration, so it cannot fill up.
+			 */
+			__shared_table_insert(next, slot,
+					      dinamite_ht_hash(next->t_hash,
+							       slot));
+			__atomic_store_n(&t->t_slots[i], SHARED_MOVED,
+					 __ATOMIC_RELEASE);
+		}
+
+		if(__atomic_add_fetch(&t->t_migrate_done, 1, __ATOMIC_ACQ_REL)
+		   == t->t_num_chunks)
+			__shared_finish_migration(t);
+	}
+
+	while(__atomic_load_n(&t->t_migrate_done, __ATOMIC_ACQUIRE)
+	      < t->t_num_chunks)
+		sched_yield();
+}
+
+void
+dinamite_hashtable_shared_put(uint64_t value) {
+
+	shared_table_t *t;
+	uint64_t hash;
+	int ret;
+
+	if( (t = __shared_get_current()) == NULL)
+		return;
+
+	if(shared_counter < 0)
+		shared_counter = __atomic_fetch_add(&shared_next_counter, 1,
+						    __ATOMIC_RELAXED)
+			% SHARED_COUNTERS;
+
+	value &= t->t_gran_mask;
+	if(value == SHARED_EMPTY || value == SHARED_MOVED) {
+		__atomic_store_n(value == SHARED_EMPTY ? &shared_has_empty :
+				 &shared_has_moved, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	hash = dinamite_ht_hash(t->t_hash, value);
+
+	for(;;) {
+		if(__atomic_load_n(&t->t_next, __ATOMIC_ACQUIRE) != NULL) {
+			__shared_migrate(t);
+			t = __atomic_load_n(&shared_current, __ATOMIC_ACQUIRE);
+			continue;
+		}
+
+		if( (ret = __shared_table_insert(t, value, hash)) == 1) {
+			if(++shared_inserts % SHARED_CHECK_EVERY == 0 &&
+			   __shared_count(t) > t->t_max_entries)
+				__shared_start_resize(t);
+			return;
+		}
+		if(ret == 0)
+			return;
+
+		/* The table is full, or it has moved and t_next is set */
+		if(__atomic_load_n(&t->t_next, __ATOMIC_ACQUIRE) == NULL &&
+		   __shared_start_resize(t) != 0)
+			return;
+	}
+}
+
+/*
+ * The rest is only called once the puts have stopped.
+ */
+uint64_t
+dinamite_hashtable_shared_size(void) {
+
+	uint64_t size = shared_has_empty + shared_has_moved;
+
+	if(shared_current != NULL)
+		size += __shared_count(shared_current);
+	return size;
+}
+
+void
+dinamite_hashtable_shared_begin_iterate(void) {
+
+	shared_iter_slot = 0;
+	shared_iter_special = 0;
+}
+
+int
+dinamite_hashtable_shared_getnext(uint64_t *value_ptr) {
+
+	shared_table_t *t = shared_current;
+
+	while(t != NULL && shared_iter_slot <= t->t_mask) {
+		uint64_t slot = t->t_slots[shared_iter_slot++];
+
+		if(slot != SHARED_EMPTY && slot != SHARED_MOVED) {
+			*value_ptr = slot;
+			return 0;
+		}
+	}
+
+	if(shared_iter_special == 0) {
+		shared_iter_special++;
+		if(shared_has_empty) {
+			*value_ptr = SHARED_EMPTY;
+			return 0;
+		}
+	}
+	if(shared_iter_special == 1) {
+		shared_iter_special++;
+		if(shared_has_moved) {
+			*value_ptr = SHARED_MOVED;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void
+dinamite_hashtable_shared_clear(void) {
+
+	shared_table_t *t, *next;
+
+	for(t = shared_retired; t != NULL; t = next) {
+		next = t->t_retired_next;
+		__shared_free(t);
+	}
+	if(shared_current != NULL)
+		__shared_free(shared_current);
+
+	shared_current = NULL;
+	shared_retired = NULL;
+	shared_has_empty = 0;
+	shared_has_moved = 0;
+	shared_iter_slot = 0;
+	shared_iter_special = 0;
+}
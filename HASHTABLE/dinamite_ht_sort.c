@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dinamite_ht_private.h"
+
+/*
+ * LSD radix sort of 64-bit values, 11 bits per pass. The histograms of all
+ * passes are built in one read of the data, and a pass whose digit is the
+ * same for every value is skipped: for pointers, which share their top
+ * bits, that is usually two or three of the six passes.
+ */
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES ((64 + RADIX_BITS - 1) / RADIX_BITS)
+#define RADIX_DIGIT(value, pass) \
+	(((value) >> ((pass) * RADIX_BITS)) & (RADIX_SIZE - 1))
+
+/* Below this, insertion sort wins */
+#define RADIX_MIN 64
+
+static void
+__insertion_sort(uint64_t *values, size_t n) {
+
+	for(size_t i = 1; i < n; i++) {
+		uint64_t v = values[i];
+		size_t j = i;
+
+		while(j > 0 && values[j - 1] > v) {
+			values[j] = values[j - 1];
+			j--;
+		}
+		values[j] = v;
+	}
+}
+
+/* Sort n values in place; 0 on success, -1 if malloc fails */
+int
+__dinamite_radix_sort(uint64_t *values, size_t n) {
+
+	size_t (*counts)[RADIX_SIZE];
+	uint64_t *tmp, *src = values, *dst;
+	size_t i;
+	int pass;
+
+	if(n < RADIX_MIN) {
+		__insertion_sort(values, n);
+		return 0;
+	}
+
+	counts = (size_t (*)[RADIX_SIZE])
+		calloc(RADIX_PASSES, sizeof(*counts));
+	tmp = (uint64_t *) malloc(sizeof(uint64_t) * n);
+	if(counts == NULL || tmp == NULL) {
+		free(counts);
+		free(tmp);
+		return -1;
+	}
+	dst = tmp;
+
+	for(i = 0; i < n; i++)
+		for(pass = 0; pass < RADIX_PASSES; pass++)
+			counts[pass][RADIX_DIGIT(values[i], pass)]++;
+
+	for(pass = 0; pass < RADIX_PASSES; pass++) {
+		size_t offset = 0, *count = counts[pass];
+		uint64_t *swap;
+
+		if(count[RADIX_DIGIT(src[0], pass)] == n)
+			continue;
+
+		/* Turn the counts into the starting offsets of each digit */
+		for(int d = 0; d < RADIX_SIZE; d++) {
+			size_t c = count[d];
+
+			count[d] = offset;
+			offset += c;
+		}
+		for(i = 0; i < n; i++)
+			dst[count[RADIX_DIGIT(src[i], pass)]++] = src[i];
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if(src != values)
+		memcpy(values, src, sizeof(uint64_t) * n);
+
+	free(counts);
+	free(tmp);
+	return 0;
+}
@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dinamite_hashtable.h"
+#include "dinamite_ht_stream.h"
+
+/*
+ * The streaming thread visits every ring in turn, hands what it finds to
+ * the callback, STREAM_BATCH values at a time, and sleeps for
+ * STREAM_POLL_USEC when all rings were empty.
+ *
+ * Rings are pushed onto the front of a list with compare-and-swap, so a
+ * thread registers its ring without a lock. Only the streaming thread
+ * removes rings, and never the first one, which a new ring may be linking
+ * itself in front of; a closed ring at the front is freed once another
+ * ring has been added, or when streaming stops. stream_lock keeps
+ * dinamite_hashtable_stream_stats() from reading a ring as it is freed.
+ */
+#define STREAM_RING_VALUES (1 << 14)
+#define STREAM_BATCH 1024
+#define STREAM_POLL_USEC 100
+
+int __dinamite_stream_active;
+
+static dinamite_stream_ring_t *stream_rings;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t stream_thread;
+static int stream_stopping;
+static dinamite_ht_stream_cb_t stream_cb;
+static void *stream_arg;
+static FILE *stream_file;
+static uint64_t stream_streamed;
+static uint64_t stream_dropped_closed;   /* Drops of the rings we freed */
+
+dinamite_stream_ring_t *
+__dinamite_stream_ring_new(int thread_id) {
+
+	dinamite_stream_ring_t *ring;
+
+	if(posix_memalign((void **) &ring, 64, sizeof(*ring)) != 0)
+		return NULL;
+	memset(ring, 0, sizeof(*ring));
+
+	if( (ring->sr_values = (uint64_t *)
+	     malloc(sizeof(uint64_t) * STREAM_RING_VALUES)) == NULL) {
+		free(ring);
+		return NULL;
+	}
+	ring->sr_mask = STREAM_RING_VALUES - 1;
+	ring->sr_thread_id = thread_id;
+
+	ring->sr_next = __atomic_load_n(&stream_rings, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&stream_rings, &ring->sr_next, ring,
+					   0, __ATOMIC_RELEASE,
+					   __ATOMIC_RELAXED))
+		;
+	return ring;
+}
+
+void
+__dinamite_stream_ring_close(dinamite_stream_ring_t *ring) {
+
+	__atomic_store_n(&ring->sr_closed, 1, __ATOMIC_RELEASE);
+}
+
+/* Hand everything the ring holds to the callback */
+static uint64_t
+__stream_drain_ring(dinamite_stream_ring_t *ring) {
+
+	uint64_t tail = ring->sr_tail, total = 0;
+	uint64_t head = __atomic_load_n(&ring->sr_head, __ATOMIC_ACQUIRE);
+
+	while(tail != head) {
+		uint64_t start = tail & ring->sr_mask;
+		uint64_t n = head - tail;
+
+		/* Stop at the end of the array, and at a batch */
+		if(n > ring->sr_mask + 1 - start)
+			n = ring->sr_mask + 1 - start;
+		if(n > STREAM_BATCH)
+			n = STREAM_BATCH;
+
+		stream_cb(stream_arg, ring->sr_thread_id,
+			  &ring->sr_values[start], n);
+		tail += n;
+		total += n;
+		__atomic_store_n(&ring->sr_tail, tail, __ATOMIC_RELEASE);
+	}
+	return total;
+}
+
+static void
+__stream_free_ring(dinamite_stream_ring_t *ring) {
+
+	stream_dropped_closed += ring->sr_dropped;
+	free(ring->sr_values);
+	free(ring);
+}
+
+/*
+ * One pass over all rings. Closed rings are drained once more after we see
+ * them closed, as values may have been pushed just before, and then freed.
+ */
+static uint64_t
+__stream_drain_all(int free_first) {
+
+	dinamite_stream_ring_t *first, *ring, **prev;
+	uint64_t total = 0;
+
+	first = __atomic_load_n(&stream_rings, __ATOMIC_ACQUIRE);
+	for(prev = NULL, ring = first; ring != NULL; ) {
+		int closed = __atomic_load_n(&ring->sr_closed,
+					     __ATOMIC_ACQUIRE);
+
+		total += __stream_drain_ring(ring);
+
+		if(closed && (ring != first || free_first)) {
+			dinamite_stream_ring_t *next = ring->sr_next;
+
+			dinamite_stream_ring_t *expected = ring;
+
+			total += __stream_drain_ring(ring);
+			pthread_mutex_lock(&stream_lock);
+			if(prev != NULL)
+				*prev = next;
+			else if(!__atomic_compare_exchange_n(
+					&stream_rings, &expected, next, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				/* A new ring went in front; free it later */
+				pthread_mutex_unlock(&stream_lock);
+				prev = &ring->sr_next;
+				ring = next;
+				continue;
+			}
+			__stream_free_ring(ring);
+			pthread_mutex_unlock(&stream_lock);
+			ring = next;
+			continue;
+		}
+		prev = &ring->sr_next;
+		ring = ring->sr_next;
+	}
+	__atomic_fetch_add(&stream_streamed, total, __ATOMIC_RELAXED);
+	return total;
+}
+
+static void *
+__stream_main(void *arg) {
+
+	struct timespec poll = {0, STREAM_POLL_USEC * 1000};
+
+	(void)arg;
+	while(!__atomic_load_n(&stream_stopping, __ATOMIC_ACQUIRE))
+		if(__stream_drain_all(0) == 0)
+			nanosleep(&poll, NULL);
+	return NULL;
+}
+
+/*
+ * Start streaming the values the tables insert from now on to cb, which
+ * runs on a thread of its own. Returns -1 if streaming is already on or the
+ * thread cannot be created.
+ */
+int
+dinamite_hashtable_stream_start(dinamite_ht_stream_cb_t cb, void *arg) {
+
+	int err;
+
+	if(__atomic_load_n(&__dinamite_stream_active, __ATOMIC_ACQUIRE)) {
+		fprintf(stderr, "Warning: hashtable streaming is already "
+			"on\n");
+		return -1;
+	}
+
+	stream_cb = cb;
+	stream_arg = arg;
+	stream_stopping = 0;
+	if( (err = pthread_create(&stream_thread, NULL, __stream_main, NULL))
+	    != 0) {
+		fprintf(stderr, "Warning: could not start the streaming "
+			"thread: %s\n", strerror(err));
+		return -1;
+	}
+	__atomic_store_n(&__dinamite_stream_active, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Records in the file are a 32-bit thread ID and a 32-bit count, followed
+ * by that many 64-bit values, all in host byte order.
+ */
+static void
+__stream_write(void *arg, int thread_id, const uint64_t *values, size_t n) {
+
+	int32_t header[2] = {thread_id, (int32_t)n};
+
+	if(fwrite(header, sizeof(header), 1, stream_file) != 1 ||
+	   fwrite(values, sizeof(uint64_t), n, stream_file) != n)
+		__atomic_store_n((int *) arg, errno ? errno : EIO,
+				 __ATOMIC_RELAXED);
+}
+
+static int stream_file_error;
+
+int
+dinamite_hashtable_stream_to_file(const char *path) {
+
+	if( (stream_file = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "Warning: could not create stream file %s: "
+			"%s\n", path, strerror(errno));
+		return -1;
+	}
+	stream_file_error = 0;
+	if(dinamite_hashtable_stream_start(__stream_write, &stream_file_error)
+	   != 0) {
+		fclose(stream_file);
+		stream_file = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stop streaming, after handing over whatever the rings hold. Values
+ * inserted while we stop may or may not be streamed. Returns -1 if writing
+ * the stream file failed.
+ */
+int
+dinamite_hashtable_stream_stop(void) {
+
+	int ret = 0;
+
+	if(!__atomic_load_n(&__dinamite_stream_active, __ATOMIC_ACQUIRE))
+		return 0;
+
+	__atomic_store_n(&__dinamite_stream_active, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&stream_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(stream_thread, NULL);
+	__stream_drain_all(1);
+
+	if(stream_file != NULL) {
+		if(fclose(stream_file) != 0 || stream_file_error != 0) {
+			fprintf(stderr, "Warning: could not write the stream "
+				"file: %s\n", strerror(stream_file_error ?
+							stream_file_error :
+							errno));
+			ret = -1;
+		}
+		stream_file = NULL;
+	}
+	return ret;
+}
+
+/*
+ * The number of values streamed, and dropped because a ring was full, since
+ * the process first started streaming.
+ */
+void
+dinamite_hashtable_stream_stats(uint64_t *streamed, uint64_t *dropped) {
+
+	dinamite_stream_ring_t *ring;
+
+	pthread_mutex_lock(&stream_lock);
+	*streamed = __atomic_load_n(&stream_streamed, __ATOMIC_RELAXED);
+	*dropped = stream_dropped_closed;
+	for(ring = __atomic_load_n(&stream_rings, __ATOMIC_ACQUIRE);
+	    ring != NULL; ring = ring->sr_next)
+		*dropped += __atomic_load_n(&ring->sr_dropped,
+					    __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&stream_lock);
+}
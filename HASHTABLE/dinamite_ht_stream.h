@@ -0,0 +1,60 @@
+#ifndef DINAMITE_HT_STREAM_H
+#define DINAMITE_HT_STREAM_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+/*
+ * A single-producer, single-consumer ring of the values a table inserts,
+ * for the streaming mode. The producer is the thread that owns the table,
+ * the consumer the streaming thread. Each side writes only its own index,
+ * on its own cache line, and the producer keeps a copy of the consumer's
+ * index so that it reads the consumer's line only when the ring looks full.
+ * When it is full, the value is counted in sr_dropped and not streamed; the
+ * producer never waits.
+ *
+ * A ring outlives its table: when the table goes away the ring is closed,
+ * and the streaming thread frees it once it has drained it.
+ */
+typedef struct __stream_ring {
+	/* Set up once, read by both sides */
+	uint64_t *sr_values;
+	uint64_t sr_mask;
+	int sr_thread_id;
+	struct __stream_ring *sr_next;
+
+	/* The producer's side */
+	uint64_t sr_head __attribute__((aligned(64)));
+	uint64_t sr_cached_tail;
+	uint64_t sr_dropped;
+	int sr_closed;
+
+	/* The consumer's side */
+	uint64_t sr_tail __attribute__((aligned(64)));
+} dinamite_stream_ring_t;
+
+extern int __dinamite_stream_active;
+
+dinamite_stream_ring_t *__dinamite_stream_ring_new(int thread_id);
+void __dinamite_stream_ring_close(dinamite_stream_ring_t *ring);
+
+static inline void
+dinamite_stream_push(dinamite_stream_ring_t *ring, uint64_t value) {
+
+	uint64_t head = ring->sr_head;
+
+	if(head - ring->sr_cached_tail > ring->sr_mask) {
+		ring->sr_cached_tail = __atomic_load_n(&ring->sr_tail,
+						       __ATOMIC_ACQUIRE);
+		if(head - ring->sr_cached_tail > ring->sr_mask) {
+			__atomic_store_n(&ring->sr_dropped,
+					 ring->sr_dropped + 1,
+					 __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	ring->sr_values[head & ring->sr_mask] = value;
+	__atomic_store_n(&ring->sr_head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dinamite_ht_hash.h"
+#include "dinamite_ht_numa.h"
+#include "dinamite_roaring.h"
+
+#define RR_INIT_DIR 64
+#define RR_INIT_ARRAY 4
+#define RR_BITMAP_WORDS 1024
+
+/*
+ * An array of RR_ARRAY_MAX 16-bit values takes as much memory as a bitmap,
+ * so this is where we switch.
+ */
+#define RR_ARRAY_MAX (RR_BITMAP_WORDS * 64 / 16)
+
+#define RR_KEY(value) ((value) >> 16)
+#define RR_LOW(value) ((uint16_t)(value))
+#define RR_VISIT_CHUNK 256
+
+/* Whether a directory slot holds a container of the current epoch */
+#define RR_LIVE(rr, c) \
+	((c)->rc_data != NULL && (c)->rc_epoch == (rr)->rr_epoch)
+
+/*
+ * The directory and the bitmaps go on the given NUMA node, or anywhere if it
+ * is -1. Arrays are at most a couple of pages and move as they grow, so we
+ * leave them where they are first touched.
+ */
+int
+dinamite_roaring_init(dinamite_roaring_t *rr, int hash, int node) {
+
+	memset(rr, 0, sizeof(*rr));
+	rr->rr_hash = hash;
+	rr->rr_node = node;
+
+	if( (rr->rr_dir = (dinamite_roaring_container_t *)
+	     calloc(RR_INIT_DIR, sizeof(dinamite_roaring_container_t)))
+	    == NULL)
+		return -1;
+	__dinamite_numa_place(rr->rr_dir,
+			      RR_INIT_DIR * sizeof(dinamite_roaring_container_t),
+			      node);
+	rr->rr_dir_size = RR_INIT_DIR;
+	return 0;
+}
+
+/* The slot holding key, or the free or stale slot where it would go */
+static dinamite_roaring_container_t *
+__rr_find_slot(dinamite_roaring_t *rr, dinamite_roaring_container_t *dir,
+	       uint64_t dir_size, uint64_t key) {
+
+	uint64_t i = dinamite_ht_hash(rr->rr_hash, key) & (dir_size - 1);
+
+	while(RR_LIVE(rr, &dir[i]) && dir[i].rc_key != key)
+		i = (i + 1) & (dir_size - 1);
+	return &dir[i];
+}
+
+static uint64_t
+__rr_container_bytes(dinamite_roaring_container_t *c) {
+
+	if(c->rc_max != 0)
+		return sizeof(uint16_t) * c->rc_max;
+	else
+		return sizeof(uint64_t) * RR_BITMAP_WORDS;
+}
+
+/*
+ * Double the directory, keeping it at most half full. The stale containers
+ * are freed rather than moved.
+ */
+static int
+__rr_grow_dir(dinamite_roaring_t *rr) {
+
+	uint64_t new_size = rr->rr_dir_size * 2;
+	dinamite_roaring_container_t *new_dir = (dinamite_roaring_container_t *)
+		calloc(new_size, sizeof(dinamite_roaring_container_t));
+
+	if(new_dir == NULL)
+		return -1;
+	__dinamite_numa_place(new_dir,
+			      new_size * sizeof(dinamite_roaring_container_t),
+			      rr->rr_node);
+
+	for(uint64_t i = 0; i < rr->rr_dir_size; i++) {
+		dinamite_roaring_container_t *c = &rr->rr_dir[i];
+
+		if(RR_LIVE(rr, c))
+			*__rr_find_slot(rr, new_dir, new_size, c->rc_key) = *c;
+		else if(c->rc_data != NULL) {
+			rr->rr_data_bytes -= __rr_container_bytes(c);
+			free(c->rc_data);
+		}
+	}
+
+	free(rr->rr_dir);
+	rr->rr_dir = new_dir;
+	rr->rr_dir_size = new_size;
+	rr->rr_last = 0;
+	return 0;
+}
+
+/* Turn a full array container into a bitmap and add low to it */
+static int
+__rr_to_bitmap(dinamite_roaring_t *rr, dinamite_roaring_container_t *c,
+	       uint16_t low) {
+
+	uint16_t *array = (uint16_t *) c->rc_data;
+	uint64_t *bitmap = (uint64_t *)
+		calloc(RR_BITMAP_WORDS, sizeof(uint64_t));
+
+	if(bitmap == NULL)
+		return -1;
+	__dinamite_numa_place(bitmap, RR_BITMAP_WORDS * sizeof(uint64_t),
+			      rr->rr_node);
+
+	for(uint32_t i = 0; i < c->rc_count; i++)
+		bitmap[array[i] >> 6] |= 1ULL << (array[i] & 63);
+	bitmap[low >> 6] |= 1ULL << (low & 63);
+
+	free(array);
+	rr->rr_data_bytes += RR_BITMAP_WORDS * sizeof(uint64_t) -
+		c->rc_max * sizeof(uint16_t);
+	c->rc_data = bitmap;
+	c->rc_max = 0;
+	return 1;
+}
+
+static int
+__rr_array_add(dinamite_roaring_t *rr, dinamite_roaring_container_t *c,
+	       uint16_t low) {
+
+	uint16_t *array = (uint16_t *) c->rc_data;
+	uint32_t lo = 0, hi = c->rc_count;
+
+	/* Values often come in ascending order, check the end first */
+	if(hi > 0 && array[hi - 1] < low)
+		lo = hi;
+	else
+		while(lo < hi) {
+			uint32_t mid = (lo + hi) / 2;
+
+			if(array[mid] < low)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+	if(lo < c->rc_count && array[lo] == low)
+		return 0;
+
+	if(c->rc_count == c->rc_max) {
+		if(c->rc_max == RR_ARRAY_MAX)
+			return __rr_to_bitmap(rr, c, low);
+
+		if( (array = (uint16_t *)
+		     realloc(array, sizeof(uint16_t) * c->rc_max * 2)) == NULL)
+			return -1;
+		rr->rr_data_bytes += sizeof(uint16_t) * c->rc_max;
+		c->rc_data = array;
+		c->rc_max *= 2;
+	}
+
+	memmove(&array[lo + 1], &array[lo],
+		sizeof(uint16_t) * (c->rc_count - lo));
+	array[lo] = low;
+	return 1;
+}
+
+static int
+__rr_bitmap_add(dinamite_roaring_container_t *c, uint16_t low) {
+
+	uint64_t *word = &((uint64_t *) c->rc_data)[low >> 6];
+	uint64_t bit = 1ULL << (low & 63);
+
+	if(*word & bit)
+		return 0;
+	*word |= bit;
+	return 1;
+}
+
+/*
+ * Returns 1 if the value was inserted, 0 if it was already there and -1 if
+ * we failed to allocate memory.
+ */
+int
+dinamite_roaring_put(dinamite_roaring_t *rr, uint64_t value) {
+
+	uint64_t key = RR_KEY(value);
+	dinamite_roaring_container_t *c = &rr->rr_dir[rr->rr_last];
+	int ret;
+
+	/* Consecutive puts usually hit the same container */
+	if(!RR_LIVE(rr, c) || c->rc_key != key) {
+		c = __rr_find_slot(rr, rr->rr_dir, rr->rr_dir_size, key);
+		if(!RR_LIVE(rr, c)) {
+			if(rr->rr_num_containers + 1 > rr->rr_dir_size / 2) {
+				if(__rr_grow_dir(rr) != 0)
+					return -1;
+				c = __rr_find_slot(rr, rr->rr_dir,
+						   rr->rr_dir_size, key);
+			}
+			/* Reuse the memory of a stale container */
+			if(c->rc_data != NULL && c->rc_max == 0)
+				memset(c->rc_data, 0,
+				       sizeof(uint64_t) * RR_BITMAP_WORDS);
+			else if(c->rc_data == NULL) {
+				if( (c->rc_data = malloc(sizeof(uint16_t) *
+							 RR_INIT_ARRAY))
+				    == NULL)
+					return -1;
+				c->rc_max = RR_INIT_ARRAY;
+				rr->rr_data_bytes +=
+					sizeof(uint16_t) * RR_INIT_ARRAY;
+			}
+			c->rc_key = key;
+			c->rc_count = 0;
+			c->rc_epoch = rr->rr_epoch;
+			rr->rr_num_containers++;
+		}
+		rr->rr_last = c - rr->rr_dir;
+	}
+
+	if(c->rc_max != 0)
+		ret = __rr_array_add(rr, c, RR_LOW(value));
+	else
+		ret = __rr_bitmap_add(c, RR_LOW(value));
+
+	if(ret == 1) {
+		c->rc_count++;
+		rr->rr_num_entries++;
+	}
+	return ret;
+}
+
+int
+dinamite_roaring_contains(dinamite_roaring_t *rr, uint64_t value) {
+
+	dinamite_roaring_container_t *c =
+		__rr_find_slot(rr, rr->rr_dir, rr->rr_dir_size, RR_KEY(value));
+	uint16_t low = RR_LOW(value), *array;
+	uint32_t lo = 0, hi;
+
+	if(!RR_LIVE(rr, c))
+		return 0;
+	if(c->rc_max == 0)
+		return (((uint64_t *) c->rc_data)[low >> 6] >> (low & 63)) & 1;
+
+	array = (uint16_t *) c->rc_data;
+	hi = c->rc_count;
+	while(lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+
+		if(array[mid] < low)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < c->rc_count && array[lo] == low;
+}
+
+void
+dinamite_roaring_begin_iterate(dinamite_roaring_t *rr) {
+
+	rr->rr_iter_slot = 0;
+	rr->rr_iter_pos = 0;
+}
+
+int
+dinamite_roaring_getnext(dinamite_roaring_t *rr, uint64_t *value_ptr) {
+
+	while(rr->rr_iter_slot < rr->rr_dir_size) {
+		dinamite_roaring_container_t *c = &rr->rr_dir[rr->rr_iter_slot];
+
+		if(RR_LIVE(rr, c) && c->rc_max != 0) {
+			if(rr->rr_iter_pos < c->rc_count) {
+				*value_ptr = (c->rc_key << 16) |
+					((uint16_t *) c->rc_data)
+					[rr->rr_iter_pos++];
+				return 0;
+			}
+		}
+		else if(RR_LIVE(rr, c)) {
+			uint64_t *bitmap = (uint64_t *) c->rc_data;
+
+			while(rr->rr_iter_pos < RR_BITMAP_WORDS * 64) {
+				uint64_t word = bitmap[rr->rr_iter_pos >> 6] >>
+					(rr->rr_iter_pos & 63);
+
+				if(word != 0) {
+					rr->rr_iter_pos += __builtin_ctzll(word);
+					*value_ptr = (c->rc_key << 16) |
+						rr->rr_iter_pos++;
+					return 0;
+				}
+				rr->rr_iter_pos = (rr->rr_iter_pos | 63) + 1;
+			}
+		}
+		rr->rr_iter_slot++;
+		rr->rr_iter_pos = 0;
+	}
+	return -1;
+}
+
+/*
+ * Continue the iteration, decoding up to max values into buf. Returns the
+ * number of values decoded, 0 once the iteration is over.
+ */
+size_t
+dinamite_roaring_getnext_bulk(dinamite_roaring_t *rr, uint64_t *buf,
+			      size_t max) {
+
+	size_t n = 0;
+
+	while(rr->rr_iter_slot < rr->rr_dir_size && n < max) {
+		dinamite_roaring_container_t *c = &rr->rr_dir[rr->rr_iter_slot];
+		uint64_t high = c->rc_key << 16;
+
+		if(RR_LIVE(rr, c) && c->rc_max != 0) {
+			uint16_t *array = (uint16_t *) c->rc_data;
+
+			while(rr->rr_iter_pos < c->rc_count && n < max)
+				buf[n++] = high | array[rr->rr_iter_pos++];
+			if(rr->rr_iter_pos < c->rc_count)
+				break;
+		}
+		else if(RR_LIVE(rr, c)) {
+			uint64_t *bitmap = (uint64_t *) c->rc_data;
+
+			while(rr->rr_iter_pos < RR_BITMAP_WORDS * 64 && n < max) {
+				uint64_t word = bitmap[rr->rr_iter_pos >> 6] >>
+					(rr->rr_iter_pos & 63);
+
+				if(word == 0) {
+					rr->rr_iter_pos =
+						(rr->rr_iter_pos | 63) + 1;
+					continue;
+				}
+				rr->rr_iter_pos += __builtin_ctzll(word);
+				buf[n++] = high | rr->rr_iter_pos++;
+			}
+			if(rr->rr_iter_pos < RR_BITMAP_WORDS * 64)
+				break;
+		}
+		rr->rr_iter_slot++;
+		rr->rr_iter_pos = 0;
+	}
+	return n;
+}
+
+/*
+ * Empty the set in constant time, keeping the containers' memory. Once
+ * every 2^32 resets the epoch wraps around; we then free the containers, so
+ * that none of them can look current by accident.
+ */
+void
+dinamite_roaring_reset(dinamite_roaring_t *rr) {
+
+	rr->rr_num_containers = 0;
+	rr->rr_num_entries = 0;
+	rr->rr_last = 0;
+	rr->rr_iter_slot = 0;
+	rr->rr_iter_pos = 0;
+
+	if(++rr->rr_epoch == 0) {
+		for(uint64_t i = 0; i < rr->rr_dir_size; i++) {
+			free(rr->rr_dir[i].rc_data);
+			rr->rr_dir[i].rc_data = NULL;
+		}
+		rr->rr_data_bytes = 0;
+	}
+}
+
+void
+dinamite_roaring_free(dinamite_roaring_t *rr) {
+
+	for(uint64_t i = 0; i < rr->rr_dir_size; i++)
+		free(rr->rr_dir[i].rc_data);
+	free(rr->rr_dir);
+	memset(rr, 0, sizeof(*rr));
+}
+
+/* The bytes held by the directory and the containers */
+uint64_t
+dinamite_roaring_memory(dinamite_roaring_t *rr) {
+
+	return rr->rr_dir_size * sizeof(dinamite_roaring_container_t) +
+		rr->rr_data_bytes;
+}
+
+/* The pages of the directory and the bitmaps not on the table's node */
+uint64_t
+dinamite_roaring_remote_pages(dinamite_roaring_t *rr) {
+
+	uint64_t remote = __dinamite_numa_remote_pages(
+		rr->rr_dir, rr->rr_dir_size *
+		sizeof(dinamite_roaring_container_t), rr->rr_node);
+
+	for(uint64_t i = 0; i < rr->rr_dir_size; i++)
+		if(rr->rr_dir[i].rc_data != NULL && rr->rr_dir[i].rc_max == 0)
+			remote += __dinamite_numa_remote_pages(
+				rr->rr_dir[i].rc_data,
+				RR_BITMAP_WORDS * sizeof(uint64_t),
+				rr->rr_node);
+	return remote;
+}
+
+/* Report the number of values in each directory slot, zero if it is free */
+void
+dinamite_roaring_container_sizes(dinamite_roaring_t *rr,
+				 void (*cb)(void *arg, uint64_t len),
+				 void *arg) {
+
+	for(uint64_t i = 0; i < rr->rr_dir_size; i++)
+		cb(arg, RR_LIVE(rr, &rr->rr_dir[i]) ?
+		   rr->rr_dir[i].rc_count : 0);
+}
+
+/*
+ * Decode all values into a buffer, handing it to the callback every
+ * RR_VISIT_CHUNK values. Like the iteration, but without touching the
+ * iteration state.
+ */
+void
+dinamite_roaring_visit_chunks(dinamite_roaring_t *rr,
+			      void (*cb)(void *arg, const uint64_t *values,
+					 size_t n),
+			      void *arg) {
+
+	uint64_t buf[RR_VISIT_CHUNK];
+	size_t n = 0;
+
+	for(uint64_t i = 0; i < rr->rr_dir_size; i++) {
+		dinamite_roaring_container_t *c = &rr->rr_dir[i];
+		uint64_t high = c->rc_key << 16;
+
+		if(!RR_LIVE(rr, c))
+			continue;
+
+		if(c->rc_max != 0) {
+			uint16_t *array = (uint16_t *) c->rc_data;
+
+			for(uint32_t j = 0; j < c->rc_count; j++) {
+				buf[n++] = high | array[j];
+				if(n == RR_VISIT_CHUNK) {
+					cb(arg, buf, n);
+					n = 0;
+				}
+			}
+			continue;
+		}
+
+		for(uint32_t w = 0; w < RR_BITMAP_WORDS; w++) {
+			uint64_t word = ((uint64_t *) c->rc_data)[w];
+
+			while(word != 0) {
+				buf[n++] = high | (w * 64 +
+						   __builtin_ctzll(word));
+				word &= word - 1;
+				if(n == RR_VISIT_CHUNK) {
+					cb(arg, buf, n);
+					n = 0;
+				}
+			}
+		}
+	}
+	if(n > 0)
+		cb(arg, buf, n);
+}
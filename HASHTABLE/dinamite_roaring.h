@@ -0,0 +1,71 @@
+#ifndef DINAMITE_ROARING_H
+#define DINAMITE_ROARING_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#include "dinamite_ht_hash.h"
+
+/*
+ * A compressed set of 64-bit values in the style of roaring bitmaps. A value
+ * is split into a 48-bit key and its low 16 bits. Each key that occurs has a
+ * container holding the low bits of its values: a sorted array of 16-bit
+ * words while it has up to RR_ARRAY_MAX of them, and a 65536-bit bitmap once
+ * it has more. The containers live in an open-addressing directory indexed by
+ * a hash of the key.
+ *
+ * Clustered addresses (heap arenas, stacks, mappings) share keys, so they
+ * cost at most 2 bytes each, and 1 bit each in dense regions, instead of the
+ * 8 bytes plus slack of the other layouts. Inserting into an array container
+ * moves up to 8KB of memory, so puts are slower.
+ *
+ * Iteration returns the containers in directory order and the values of
+ * each container in ascending order.
+ *
+ * A container from an earlier epoch than the table is logically gone and
+ * its directory slot free. Resetting the table bumps the epoch; the
+ * memory of a stale container is reused by the next key that takes its slot.
+ */
+typedef struct __roaring_container {
+	uint64_t rc_key;          /* The top 48 bits of its values */
+	uint32_t rc_count;
+	uint32_t rc_max;          /* Array capacity, 0 for a bitmap */
+	uint32_t rc_epoch;
+	void *rc_data;            /* NULL if the slot was never used */
+} dinamite_roaring_container_t;
+
+typedef struct __roaring {
+	dinamite_roaring_container_t *rr_dir;
+	uint64_t rr_dir_size;     /* Always a power of two */
+	uint64_t rr_num_containers;
+	uint64_t rr_num_entries;
+	uint64_t rr_data_bytes;   /* Memory held by the containers */
+	uint64_t rr_last;         /* Directory slot of the last put */
+	uint64_t rr_iter_slot;
+	uint32_t rr_iter_pos;     /* Array index, or bit in the bitmap */
+	uint32_t rr_epoch;
+	int rr_hash;              /* Hash family, see dinamite_ht_hash.h */
+	int rr_node;              /* NUMA node of the memory, or -1 */
+} dinamite_roaring_t;
+
+int dinamite_roaring_init(dinamite_roaring_t *rr, int hash, int node);
+int dinamite_roaring_put(dinamite_roaring_t *rr, uint64_t value);
+int dinamite_roaring_contains(dinamite_roaring_t *rr, uint64_t value);
+void dinamite_roaring_begin_iterate(dinamite_roaring_t *rr);
+int dinamite_roaring_getnext(dinamite_roaring_t *rr, uint64_t *value_ptr);
+size_t dinamite_roaring_getnext_bulk(dinamite_roaring_t *rr, uint64_t *buf,
+				     size_t max);
+void dinamite_roaring_reset(dinamite_roaring_t *rr);
+void dinamite_roaring_free(dinamite_roaring_t *rr);
+uint64_t dinamite_roaring_memory(dinamite_roaring_t *rr);
+uint64_t dinamite_roaring_remote_pages(dinamite_roaring_t *rr);
+void dinamite_roaring_container_sizes(dinamite_roaring_t *rr,
+				      void (*cb)(void *arg, uint64_t len),
+				      void *arg);
+void dinamite_roaring_visit_chunks(dinamite_roaring_t *rr,
+				   void (*cb)(void *arg,
+					      const uint64_t *values,
+					      size_t n),
+				   void *arg);
+
+#endif
@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dinamite_hashtable.h"
+#include "dinamite_ht_private.h"
+#include "dinamite_snapshot.h"
+
+/*
+ * Values are copied a bucket at a time to the current position in the
+ * mapping of the file.
+ */
+typedef struct __snapshot_cursor {
+	uint64_t *sc_pos;
+	uint64_t sc_left;        /* Room left in the section */
+	int sc_overflow;
+} snapshot_cursor_t;
+
+static void
+__snapshot_copy(void *arg, const uint64_t *values, size_t n) {
+
+	snapshot_cursor_t *cursor = (snapshot_cursor_t *) arg;
+
+	if(n > cursor->sc_left) {
+		cursor->sc_overflow = 1;
+		n = cursor->sc_left;
+	}
+	memcpy(cursor->sc_pos, values, n * sizeof(uint64_t));
+	cursor->sc_pos += n;
+	cursor->sc_left -= n;
+}
+
+/*
+ * Write every table to the file at path, replacing it. The tables must not
+ * change while the snapshot is being written.
+ */
+int
+dinamite_hashtable_snapshot(const char *path) {
+
+	dinamite_hashtable_t **tables;
+	dinamite_snapshot_header_t *header;
+	dinamite_snapshot_section_t *sections;
+	uint64_t file_size, offset;
+	char *base;
+	int fd, i, num_tables, ret = -1;
+
+	if( (tables = __dinamite_ht_all_tables(&num_tables)) == NULL) {
+		fprintf(stderr, "Warning: malloc() returned NULL when "
+			"writing a snapshot\n");
+		return -1;
+	}
+
+	offset = sizeof(dinamite_snapshot_header_t) +
+		sizeof(dinamite_snapshot_section_t) * num_tables;
+	file_size = offset;
+	for(i = 0; i < num_tables; i++)
+		file_size += sizeof(uint64_t) *
+			__dinamite_ht_num_entries(tables[i]);
+
+	if( (fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "Warning: could not create snapshot %s: %s\n",
+			path, strerror(errno));
+		free(tables);
+		return -1;
+	}
+
+	/*
+	 * Reserve the blocks up front: stores into a hole of a sparse file
+	 * that the disk has no room for raise SIGBUS rather than fail.
+	 */
+	if( (errno = posix_fallocate(fd, 0, file_size)) != 0) {
+		fprintf(stderr, "Warning: could not size snapshot %s: %s\n",
+			path, strerror(errno));
+		goto out;
+	}
+
+	base = (char *) mmap(NULL, file_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, fd, 0);
+	if(base == MAP_FAILED) {
+		fprintf(stderr, "Warning: could not map snapshot %s: %s\n",
+			path, strerror(errno));
+		goto out;
+	}
+	madvise(base, file_size, MADV_SEQUENTIAL);
+
+	header = (dinamite_snapshot_header_t *) base;
+	memset(header, 0, sizeof(*header));
+	memcpy(header->dsh_magic, DINAMITE_SNAPSHOT_MAGIC,
+	       sizeof(DINAMITE_SNAPSHOT_MAGIC));
+	header->dsh_version = DINAMITE_SNAPSHOT_VERSION;
+	header->dsh_num_sections = num_tables;
+	header->dsh_file_size = file_size;
+
+	sections = (dinamite_snapshot_section_t *) (header + 1);
+	ret = 0;
+
+	for(i = 0; i < num_tables; i++) {
+		snapshot_cursor_t cursor;
+		uint64_t n = __dinamite_ht_num_entries(tables[i]);
+
+		sections[i].dss_thread_id = __dinamite_ht_thread_id(tables[i]);
+		sections[i].dss_num_values = n;
+		sections[i].dss_offset = offset;
+
+		cursor.sc_pos = (uint64_t *) (base + offset);
+		cursor.sc_left = n;
+		cursor.sc_overflow = 0;
+		__dinamite_ht_visit_chunks(tables[i], __snapshot_copy, &cursor);
+
+		if(cursor.sc_overflow || cursor.sc_left != 0) {
+			fprintf(stderr, "Warning: the hashtable of thread %d "
+				"changed while writing snapshot %s\n",
+				__dinamite_ht_thread_id(tables[i]), path);
+			ret = -1;
+		}
+		offset += n * sizeof(uint64_t);
+	}
+
+	/* Write the pages back now, so that we hear of write errors */
+	if(msync(base, file_size, MS_SYNC) != 0) {
+		fprintf(stderr, "Warning: could not write snapshot %s: %s\n",
+			path, strerror(errno));
+		ret = -1;
+	}
+	munmap(base, file_size);
+
+out:
+	if(close(fd) != 0 && ret == 0) {
+		fprintf(stderr, "Warning: could not write snapshot %s: %s\n",
+			path, strerror(errno));
+		ret = -1;
+	}
+	free(tables);
+	return ret;
+}
+
+/*
+ * Map a snapshot for reading and check that it is well formed.
+ */
+int
+dinamite_snapshot_open(const char *path, dinamite_snapshot_t *snap) {
+
+	const dinamite_snapshot_header_t *header;
+	struct stat st;
+	void *base;
+	uint32_t i;
+	int fd;
+
+	memset(snap, 0, sizeof(*snap));
+
+	if( (fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "Warning: could not open snapshot %s: %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+	if(fstat(fd, &st) != 0 ||
+	   (size_t)st.st_size < sizeof(dinamite_snapshot_header_t)) {
+		fprintf(stderr, "Warning: %s is not a snapshot\n", path);
+		close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED) {
+		fprintf(stderr, "Warning: could not map snapshot %s: %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	snap->ds_base = base;
+	snap->ds_size = st.st_size;
+	header = (const dinamite_snapshot_header_t *) base;
+
+	if(memcmp(header->dsh_magic, DINAMITE_SNAPSHOT_MAGIC,
+		  sizeof(DINAMITE_SNAPSHOT_MAGIC)) != 0 ||
+	   header->dsh_version != DINAMITE_SNAPSHOT_VERSION ||
+	   header->dsh_file_size != (uint64_t)st.st_size ||
+	   header->dsh_num_sections >
+	   (st.st_size - sizeof(*header)) /
+	   sizeof(dinamite_snapshot_section_t))
+		goto corrupt;
+
+	snap->ds_num_sections = header->dsh_num_sections;
+	snap->ds_sections = (const dinamite_snapshot_section_t *) (header + 1);
+
+	for(i = 0; i < snap->ds_num_sections; i++) {
+		const dinamite_snapshot_section_t *s = &snap->ds_sections[i];
+
+		if(s->dss_offset % sizeof(uint64_t) != 0 ||
+		   s->dss_offset > snap->ds_size ||
+		   s->dss_num_values >
+		   (snap->ds_size - s->dss_offset) / sizeof(uint64_t))
+			goto corrupt;
+	}
+	return 0;
+
+corrupt:
+	fprintf(stderr, "Warning: snapshot %s is corrupt or has an "
+		"unsupported version\n", path);
+	dinamite_snapshot_close(snap);
+	return -1;
+}
+
+/*
+ * Return the thread ID and the values of section i. The values point into
+ * the mapping and stay valid until the snapshot is closed.
+ */
+int
+dinamite_snapshot_section(const dinamite_snapshot_t *snap, uint32_t i,
+			  int64_t *thread_id, const uint64_t **values,
+			  uint64_t *num_values) {
+
+	const dinamite_snapshot_section_t *s;
+
+	if(i >= snap->ds_num_sections)
+		return -1;
+
+	s = &snap->ds_sections[i];
+	*thread_id = s->dss_thread_id;
+	*values = (const uint64_t *) ((const char *) snap->ds_base +
+				      s->dss_offset);
+	*num_values = s->dss_num_values;
+	return 0;
+}
+
+void
+dinamite_snapshot_close(dinamite_snapshot_t *snap) {
+
+	if(snap->ds_base != NULL)
+		munmap((void *) snap->ds_base, snap->ds_size);
+	memset(snap, 0, sizeof(*snap));
+}
@@ -0,0 +1,52 @@
+#ifndef DINAMITE_SNAPSHOT_H
+#define DINAMITE_SNAPSHOT_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+/*
+ * A binary snapshot of the per-thread hashtables. The file is a header,
+ * a table of sections (one per thread) and then each section's values as a
+ * plain array of native-endian 64-bit words:
+ *
+ *   header:  magic "DHTSNAP", version, number of sections, file size
+ *   section: thread ID (-1 for thread-local tables), count, offset
+ *   values:  count words at offset, for every section
+ *
+ * The writer copies whole buckets straight into a mapping of the file, and
+ * the reader maps the file and hands out pointers into the mapping, so
+ * neither side makes a call or a copy per value.
+ */
+#define DINAMITE_SNAPSHOT_MAGIC "DHTSNAP"
+#define DINAMITE_SNAPSHOT_VERSION 1
+
+typedef struct __dinamite_snapshot_header {
+	char dsh_magic[8];
+	uint32_t dsh_version;
+	uint32_t dsh_num_sections;
+	uint64_t dsh_file_size;
+} dinamite_snapshot_header_t;
+
+typedef struct __dinamite_snapshot_section {
+	int64_t dss_thread_id;
+	uint64_t dss_num_values;
+	uint64_t dss_offset;
+} dinamite_snapshot_section_t;
+
+/* Write the tables of all threads to the file; 0 on success, -1 on error */
+int dinamite_hashtable_snapshot(const char *path);
+
+typedef struct __dinamite_snapshot {
+	const void *ds_base;
+	size_t ds_size;
+	uint32_t ds_num_sections;
+	const dinamite_snapshot_section_t *ds_sections;
+} dinamite_snapshot_t;
+
+int dinamite_snapshot_open(const char *path, dinamite_snapshot_t *snap);
+int dinamite_snapshot_section(const dinamite_snapshot_t *snap, uint32_t i,
+			      int64_t *thread_id, const uint64_t **values,
+			      uint64_t *num_values);
+void dinamite_snapshot_close(dinamite_snapshot_t *snap);
+
+#endif
@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dinamite_ht_hash.h"
+#include "dinamite_ht_numa.h"
+#include "dinamite_swisstable.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define ST_MASK_SHIFT 0
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define ST_MASK_SHIFT 0
+#else
+#define ST_MASK_SHIFT 3
+#endif
+
+#define ST_INIT_GROUPS 16
+#define ST_CTRL_EMPTY 0x80
+
+/*
+ * We grow once the table is 7/8 full. Since nothing is ever deleted, the
+ * first empty slot on the probe sequence both terminates a lookup and is
+ * the place where the new value goes.
+ */
+#define ST_MAX_LOAD(slots) ((slots) - (slots) / 8)
+
+/*
+ * A group mask has one bit per slot in the group (the SWAR fallback uses
+ * the high bit of each byte instead, hence ST_MASK_SHIFT).
+ */
+typedef uint64_t st_mask_t;
+
+#if defined(__AVX2__)
+
+static inline st_mask_t
+__st_match(const uint8_t *group, uint8_t tag) {
+
+	__m256i ctrl = _mm256_load_si256((const __m256i *)group);
+	return (uint32_t)_mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8((char)tag)));
+}
+
+static inline st_mask_t
+__st_match_empty(const uint8_t *group) {
+
+	/* Only EMPTY has the high bit set */
+	return (uint32_t)_mm256_movemask_epi8(
+		_mm256_load_si256((const __m256i *)group));
+}
+
+#elif defined(__SSE2__)
+
+static inline st_mask_t
+__st_match(const uint8_t *group, uint8_t tag) {
+
+	__m128i ctrl = _mm_load_si128((const __m128i *)group);
+	return (uint32_t)_mm_movemask_epi8(
+		_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+}
+
+static inline st_mask_t
+__st_match_empty(const uint8_t *group) {
+
+	/* Only EMPTY has the high bit set */
+	return (uint32_t)_mm_movemask_epi8(
+		_mm_load_si128((const __m128i *)group));
+}
+
+#else
+
+#define ST_LSBS 0x0101010101010101ULL
+#define ST_MSBS 0x8080808080808080ULL
+
+/*
+ * The classic "has zero byte" trick. It may report a false positive for a
+ * byte that follows a true match, which is fine: we compare the values.
+ */
+static inline st_mask_t
+__st_match(const uint8_t *group, uint8_t tag) {
+
+	uint64_t ctrl, x;
+
+	memcpy(&ctrl, group, sizeof(ctrl));
+	x = ctrl ^ (ST_LSBS * tag);
+	return (x - ST_LSBS) & ~x & ST_MSBS;
+}
+
+static inline st_mask_t
+__st_match_empty(const uint8_t *group) {
+
+	uint64_t ctrl;
+
+	memcpy(&ctrl, group, sizeof(ctrl));
+	return ctrl & ST_MSBS;
+}
+
+#endif
+
+#define ST_MASK_FIRST(mask) (__builtin_ctzll(mask) >> ST_MASK_SHIFT)
+
+/*
+ * The low bits of the hash pick the group, the top seven bits are the tag
+ * stored in the control byte.
+ */
+#define ST_HASH(st, value) dinamite_ht_hash((st)->st_hash, (value))
+#define ST_TAG(hash) ((uint8_t)((hash) >> 57))
+
+static int
+__st_alloc(dinamite_swisstable_t *st, uint64_t num_groups) {
+
+	uint64_t num_slots = num_groups * ST_GROUP_WIDTH;
+	void *ctrl;
+
+	if(posix_memalign(&ctrl, ST_GROUP_WIDTH, num_slots) != 0)
+		return -1;
+
+	st->st_slots = (uint64_t *) malloc(sizeof(uint64_t) * num_slots);
+	st->st_group_epoch = (uint32_t *) calloc(num_groups, sizeof(uint32_t));
+	if(st->st_slots == NULL || st->st_group_epoch == NULL) {
+		free(ctrl);
+		free(st->st_slots);
+		free(st->st_group_epoch);
+		return -1;
+	}
+
+	/* Before we touch them */
+	__dinamite_numa_place(ctrl, num_slots, st->st_node);
+	__dinamite_numa_place(st->st_slots, sizeof(uint64_t) * num_slots,
+			      st->st_node);
+	__dinamite_numa_place(st->st_group_epoch,
+			      sizeof(uint32_t) * num_groups, st->st_node);
+
+	memset(ctrl, ST_CTRL_EMPTY, num_slots);
+	st->st_ctrl = (uint8_t *) ctrl;
+	st->st_num_groups = num_groups;
+	st->st_epoch = 0;
+	st->st_num_entries = 0;
+	st->st_growth_left = ST_MAX_LOAD(num_slots);
+	st->st_iter_marker = 0;
+	return 0;
+}
+
+/* The control bytes of a group, emptied first if they are stale */
+static inline const uint8_t *
+__st_group_ctrl(dinamite_swisstable_t *st, uint64_t group) {
+
+	uint8_t *ctrl = &st->st_ctrl[group * ST_GROUP_WIDTH];
+
+	if(st->st_group_epoch[group] != st->st_epoch) {
+		memset(ctrl, ST_CTRL_EMPTY, ST_GROUP_WIDTH);
+		st->st_group_epoch[group] = st->st_epoch;
+	}
+	return ctrl;
+}
+
+/* Whether slot i holds a value of the current epoch */
+static inline int
+__st_slot_full(const dinamite_swisstable_t *st, uint64_t i) {
+
+	return st->st_ctrl[i] != ST_CTRL_EMPTY &&
+		st->st_group_epoch[i / ST_GROUP_WIDTH] == st->st_epoch;
+}
+
+/*
+ * Find the first empty slot on the probe sequence of the given hash.
+ * The table always has empty slots, so this terminates.
+ */
+static inline uint64_t
+__st_find_empty(dinamite_swisstable_t *st, uint64_t hash) {
+
+	uint64_t group_mask = st->st_num_groups - 1;
+	uint64_t group = hash & group_mask;
+	uint64_t step = 0;
+	st_mask_t empty;
+
+	while((empty = __st_match_empty(__st_group_ctrl(st, group))) == 0)
+		group = (group + ++step) & group_mask;
+
+	return group * ST_GROUP_WIDTH + ST_MASK_FIRST(empty);
+}
+
+/*
+ * Double the number of groups and reinsert everything. The values are known
+ * to be distinct, so we only need to look for empty slots.
+ */
+static int
+__st_grow(dinamite_swisstable_t *st) {
+
+	dinamite_swisstable_t old = *st;
+	uint64_t i, num_slots = old.st_num_groups * ST_GROUP_WIDTH;
+
+	if(__st_alloc(st, old.st_num_groups * 2) != 0) {
+		*st = old;
+		return -1;
+	}
+
+	for(i = 0; i < num_slots; i++) {
+		uint64_t hash, slot;
+
+		if(!__st_slot_full(&old, i))
+			continue;
+
+		hash = ST_HASH(st, old.st_slots[i]);
+		slot = __st_find_empty(st, hash);
+		st->st_ctrl[slot] = ST_TAG(hash);
+		st->st_slots[slot] = old.st_slots[i];
+	}
+
+	st->st_num_entries = old.st_num_entries;
+	st->st_growth_left -= old.st_num_entries;
+
+	free(old.st_ctrl);
+	free(old.st_slots);
+	free(old.st_group_epoch);
+	return 0;
+}
+
+/* The arrays go on the given NUMA node, or anywhere if it is -1 */
+int
+dinamite_swisstable_init(dinamite_swisstable_t *st, int hash, int node) {
+
+	st->st_hash = hash;
+	st->st_node = node;
+	return __st_alloc(st, ST_INIT_GROUPS);
+}
+
+/*
+ * Start out large enough to hold the given number of entries without
+ * growing.
+ */
+int
+dinamite_swisstable_init_size(dinamite_swisstable_t *st, int hash,
+			      uint64_t entries, int node) {
+
+	uint64_t num_groups = ST_INIT_GROUPS;
+
+	while(ST_MAX_LOAD(num_groups * ST_GROUP_WIDTH) < entries)
+		num_groups *= 2;
+
+	st->st_hash = hash;
+	st->st_node = node;
+	return __st_alloc(st, num_groups);
+}
+
+/*
+ * Returns 1 if the value was inserted, 0 if it was already there and -1 if
+ * we needed to grow the table, but could not allocate the memory.
+ */
+int
+dinamite_swisstable_put(dinamite_swisstable_t *st, uint64_t value) {
+
+	return dinamite_swisstable_put_hash(st, value, ST_HASH(st, value));
+}
+
+/*
+ * The same, with the value's hash computed by the caller, as
+ * dinamite_swisstable_hash() does.
+ */
+int
+dinamite_swisstable_put_hash(dinamite_swisstable_t *st, uint64_t value,
+			     uint64_t hash) {
+
+	uint64_t group_mask = st->st_num_groups - 1;
+	uint64_t group = hash & group_mask;
+	uint64_t step = 0, slot;
+	uint8_t tag = ST_TAG(hash);
+
+	for(;;) {
+		const uint8_t *ctrl = __st_group_ctrl(st, group);
+		st_mask_t match = __st_match(ctrl, tag);
+
+		while(match) {
+			slot = group * ST_GROUP_WIDTH + ST_MASK_FIRST(match);
+			if(st->st_slots[slot] == value)
+				return 0;
+			match &= match - 1;
+		}
+
+		st_mask_t empty = __st_match_empty(ctrl);
+		if(empty) {
+			slot = group * ST_GROUP_WIDTH + ST_MASK_FIRST(empty);
+			break;
+		}
+		group = (group + ++step) & group_mask;
+	}
+
+	/* The value is not there. Add it, growing the table if it is full. */
+	if(st->st_growth_left == 0) {
+		if(__st_grow(st) != 0)
+			return -1;
+		slot = __st_find_empty(st, hash);
+	}
+
+	st->st_ctrl[slot] = tag;
+	st->st_slots[slot] = value;
+	st->st_num_entries++;
+	st->st_growth_left--;
+	return 1;
+}
+
+int
+dinamite_swisstable_contains(dinamite_swisstable_t *st, uint64_t value) {
+
+	uint64_t hash = ST_HASH(st, value);
+	uint64_t group_mask = st->st_num_groups - 1;
+	uint64_t group = hash & group_mask;
+	uint64_t step = 0;
+	uint8_t tag = ST_TAG(hash);
+
+	for(;;) {
+		const uint8_t *ctrl = __st_group_ctrl(st, group);
+		st_mask_t match = __st_match(ctrl, tag);
+
+		while(match) {
+			if(st->st_slots[group * ST_GROUP_WIDTH +
+					ST_MASK_FIRST(match)] == value)
+				return 1;
+			match &= match - 1;
+		}
+		if(__st_match_empty(ctrl))
+			return 0;
+		group = (group + ++step) & group_mask;
+	}
+}
+
+void
+dinamite_swisstable_begin_iterate(dinamite_swisstable_t *st) {
+
+	st->st_iter_marker = 0;
+}
+
+int
+dinamite_swisstable_getnext(dinamite_swisstable_t *st, uint64_t *value_ptr) {
+
+	uint64_t num_slots = st->st_num_groups * ST_GROUP_WIDTH;
+	uint64_t i;
+
+	for(i = st->st_iter_marker; i < num_slots; i++)
+		if(__st_slot_full(st, i)) {
+			*value_ptr = st->st_slots[i];
+			st->st_iter_marker = i + 1;
+			return 0;
+		}
+
+	st->st_iter_marker = num_slots;
+	return -1;
+}
+
+/*
+ * Continue the iteration, copying up to max values to buf. Returns the
+ * number of values copied, 0 once the iteration is over. Stale groups are
+ * skipped whole.
+ */
+size_t
+dinamite_swisstable_getnext_bulk(dinamite_swisstable_t *st, uint64_t *buf,
+				 size_t max) {
+
+	uint64_t num_slots = st->st_num_groups * ST_GROUP_WIDTH;
+	uint64_t i = st->st_iter_marker;
+	size_t n = 0;
+
+	while(i < num_slots && n < max) {
+		uint64_t group = i / ST_GROUP_WIDTH;
+		uint64_t end = (group + 1) * ST_GROUP_WIDTH;
+
+		if(st->st_group_epoch[group] != st->st_epoch) {
+			i = end;
+			continue;
+		}
+		for(; i < end && n < max; i++)
+			if(st->st_ctrl[i] != ST_CTRL_EMPTY)
+				buf[n++] = st->st_slots[i];
+	}
+
+	st->st_iter_marker = i;
+	return n;
+}
+
+/*
+ * Empty the table in constant time, keeping its memory. Once every 2^32
+ * resets, the epoch wraps around and we empty the groups for real.
+ */
+void
+dinamite_swisstable_reset(dinamite_swisstable_t *st) {
+
+	uint64_t num_slots = st->st_num_groups * ST_GROUP_WIDTH;
+
+	st->st_num_entries = 0;
+	st->st_growth_left = ST_MAX_LOAD(num_slots);
+	st->st_iter_marker = 0;
+
+	if(++st->st_epoch == 0) {
+		memset(st->st_ctrl, ST_CTRL_EMPTY, num_slots);
+		memset(st->st_group_epoch, 0,
+		       sizeof(uint32_t) * st->st_num_groups);
+	}
+}
+
+void
+dinamite_swisstable_free(dinamite_swisstable_t *st) {
+
+	free(st->st_ctrl);
+	free(st->st_slots);
+	free(st->st_group_epoch);
+	memset(st, 0, sizeof(*st));
+}
+
+uint64_t
+dinamite_swisstable_capacity(dinamite_swisstable_t *st) {
+
+	return st->st_num_groups * ST_GROUP_WIDTH;
+}
+
+/* The pages of the arrays that are not on the table's node */
+uint64_t
+dinamite_swisstable_remote_pages(dinamite_swisstable_t *st) {
+
+	uint64_t num_slots = st->st_num_groups * ST_GROUP_WIDTH;
+
+	return __dinamite_numa_remote_pages(st->st_ctrl, num_slots,
+					    st->st_node) +
+		__dinamite_numa_remote_pages(st->st_slots,
+					     sizeof(uint64_t) * num_slots,
+					     st->st_node) +
+		__dinamite_numa_remote_pages(st->st_group_epoch,
+					     sizeof(uint32_t) *
+					     st->st_num_groups, st->st_node);
+}
+
+/*
+ * Report, for every entry, how many groups a lookup of that entry probes.
+ * One means that the entry sits in its home group.
+ */
+void
+dinamite_swisstable_probe_lengths(dinamite_swisstable_t *st,
+				  void (*cb)(void *arg, uint64_t len),
+				  void *arg) {
+
+	uint64_t group_mask = st->st_num_groups - 1;
+	uint64_t i, num_slots = st->st_num_groups * ST_GROUP_WIDTH;
+
+	for(i = 0; i < num_slots; i++) {
+		uint64_t group, step = 0;
+
+		if(!__st_slot_full(st, i))
+			continue;
+
+		group = ST_HASH(st, st->st_slots[i]) & group_mask;
+		while(group != i / ST_GROUP_WIDTH)
+			group = (group + ++step) & group_mask;
+		cb(arg, step + 1);
+	}
+}
+
+/*
+ * Hand the values to the callback in chunks of up to ST_VISIT_CHUNK.
+ */
+#define ST_VISIT_CHUNK 256
+
+void
+dinamite_swisstable_visit_chunks(dinamite_swisstable_t *st,
+				 void (*cb)(void *arg, const uint64_t *values,
+					    size_t n),
+				 void *arg) {
+
+	uint64_t buf[ST_VISIT_CHUNK];
+	uint64_t i, num_slots = st->st_num_groups * ST_GROUP_WIDTH;
+	size_t n = 0;
+
+	for(i = 0; i < num_slots; i++) {
+		if(!__st_slot_full(st, i))
+			continue;
+		buf[n++] = st->st_slots[i];
+		if(n == ST_VISIT_CHUNK) {
+			cb(arg, buf, n);
+			n = 0;
+		}
+	}
+	if(n > 0)
+		cb(arg, buf, n);
+}
@@ -0,0 +1,92 @@
+#ifndef DINAMITE_SWISSTABLE_H
+#define DINAMITE_SWISSTABLE_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#include "dinamite_ht_hash.h"
+
+/* The number of control bytes we compare at once */
+#if defined(__AVX2__)
+#define ST_GROUP_WIDTH 32
+#elif defined(__SSE2__)
+#define ST_GROUP_WIDTH 16
+#else
+#define ST_GROUP_WIDTH 8
+#endif
+
+/*
+ * An open-addressing set of 64-bit values laid out in the style of Swiss
+ * tables. Slots are organized in groups; each slot has a control byte that
+ * is either EMPTY or holds the top seven bits of the value's hash. A lookup
+ * compares the whole group of control bytes against the hash tag at once
+ * (AVX2, SSE2 or a portable SWAR fallback) and only touches the slots whose
+ * tags match.
+ *
+ * Unlike the chained layout, any 64-bit value, including zero, can be stored.
+ *
+ * Each group also has an epoch. A group whose epoch is not the table's is
+ * logically empty, whatever its control bytes say, and its control bytes
+ * are emptied the next time a probe reaches it. Resetting the table just
+ * bumps the table's epoch.
+ */
+typedef struct __swisstable {
+	uint8_t *st_ctrl;         /* One control byte per slot */
+	uint64_t *st_slots;       /* The values */
+	uint32_t *st_group_epoch; /* One epoch per group */
+	uint32_t st_epoch;
+	uint64_t st_num_groups;   /* Always a power of two */
+	uint64_t st_num_entries;
+	uint64_t st_growth_left;  /* Inserts left before we must grow */
+	uint64_t st_iter_marker;  /* Next slot to look at when iterating */
+	int st_hash;              /* Hash family, see dinamite_ht_hash.h */
+	int st_node;              /* NUMA node of the arrays, or -1 */
+} dinamite_swisstable_t;
+
+int dinamite_swisstable_init(dinamite_swisstable_t *st, int hash, int node);
+int dinamite_swisstable_init_size(dinamite_swisstable_t *st, int hash,
+				  uint64_t entries, int node);
+int dinamite_swisstable_put(dinamite_swisstable_t *st, uint64_t value);
+void dinamite_swisstable_begin_iterate(dinamite_swisstable_t *st);
+int dinamite_swisstable_getnext(dinamite_swisstable_t *st,
+				uint64_t *value_ptr);
+size_t dinamite_swisstable_getnext_bulk(dinamite_swisstable_t *st,
+					uint64_t *buf, size_t max);
+int dinamite_swisstable_put_hash(dinamite_swisstable_t *st, uint64_t value,
+				 uint64_t hash);
+int dinamite_swisstable_contains(dinamite_swisstable_t *st, uint64_t value);
+void dinamite_swisstable_reset(dinamite_swisstable_t *st);
+void dinamite_swisstable_free(dinamite_swisstable_t *st);
+uint64_t dinamite_swisstable_capacity(dinamite_swisstable_t *st);
+uint64_t dinamite_swisstable_remote_pages(dinamite_swisstable_t *st);
+void dinamite_swisstable_probe_lengths(dinamite_swisstable_t *st,
+				       void (*cb)(void *arg, uint64_t len),
+				       void *arg);
+void dinamite_swisstable_visit_chunks(dinamite_swisstable_t *st,
+				      void (*cb)(void *arg,
+						 const uint64_t *values,
+						 size_t n),
+				      void *arg);
+
+static inline uint64_t
+dinamite_swisstable_hash(dinamite_swisstable_t *st, uint64_t value) {
+
+	return dinamite_ht_hash(st->st_hash, value);
+}
+
+/*
+ * Bring the home group of a hash into the cache ahead of a put. Most values
+ * are found or inserted in their home group.
+ */
+static inline void
+dinamite_swisstable_prefetch(dinamite_swisstable_t *st, uint64_t hash) {
+
+	uint64_t group = hash & (st->st_num_groups - 1);
+
+	__builtin_prefetch(&st->st_group_epoch[group], 1);
+	__builtin_prefetch(&st->st_ctrl[group * ST_GROUP_WIDTH], 1);
+	__builtin_prefetch(&st->st_slots[group * ST_GROUP_WIDTH], 1);
+	__builtin_prefetch(&st->st_slots[(group + 1) * ST_GROUP_WIDTH - 1], 1);
+}
+
+#endif
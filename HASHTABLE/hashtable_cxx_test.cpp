@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "dinamite_hashtable.h"
+#include "dinamite_hashtable.hpp"
+
+/*
+ * Tests of the C++ template version of the hashtable. The C instantiation
+ * must hold the same set as the C library for the same puts; the other
+ * instantiations must behave as sets whatever their parameters; and 32-bit
+ * keys should take about half the memory of 64-bit ones.
+ */
+#define ITEMS 200000
+
+static uint64_t
+usec_since(struct timeval *tv_before) {
+
+	struct timeval tv_after;
+
+	gettimeofday(&tv_after, NULL);
+	return (tv_after.tv_sec - tv_before->tv_sec) * 1000000 +
+		tv_after.tv_usec - tv_before->tv_usec;
+}
+
+/* Pseudo-random addresses with repeats, the same for every table */
+static uint64_t
+key_at(uint64_t i) {
+
+	return (__dinamite_hash_murmur(i % (ITEMS / 2)) & 0xffffffff) << 3;
+}
+
+/* The C instantiation against the C library */
+static void
+test1(void) {
+
+	dinamite::c_hashtable cxx;
+	std::vector<uint64_t> c_keys, cxx_keys;
+	uint64_t value;
+	int inserted = 0;
+
+	printf("Starting Test 1...\n");
+	for(uint64_t i = 0; i < ITEMS; i++) {
+		dinamite_hashtable_put(key_at(i), 0);
+		inserted += cxx.put(key_at(i), 0);
+	}
+
+	dinamite_hashtable_begin_iterate(0);
+	while(dinamite_hashtable_getnext(0, &value) == 0)
+		c_keys.push_back(value);
+	cxx.begin_iterate(0);
+	while(cxx.getnext(0, &value) == 0)
+		cxx_keys.push_back(value);
+
+	std::sort(c_keys.begin(), c_keys.end());
+	std::sort(cxx_keys.begin(), cxx_keys.end());
+	if(c_keys != cxx_keys || (size_t)inserted != cxx_keys.size())
+		printf("test1: the C library has %zu values, the template "
+		       "%zu\n", c_keys.size(), cxx_keys.size());
+
+	if(cxx.put(8, dinamite::c_hashtable::max_threads) != -1 ||
+	   cxx.getnext(1, &value) != -1)
+		printf("test1: used a table that does not exist\n");
+
+	dinamite_hashtable_clear();
+	cxx.clear();
+	printf("Done.\n");
+}
+
+/*
+ * Put, look up, visit and reset one instantiation, and time first puts
+ * and lookups.
+ */
+template<class Table>
+static void
+check_table(const char *name) {
+
+	typedef typename Table::key_type key_type;
+	Table table;
+	struct timeval tv_before;
+	uint64_t put_us, hit_us, sum = 0, expect = 0, count = 0;
+	uint64_t hits = 0, visited = 0, visited_sum = 0, value;
+	key_type key;
+
+	gettimeofday(&tv_before, NULL);
+	for(uint64_t i = 0; i < ITEMS; i++)
+		if(table.put((key_type)key_at(i)) == 1) {
+			expect += (key_type)key_at(i);
+			count++;
+		}
+	put_us = usec_since(&tv_before);
+
+	gettimeofday(&tv_before, NULL);
+	for(uint64_t i = 0; i < ITEMS; i++)
+		hits += table.contains((key_type)key_at(i));
+	hit_us = usec_since(&tv_before);
+
+	if(hits != ITEMS || table.size() != count ||
+	   table.contains((key_type)1))
+		printf("%s: found %lld of %d keys, size %lld of %lld\n", name,
+		       (long long)hits, ITEMS, (long long)table.size(),
+		       (long long)count);
+
+	table.begin_iterate();
+	while(table.getnext(&key) == 0)
+		sum += key;
+	table.visit([&](const key_type *keys, size_t n) {
+			    for(size_t i = 0; i < n; i++)
+				    visited_sum += keys[i];
+			    visited += n;
+		    });
+	if(sum != expect || visited_sum != expect || visited != count)
+		printf("%s: iterated over the wrong keys\n", name);
+
+	value = table.memory();
+	table.reset();
+	if(table.size() != 0 || table.contains((key_type)key_at(0)) ||
+	   table.getnext(&key) == 0 || table.memory() != value)
+		printf("%s: the table is not empty after a reset\n", name);
+
+	printf("%-24s %lld keys in %lld buckets, %.1f bytes/key, "
+	       "put %.1f ns, hit %.1f ns\n", name, (long long)count,
+	       (long long)table.num_buckets(), (double)value / count,
+	       put_us * 1000.0 / ITEMS, hit_us * 1000.0 / ITEMS);
+}
+
+static void
+test2(void) {
+
+	printf("Starting Test 2...\n");
+	check_table<dinamite::hashtable<uint64_t>>("64-bit");
+	check_table<dinamite::hashtable<uint32_t>>("32-bit");
+	check_table<dinamite::hashtable<uint64_t, dinamite::murmur_hash,
+					64, dinamite::grow_at_load<2>>>(
+						"64-bit murmur, load 2");
+	check_table<dinamite::hashtable<uint32_t, dinamite::wymix_hash,
+					64, dinamite::grow_at_load<2>>>(
+						"32-bit wymix, load 2");
+	check_table<dinamite::hashtable<uint32_t, dinamite::mulshift_hash,
+					(1 << 16), dinamite::grow_never>>(
+						"32-bit, fixed buckets");
+	check_table<dinamite::hashtable<uint64_t, dinamite::page_hash,
+					1024, dinamite::grow_never>>(
+						"64-bit page hash");
+	printf("Done.\n");
+}
+
+int main(void) {
+
+	test1();
+	test2();
+}
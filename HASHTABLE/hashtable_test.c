@@ -2,44 +2,69 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #include "dinamite_hashtable.h"
+#include "dinamite_snapshot.h"
 
 
-void test1(void *tid) {
-
+/*
+ * Drain the thread's hashtable and check that it holds exactly the values
+ * multiplier * 1 ... multiplier * ITEMS. The layouts do not agree on the
+ * iteration order, so we only check set membership.
+ */
 #define ITEMS 1024
-	int threadID = (int)tid;
+static void
+check_contents(const char *test, int threadID, uint64_t multiplier) {
 
-	if( threadID == 0 )
-		printf("Starting Test 1...\n");
-
-	for(int i = 1; i <= ITEMS; i++)
-		dinamite_hashtable_put(i, threadID);
+	char seen[ITEMS + 1];
+	uint64_t value;
+	int count = 0;
 
+	memset(seen, 0, sizeof(seen));
 	dinamite_hashtable_begin_iterate(threadID);
 
-	for(int i = 1; i <= ITEMS; i++) {
-		uint64_t value;
+	while(dinamite_hashtable_getnext(threadID, &value) == 0) {
+		uint64_t i = value / multiplier;
 
-		if(dinamite_hashtable_getnext(threadID, &value) != 0) {
-			printf("test1: could not retrieve item %d\n", i);
+		if(value % multiplier != 0 || i < 1 || i > ITEMS) {
+			printf("%s: value error: got unexpected value %lld\n",
+			       test, (long long)value);
 			return;
 		}
-		if(value != i) {
-			printf("test1: value error: got %d, expecting %d\n",
-			       (int)value, i);
+		if(seen[i]++) {
+			printf("%s: value error: got %lld twice\n",
+			       test, (long long)value);
 			return;
 		}
+		count++;
 	}
 
+	if(count != ITEMS)
+		printf("%s: could not retrieve all items: got %d, "
+		       "expecting %d\n", test, count, ITEMS);
+}
+
+void test1(void *tid) {
+
+	int threadID = (int)tid;
+
+	if( threadID == 0 )
+		printf("Starting Test 1...\n");
+
+	for(int i = 1; i <= ITEMS; i++)
+		dinamite_hashtable_put(i, threadID);
+
+	check_contents("test1", threadID, 1);
+
 	if( (int)threadID == 0 )
 		printf("Done.\n");
 }
 
 void test2(void *tid) {
 
-#define ITEMS 1024
 #define MULTIPLIER 1024
 	int threadID = (int)tid;
 
@@ -49,21 +74,11 @@ void test2(void *tid) {
 	for(int i = 1; i <= ITEMS; i++)
 		dinamite_hashtable_put(i * MULTIPLIER, threadID);
 
-	dinamite_hashtable_begin_iterate(threadID);
-
-	for(uint64_t i = 1; i <= ITEMS; i++) {
-		uint64_t value;
+	/* Inserting everything again must not change the contents */
+	for(int i = 1; i <= ITEMS; i++)
+		dinamite_hashtable_put(i * MULTIPLIER, threadID);
 
-		if(dinamite_hashtable_getnext(threadID, &value) != 0) {
-			printf("test2: could not retrieve item %lld\n", i);
-			return;
-		}
-		if(value != i * MULTIPLIER) {
-			printf("test2: value error: got %lld, expecting %lld\n",
-			       value, i * MULTIPLIER);
-			return;
-		}
-	}
+	check_contents("test2", threadID, MULTIPLIER);
 
 	if( threadID == 0 )
 		printf("Done.\n");
@@ -124,13 +139,1488 @@ void test4(void) {
 	printf("Done.\n");
 }
 
-int main(void) {
+static uint64_t
+usec_since(struct timeval *tv_before) {
+
+	struct timeval tv_after;
+
+	gettimeofday(&tv_after, NULL);
+	return (tv_after.tv_sec - tv_before->tv_sec) * 1000000 +
+		(tv_after.tv_usec - tv_before->tv_usec);
+}
+
+static void
+print_stats(int threadID) {
+
+	dinamite_ht_stats_t stats;
+
+	if(dinamite_hashtable_get_stats(threadID, &stats) != 0)
+		return;
+
+	printf("entries: %lld, buckets: %lld, load factor: %.2f, "
+	       "non-empty: %lld, max length: %lld, %.2f bytes/entry%s\n",
+	       (long long)stats.hts_entries, (long long)stats.hts_buckets,
+	       stats.hts_load_factor, (long long)stats.hts_nonempty_buckets,
+	       (long long)stats.hts_max_len,
+	       stats.hts_entries ?
+	       (double)stats.hts_memory / stats.hts_entries : 0.0,
+	       stats.hts_resizing ? " (resizing)" : "");
+	printf("length histogram:");
+	for(int i = 0; i < DINAMITE_HT_HIST_BUCKETS; i++)
+		if(stats.hts_len_hist[i] != 0)
+			printf(" [%lld, %lld): %lld",
+			       (long long)(i == 0 ? 0 : 1LL << (i - 1)),
+			       (long long)(1LL << i),
+			       (long long)stats.hts_len_hist[i]);
+	printf("\n");
+}
+
+/*
+ * Insert throughput on a pointer-like stream: 8-byte aligned addresses
+ * within a 4MB region, about half of them repeated. Afterwards we check
+ * that the table holds every distinct value exactly once, which exercises
+ * resizing.
+ */
+void test5(void) {
+
+#define TEST5_PUTS (1 << 20)
+#define TEST5_BASE 0x7f0000000000ULL
+	struct timeval tv_before;
+	uint64_t x = 88172645463325252ULL, elapsed, value;
+	static char expected[TEST5_PUTS / 2], seen[TEST5_PUTS / 2];
+	int num_expected = 0, num_seen = 0;
+
+	printf("Starting Test 5...\n");
+	memset(expected, 0, sizeof(expected));
+	memset(seen, 0, sizeof(seen));
+	gettimeofday(&tv_before, NULL);
+
+	for(int i = 0; i < TEST5_PUTS; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		dinamite_hashtable_put(TEST5_BASE +
+				       ((x % (TEST5_PUTS / 2)) << 3), 0);
+		if(!expected[x % (TEST5_PUTS / 2)]++)
+			num_expected++;
+	}
+
+	elapsed = usec_since(&tv_before);
+	printf("%d puts in %lld us: %.2f Mputs/s\n", TEST5_PUTS,
+	       (long long)elapsed, (double)TEST5_PUTS / elapsed);
+	print_stats(0);
+
+	dinamite_hashtable_begin_iterate(0);
+	while(dinamite_hashtable_getnext(0, &value) == 0) {
+		uint64_t i = (value - TEST5_BASE) >> 3;
+
+		if(i >= TEST5_PUTS / 2 || !expected[i] || seen[i]++) {
+			printf("test5: value error: got unexpected value "
+			       "%llx\n", (unsigned long long)value);
+			return;
+		}
+		num_seen++;
+	}
+	if(num_seen != num_expected)
+		printf("test5: could not retrieve all items: got %d, "
+		       "expecting %d\n", num_seen, num_expected);
+
+	printf("Done.\n");
+}
+
+/*
+ * Bucket distribution of each hash family on two pointer streams: real heap
+ * pointers from malloc() and addresses one page apart.
+ */
+void test6(void) {
+
+#define TEST6_PTRS (1 << 16)
+	const char *hashes[] = {"page", "mulshift", "murmur", "wymix"};
+	static void *ptrs[TEST6_PTRS];
+
+	printf("Starting Test 6...\n");
+	for(int i = 0; i < TEST6_PTRS; i++)
+		ptrs[i] = malloc(16 + (i % 4) * 16);
+
+	for(int h = DINAMITE_HT_HASH_PAGE; h <= DINAMITE_HT_HASH_WYMIX; h++) {
+
+		dinamite_hashtable_set_hash(h);
+
+		printf("%s hash, heap pointers: ", hashes[h]);
+		for(int i = 0; i < TEST6_PTRS; i++)
+			dinamite_hashtable_put((uint64_t)ptrs[i], 0);
+		print_stats(0);
+		dinamite_hashtable_clear();
+
+		printf("%s hash, page-strided: ", hashes[h]);
+		for(uint64_t i = 0; i < TEST6_PTRS; i++)
+			dinamite_hashtable_put(0x7f0000000000ULL + (i << 12), 0);
+		print_stats(0);
+		dinamite_hashtable_clear();
+	}
+	dinamite_hashtable_set_hash(DINAMITE_HT_HASH_MULSHIFT);
+
+	for(int i = 0; i < TEST6_PTRS; i++)
+		free(ptrs[i]);
+	printf("Done.\n");
+}
+
+/*
+ * At cache line granularity, the 64 addresses of a line are one entry.
+ */
+void test7(void) {
+
+	uint64_t value;
+	int count = 0;
+
+	printf("Starting Test 7...\n");
+	dinamite_hashtable_set_granularity(DINAMITE_HT_GRAN_CACHELINE);
+
+	for(int i = 1; i <= ITEMS * 64; i++)
+		dinamite_hashtable_put(i, 0);
+
+	dinamite_hashtable_begin_iterate(0);
+	while(dinamite_hashtable_getnext(0, &value) == 0) {
+		if(value % 64 != 0)
+			printf("test7: value error: %lld is not rounded "
+			       "down to a cache line\n", (long long)value);
+		count++;
+	}
+	/* 1 ... 64 * ITEMS touches lines 0 ... ITEMS */
+	if(count != ITEMS + 1)
+		printf("test7: got %d cache lines, expecting %d\n",
+		       count, ITEMS + 1);
+
+	dinamite_hashtable_set_granularity(DINAMITE_HT_GRAN_BYTE);
+	printf("Done.\n");
+}
+
+/*
+ * More threads than MAX_THREADS, using thread-local tables. Each thread
+ * drains its own table; the tables must be gone once the threads exit.
+ */
+#define TEST8_THREADS 200
+static void *
+test8_thread(void *arg) {
+
+	uint64_t value, sum = 0;
+	int count = 0;
 
-	test1(0);
+	for(int i = 1; i <= ITEMS; i++) {
+		dinamite_hashtable_tls_put(i * MULTIPLIER);
+		dinamite_hashtable_tls_put(i * MULTIPLIER);
+	}
+
+	dinamite_hashtable_tls_begin_iterate();
+	while(dinamite_hashtable_tls_getnext(&value) == 0) {
+		sum += value / MULTIPLIER;
+		count++;
+	}
+	if(count != ITEMS || sum != (uint64_t)ITEMS * (ITEMS + 1) / 2)
+		printf("test8: got %d items with sum %lld, expecting %d "
+		       "items\n", count, (long long)sum, ITEMS);
+	return NULL;
+}
+
+void test8(void) {
+
+	pthread_t threads[TEST8_THREADS];
+
+	printf("Starting Test 8...\n");
+	for( int i = 0; i < TEST8_THREADS; i++ ) {
+		int ret = pthread_create(&threads[i], NULL, test8_thread, NULL);
+		if(ret != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			exit(-1);
+		}
+	}
+
+	for( int i = 0; i < TEST8_THREADS; i++ ) {
+		int ret = pthread_join(threads[i], NULL);
+		if(ret != 0) {
+			fprintf(stderr, "pthread_join: %s\n", strerror(ret));
+			exit(-1);
+		}
+	}
+
+	if(dinamite_hashtable_tls_count() != 0)
+		printf("test8: %d thread-local tables were not released\n",
+		       dinamite_hashtable_tls_count());
+
+	/* The main thread releases its table explicitly */
+	dinamite_hashtable_tls_put(1);
+	dinamite_hashtable_tls_release();
+	if(dinamite_hashtable_tls_count() != 0)
+		printf("test8: the main thread's table was not released\n");
+
+	printf("Done.\n");
+}
+
+/*
+ * Batch against single-value puts, on a random stream of mostly unique
+ * pointers and on a cache-line strided stream. Both ways must produce the
+ * same number of entries.
+ */
+#define TEST9_VALUES (1 << 21)
+#define TEST9_BATCH 256
+static void
+test9_stream(const char *name, const uint64_t *values) {
+
+	struct timeval tv_before;
+	uint64_t single_us, batch_us;
+	dinamite_ht_stats_t single_stats, batch_stats;
+
+	gettimeofday(&tv_before, NULL);
+	for(int i = 0; i < TEST9_VALUES; i++)
+		dinamite_hashtable_put(values[i], 0);
+	single_us = usec_since(&tv_before);
+	dinamite_hashtable_get_stats(0, &single_stats);
 	dinamite_hashtable_clear();
-	test2(0);
+
+	gettimeofday(&tv_before, NULL);
+	for(int i = 0; i < TEST9_VALUES; i += TEST9_BATCH)
+		dinamite_hashtable_put_batch(&values[i], TEST9_BATCH, 0);
+	batch_us = usec_since(&tv_before);
+	dinamite_hashtable_get_stats(0, &batch_stats);
 	dinamite_hashtable_clear();
-	test3();
+
+	if(single_stats.hts_entries != batch_stats.hts_entries)
+		printf("test9: %s: batch put stored %lld entries, single "
+		       "put stored %lld\n", name,
+		       (long long)batch_stats.hts_entries,
+		       (long long)single_stats.hts_entries);
+
+	printf("%s: single put %.2f Mputs/s, batch put %.2f Mputs/s "
+	       "(%.2fx)\n", name, (double)TEST9_VALUES / single_us,
+	       (double)TEST9_VALUES / batch_us,
+	       (double)single_us / batch_us);
+}
+
+void test9(void) {
+
+	uint64_t *values, x = 88172645463325252ULL;
+
+	printf("Starting Test 9...\n");
+	values = (uint64_t *) malloc(sizeof(uint64_t) * TEST9_VALUES);
+	if(values == NULL) {
+		perror("malloc");
+		exit(-1);
+	}
+
+	for(int i = 0; i < TEST9_VALUES; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		values[i] = 0x7f0000000000ULL + ((x % (1 << 27)) << 3);
+	}
+	test9_stream("random", values);
+
+	for(int i = 0; i < TEST9_VALUES; i++)
+		values[i] = 0x7f0000000000ULL + ((uint64_t)i << 6);
+	test9_stream("strided", values);
+
+	free(values);
+	printf("Done.\n");
+}
+
+/*
+ * Merge 127 per-thread tables, like those of test3 and test4, with a
+ * varying number of workers. Thread t inserts TEST10_ITEMS consecutive
+ * multiples of 8 starting at t * TEST10_ITEMS / 2, so neighbouring threads
+ * overlap by half.
+ */
+#define TEST10_ITEMS 8192
+static void *
+test10_thread(void *tid) {
+
+	int threadID = (int)(long)tid;
+	uint64_t first = (uint64_t)threadID * TEST10_ITEMS / 2;
+
+	for(uint64_t i = first; i < first + TEST10_ITEMS; i++)
+		dinamite_hashtable_put((i + 1) * 8, threadID);
+	return NULL;
+}
+
+void test10(void) {
+
+	pthread_t threads[NUM_THREADS];
+	uint64_t expected = (uint64_t)(NUM_THREADS - 1) * TEST10_ITEMS / 2 +
+		TEST10_ITEMS;
+
+	printf("Starting Test 10...\n");
+	for( int i = 0; i < NUM_THREADS; i++ ) {
+		int ret = pthread_create(&threads[i], NULL, test10_thread,
+					 (void*)(long)i);
+		if(ret != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			exit(-1);
+		}
+	}
+	for( int i = 0; i < NUM_THREADS; i++ )
+		pthread_join(threads[i], NULL);
+
+	for(int workers = 1; workers <= 16; workers *= 2) {
+		struct timeval tv_before;
+		uint64_t elapsed, value, count = 0, sum = 0;
+
+		gettimeofday(&tv_before, NULL);
+		if(dinamite_hashtable_merge(workers) != 0) {
+			printf("test10: merge with %d workers failed\n",
+			       workers);
+			continue;
+		}
+		elapsed = usec_since(&tv_before);
+
+		dinamite_hashtable_merged_begin_iterate();
+		while(dinamite_hashtable_merged_getnext(&value) == 0) {
+			sum += value / 8;
+			count++;
+		}
+		if(count != expected ||
+		   dinamite_hashtable_merged_size() != expected ||
+		   sum != expected * (expected + 1) / 2)
+			printf("test10: merged %lld values, expecting %lld\n",
+			       (long long)count, (long long)expected);
+
+		printf("%d x %d entries, %d workers: %lld us, "
+		       "%.2f Mentries/s\n", NUM_THREADS, TEST10_ITEMS,
+		       workers, (long long)elapsed,
+		       (double)NUM_THREADS * TEST10_ITEMS / elapsed);
+	}
+	dinamite_hashtable_merged_clear();
+
+	printf("Done.\n");
+}
+
+/*
+ * Snapshot TEST11_THREADS tables to a file, map it back and check every
+ * section. Reports the export and scan bandwidth.
+ */
+#define TEST11_THREADS 16
+#define TEST11_ITEMS (1 << 18)
+void test11(void) {
+
+	char path[] = "/tmp/ht_test_snapshot.XXXXXX";
+	struct timeval tv_before;
+	dinamite_snapshot_t snap;
+	uint64_t elapsed, bytes;
+	int fd, seen = 0;
+
+	printf("Starting Test 11...\n");
+	for(uint64_t t = 0; t < TEST11_THREADS; t++)
+		for(uint64_t i = 0; i < TEST11_ITEMS; i++)
+			dinamite_hashtable_put((t << 32) + i * 8, t);
+
+	if( (fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return;
+	}
+	close(fd);
+
+	gettimeofday(&tv_before, NULL);
+	if(dinamite_hashtable_snapshot(path) != 0) {
+		printf("test11: could not write the snapshot\n");
+		unlink(path);
+		return;
+	}
+	elapsed = usec_since(&tv_before);
+	bytes = (uint64_t)TEST11_THREADS * TEST11_ITEMS * sizeof(uint64_t);
+	printf("exported %lld MB in %lld us: %.2f MB/s\n",
+	       (long long)(bytes >> 20), (long long)elapsed,
+	       (double)bytes / elapsed);
+
+	if(dinamite_snapshot_open(path, &snap) != 0) {
+		printf("test11: could not open the snapshot\n");
+		unlink(path);
+		return;
+	}
+
+	gettimeofday(&tv_before, NULL);
+	for(uint32_t i = 0; i < snap.ds_num_sections; i++) {
+		const uint64_t *values;
+		uint64_t n, sum = 0;
+		int64_t t;
+
+		dinamite_snapshot_section(&snap, i, &t, &values, &n);
+		for(uint64_t j = 0; j < n; j++)
+			sum += values[j] - ((uint64_t)t << 32);
+
+		if(t < 0 || t >= TEST11_THREADS || n != TEST11_ITEMS ||
+		   sum != 8ULL * TEST11_ITEMS * (TEST11_ITEMS - 1) / 2)
+			printf("test11: section %d of thread %lld has %lld "
+			       "wrong values\n", i, (long long)t,
+			       (long long)n);
+		seen |= 1 << t;
+	}
+	elapsed = usec_since(&tv_before);
+	printf("scanned the snapshot in %lld us: %.2f MB/s\n",
+	       (long long)elapsed, (double)bytes / elapsed);
+
+	if(seen != (1 << TEST11_THREADS) - 1)
+		printf("test11: the snapshot is missing threads\n");
+
+	dinamite_snapshot_close(&snap);
+	unlink(path);
+
+	/* No room for the file must be an error, not a SIGBUS */
+	if(dinamite_hashtable_snapshot("/dev/full") == 0)
+		printf("test11: a snapshot to /dev/full succeeded\n");
+	printf("Done.\n");
+}
+
+/*
+ * With the page hash, all addresses of a page land in one bucket, which
+ * grows through every size class while the resizes hand the arrays of the
+ * old buckets back. Refill after each clear, reusing the released memory.
+ */
+#define TEST12_ITEMS 4096
+void test12(void) {
+
+	uint64_t value, sum;
+	int count;
+
+	printf("Starting Test 12...\n");
+	dinamite_hashtable_set_hash(DINAMITE_HT_HASH_PAGE);
+
+	for(int round = 0; round < 3; round++) {
+		for(uint64_t i = 1; i <= TEST12_ITEMS; i++) {
+			dinamite_hashtable_put(0x7f0000000000ULL + i, 0);
+			dinamite_hashtable_put(0x7f0000000000ULL + i, 0);
+		}
+
+		count = 0;
+		sum = 0;
+		dinamite_hashtable_begin_iterate(0);
+		while(dinamite_hashtable_getnext(0, &value) == 0) {
+			sum += value - 0x7f0000000000ULL;
+			count++;
+		}
+		if(count != TEST12_ITEMS ||
+		   sum != (uint64_t)TEST12_ITEMS * (TEST12_ITEMS + 1) / 2)
+			printf("test12: round %d got %d items with sum %lld, "
+			       "expecting %d items\n", round, count,
+			       (long long)sum, TEST12_ITEMS);
+		dinamite_hashtable_clear();
+	}
+
+	dinamite_hashtable_set_hash(DINAMITE_HT_HASH_MULSHIFT);
+	printf("Done.\n");
+}
+
+/*
+ * Scaling of the shared set against per-thread tables plus a merge, from 1
+ * to NUM_THREADS threads. With overlapping keys every thread puts the same
+ * TEST13_KEYS values; with disjoint keys every thread has its own.
+ */
+#define TEST13_KEYS (1 << 15)
+typedef struct {
+	int tt_id;
+	int tt_shared;
+	int tt_disjoint;
+} test13_arg_t;
+
+static void *
+test13_thread(void *arg) {
+
+	test13_arg_t *a = (test13_arg_t *) arg;
+	uint64_t base = a->tt_disjoint ? (uint64_t)a->tt_id << 24 : 0;
+
+	for(uint64_t i = base + 1; i <= base + TEST13_KEYS; i++)
+		if(a->tt_shared)
+			dinamite_hashtable_shared_put(i * 8);
+		else
+			dinamite_hashtable_put(i * 8, a->tt_id);
+	return NULL;
+}
+
+static uint64_t
+test13_run(int n, int shared, int disjoint) {
+
+	pthread_t threads[NUM_THREADS];
+	test13_arg_t args[NUM_THREADS];
+	struct timeval tv_before;
+
+	gettimeofday(&tv_before, NULL);
+	for(int i = 0; i < n; i++) {
+		int ret;
+
+		args[i].tt_id = i;
+		args[i].tt_shared = shared;
+		args[i].tt_disjoint = disjoint;
+		ret = pthread_create(&threads[i], NULL, test13_thread,
+				     &args[i]);
+		if(ret != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			exit(-1);
+		}
+	}
+	for(int i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	if(!shared)
+		dinamite_hashtable_merge(n < 16 ? n : 16);
+	return usec_since(&tv_before);
+}
+
+void test13(void) {
+
+	const char *key_sets[] = {"overlapping", "disjoint"};
+	int counts[] = {1, 2, 4, 8, 16, 32, 64, NUM_THREADS};
+
+	printf("Starting Test 13...\n");
+	for(int d = 0; d < 2; d++) {
+		for(int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+			int n = counts[c];
+			uint64_t puts = (uint64_t)n * TEST13_KEYS;
+			uint64_t expected = d ? puts : TEST13_KEYS;
+			uint64_t shared_us, private_us, value, count = 0;
+
+			shared_us = test13_run(n, 1, d);
+			dinamite_hashtable_shared_begin_iterate();
+			while(dinamite_hashtable_shared_getnext(&value) == 0)
+				count++;
+			if(count != expected ||
+			   dinamite_hashtable_shared_size() != expected)
+				printf("test13: shared set has %lld values, "
+				       "expecting %lld\n", (long long)count,
+				       (long long)expected);
+			dinamite_hashtable_shared_clear();
+
+			private_us = test13_run(n, 0, d);
+			if(dinamite_hashtable_merged_size() != expected)
+				printf("test13: merged set has %lld values, "
+				       "expecting %lld\n",
+				       (long long)
+				       dinamite_hashtable_merged_size(),
+				       (long long)expected);
+			dinamite_hashtable_merged_clear();
+			dinamite_hashtable_clear();
+
+			printf("%s, %3d threads: shared %.2f Mputs/s, "
+			       "per-thread + merge %.2f Mputs/s "
+			       "(%lld vs %lld entries)\n", key_sets[d], n,
+			       (double)puts / shared_us,
+			       (double)puts / private_us,
+			       (long long)expected, (long long)puts);
+		}
+	}
+	printf("Done.\n");
+}
+
+/*
+ * Memory per value on clustered addresses: small heap objects, a dense
+ * array of words, and one word per page of a large mapping.
+ */
+#define TEST14_PTRS (1 << 16)
+void test14(void) {
+
+	static void *ptrs[TEST14_PTRS];
+	struct timeval tv_before;
+	uint64_t elapsed, value, count = 0;
+
+	printf("Starting Test 14...\n");
+	for(int i = 0; i < TEST14_PTRS; i++)
+		ptrs[i] = malloc(16 + (i % 4) * 16);
+
+	gettimeofday(&tv_before, NULL);
+	for(int i = 0; i < TEST14_PTRS; i++)
+		dinamite_hashtable_put((uint64_t)ptrs[i], 0);
+	for(uint64_t i = 0; i < 4 * TEST14_PTRS; i++)
+		dinamite_hashtable_put(0x7f0000000000ULL + i * 8, 0);
+	for(uint64_t i = 0; i < TEST14_PTRS; i++)
+		dinamite_hashtable_put(0x7e0000000000ULL + (i << 12) + 64, 0);
+	elapsed = usec_since(&tv_before);
+
+	printf("%d puts in %lld us: %.2f Mputs/s\n", 6 * TEST14_PTRS,
+	       (long long)elapsed, (double)6 * TEST14_PTRS / elapsed);
+	print_stats(0);
+
+	dinamite_hashtable_begin_iterate(0);
+	while(dinamite_hashtable_getnext(0, &value) == 0)
+		count++;
+	if(count != 6 * TEST14_PTRS)
+		printf("test14: got %lld values, expecting %d\n",
+		       (long long)count, 6 * TEST14_PTRS);
+
+	for(int i = 0; i < TEST14_PTRS; i++)
+		free(ptrs[i]);
+	dinamite_hashtable_clear();
+	printf("Done.\n");
+}
+
+/*
+ * Trace intervals with epoch resets. Thread 0 rolls its window, with
+ * window sizes that alternate so that stale entries would show up, while
+ * thread 1 keeps its table. Then compare the cost of a reset and a clear.
+ */
+#define TEST15_WINDOWS 16
+static int
+test15_check(const char *what, int threadID, uint64_t first, uint64_t n) {
+
+	uint64_t value, count = 0, sum = 0;
+
+	dinamite_hashtable_begin_iterate(threadID);
+	while(dinamite_hashtable_getnext(threadID, &value) == 0) {
+		if(value / 8 < first || value / 8 >= first + n) {
+			printf("test15: %s: stale value %lld\n", what,
+			       (long long)value);
+			return -1;
+		}
+		sum += value / 8 - first;
+		count++;
+	}
+	if(count != n || sum != n * (n - 1) / 2) {
+		printf("test15: %s: got %lld values, expecting %lld\n", what,
+		       (long long)count, (long long)n);
+		return -1;
+	}
+	return 0;
+}
+
+static void *
+test15_tls_thread(void *arg) {
+
+	uint64_t value;
+	int count = 0;
+
+	for(int i = 1; i <= ITEMS; i++)
+		dinamite_hashtable_tls_put(i * 8);
+	dinamite_hashtable_tls_reset();
+	dinamite_hashtable_tls_put(8);
+
+	dinamite_hashtable_tls_begin_iterate();
+	while(dinamite_hashtable_tls_getnext(&value) == 0)
+		count++;
+	if(count != 1)
+		printf("test15: thread-local table has %d values after a "
+		       "reset, expecting 1\n", count);
+	return NULL;
+}
+
+static uint64_t
+test15_fill(int threadID, uint64_t first, uint64_t n) {
+
+	struct timeval tv_before;
+
+	gettimeofday(&tv_before, NULL);
+	for(uint64_t i = first; i < first + n; i++)
+		dinamite_hashtable_put(i * 8, threadID);
+	return usec_since(&tv_before);
+}
+
+void test15(void) {
+
+	dinamite_ht_stats_t before, after;
+	struct timeval tv_before;
+	uint64_t reset_us = 0, clear_us = 0, fill_reset_us = 0;
+	uint64_t fill_clear_us = 0;
+	pthread_t thread;
+
+	printf("Starting Test 15...\n");
+	test15_fill(1, 1, ITEMS);
+
+	for(int w = 0; w < TEST15_WINDOWS; w++) {
+		uint64_t n = (w % 2) ? 100 : 50000 + w * 1000;
+
+		test15_fill(0, (uint64_t)w << 20, n);
+		if(test15_check("window", 0, (uint64_t)w << 20, n) != 0)
+			break;
+		dinamite_hashtable_reset(0);
+	}
+	test15_check("other thread", 1, 1, ITEMS);
+	dinamite_hashtable_reset_all();
+	test15_check("after reset_all", 1, 1, 0);
+
+	/* Reset halfway through growing */
+	test15_fill(0, 1, 3000);
+	dinamite_hashtable_reset(0);
+	test15_fill(0, 5000, 3000);
+	test15_check("reset while growing", 0, 5000, 3000);
+
+	pthread_create(&thread, NULL, test15_tls_thread, NULL);
+	pthread_join(thread, NULL);
+
+	/* Refill the same window after a reset and after a clear */
+	dinamite_hashtable_clear();
+	test15_fill(0, 1, 1 << 18);
+	dinamite_hashtable_get_stats(0, &before);
+	for(int w = 0; w < TEST15_WINDOWS; w++) {
+		gettimeofday(&tv_before, NULL);
+		dinamite_hashtable_reset(0);
+		reset_us += usec_since(&tv_before);
+		fill_reset_us += test15_fill(0, 1, 1 << 18);
+	}
+	dinamite_hashtable_get_stats(0, &after);
+	if(after.hts_memory != before.hts_memory)
+		printf("test15: memory went from %lld to %lld bytes over the "
+		       "resets\n", (long long)before.hts_memory,
+		       (long long)after.hts_memory);
+
+	for(int w = 0; w < TEST15_WINDOWS; w++) {
+		gettimeofday(&tv_before, NULL);
+		dinamite_hashtable_clear();
+		clear_us += usec_since(&tv_before);
+		fill_clear_us += test15_fill(0, 1, 1 << 18);
+	}
+	printf("%d windows of %d values: reset %lld us + refill %lld us, "
+	       "clear %lld us + refill %lld us\n", TEST15_WINDOWS, 1 << 18,
+	       (long long)reset_us, (long long)fill_reset_us,
+	       (long long)clear_us, (long long)fill_clear_us);
+	dinamite_hashtable_clear();
+	printf("Done.\n");
+}
+
+/*
+ * Drain the same table one value at a time, in bulk, with a visitor and
+ * sorted, and check that they agree. Then time them, and the radix sort
+ * against qsort().
+ */
+#define TEST16_VALUES 100000
+#define TEST16_BUF 1024
+
+typedef struct test16_sum {
+	uint64_t count;
+	uint64_t sum;
+} test16_sum_t;
+
+static void
+test16_visitor(void *arg, const uint64_t *values, size_t n) {
+
+	test16_sum_t *s = (test16_sum_t *) arg;
+
+	for(size_t i = 0; i < n; i++)
+		s->sum += values[i];
+	s->count += n;
+}
+
+static int
+test16_cmp(const void *a, const void *b) {
+
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+void test16(void) {
+
+	static uint64_t buf[TEST16_BUF];
+	test16_sum_t one = {0, 0}, bulk = {0, 0}, visit = {0, 0};
+	test16_sum_t sorted_sum = {0, 0}, merged = {0, 0};
+	uint64_t value, count, *sorted, *copy;
+	uint64_t one_us, bulk_us, visit_us, sort_us, qsort_us;
+	struct timeval tv_before;
+	size_t n;
+
+	printf("Starting Test 16...\n");
+	srand(16);
+	for(int i = 0; i < TEST16_VALUES; i++)
+		dinamite_hashtable_put(((uint64_t)rand() << 31 | rand()) * 8, 0);
+
+	gettimeofday(&tv_before, NULL);
+	dinamite_hashtable_begin_iterate(0);
+	while(dinamite_hashtable_getnext(0, &value) == 0)
+		test16_visitor(&one, &value, 1);
+	one_us = usec_since(&tv_before);
+
+	gettimeofday(&tv_before, NULL);
+	dinamite_hashtable_begin_iterate(0);
+	while( (n = dinamite_hashtable_getnext_bulk(0, buf, TEST16_BUF)) > 0)
+		test16_visitor(&bulk, buf, n);
+	bulk_us = usec_since(&tv_before);
+
+	gettimeofday(&tv_before, NULL);
+	dinamite_hashtable_visit(0, test16_visitor, &visit);
+	visit_us = usec_since(&tv_before);
+
+	gettimeofday(&tv_before, NULL);
+	sorted = dinamite_hashtable_sorted(0, &count);
+	sort_us = usec_since(&tv_before);
+	if(sorted == NULL) {
+		printf("test16: could not sort the table\n");
+		return;
+	}
+	test16_visitor(&sorted_sum, sorted, count);
+	for(uint64_t i = 1; i < count; i++)
+		if(sorted[i - 1] >= sorted[i]) {
+			printf("test16: values %lld and %lld are out of order\n",
+			       (long long)i - 1, (long long)i);
+			break;
+		}
+
+	if(bulk.count != one.count || bulk.sum != one.sum ||
+	   visit.count != one.count || visit.sum != one.sum ||
+	   sorted_sum.count != one.count || sorted_sum.sum != one.sum)
+		printf("test16: got %lld, %lld, %lld and %lld values, "
+		       "or their sums differ\n", (long long)one.count,
+		       (long long)bulk.count, (long long)visit.count,
+		       (long long)sorted_sum.count);
+
+	/* The merged set of a single table holds the same values */
+	dinamite_hashtable_merge(2);
+	dinamite_hashtable_merged_visit(test16_visitor, &merged);
+	free(sorted);
+	sorted = dinamite_hashtable_merged_sorted(&count);
+	if(merged.count != one.count || merged.sum != one.sum ||
+	   sorted == NULL || count != one.count)
+		printf("test16: the merged set has %lld values, expecting "
+		       "%lld\n", (long long)merged.count, (long long)one.count);
+	merged.count = merged.sum = 0;
+	dinamite_hashtable_merged_begin_iterate();
+	while( (n = dinamite_hashtable_merged_getnext_bulk(buf, TEST16_BUF)) > 0)
+		test16_visitor(&merged, buf, n);
+	if(merged.count != one.count || merged.sum != one.sum)
+		printf("test16: merged bulk iteration got %lld values, "
+		       "expecting %lld\n", (long long)merged.count,
+		       (long long)one.count);
+	dinamite_hashtable_merged_clear();
+
+	copy = (uint64_t *) malloc(sizeof(uint64_t) * one.count);
+	dinamite_hashtable_begin_iterate(0);
+	dinamite_hashtable_getnext_bulk(0, copy, one.count);
+	gettimeofday(&tv_before, NULL);
+	qsort(copy, one.count, sizeof(uint64_t), test16_cmp);
+	qsort_us = usec_since(&tv_before);
+	if(sorted != NULL && memcmp(copy, sorted, sizeof(uint64_t) * one.count)
+	   != 0)
+		printf("test16: the radix sort and qsort() disagree\n");
+
+	printf("%lld values: getnext %lld us, bulk %lld us, visit %lld us, "
+	       "sorted %lld us, copy + qsort %lld us\n", (long long)one.count,
+	       (long long)one_us, (long long)bulk_us, (long long)visit_us,
+	       (long long)sort_us, (long long)(bulk_us + qsort_us));
+
+	free(copy);
+	free(sorted);
+	dinamite_hashtable_clear();
+	printf("Done.\n");
+}
+
+/*
+ * Distinct counts with the HLL layout: the estimates should be within a
+ * few percent, the memory should not grow, and sketches should merge with
+ * each other and with exact tables into an estimate of the union.
+ */
+#define TEST17_MAX (1 << 20)
+
+static int
+test17_close(const char *what, uint64_t estimate, uint64_t exact) {
+
+	double err = ((double)estimate - exact) / exact;
+
+	if(err > 0.05 || err < -0.05) {
+		printf("test17: %s: estimated %lld, exact %lld\n", what,
+		       (long long)estimate, (long long)exact);
+		return -1;
+	}
+	return 0;
+}
+
+static void *
+test17_tls_thread(void *arg) {
+
+	uint64_t *estimate = (uint64_t *) arg;
+
+	for(uint64_t i = 0; i < 50000; i++)
+		dinamite_hashtable_tls_put((i % 20000) * 64);
+	*estimate = dinamite_hashtable_tls_distinct();
+	dinamite_hashtable_tls_release();
+	return NULL;
+}
+
+void test17(void) {
+
+	dinamite_ht_stats_t stats;
+	struct timeval tv_before;
+	uint64_t hll_us, exact_us, value, tls_estimate = 0;
+	pthread_t thread;
+	char what[64];
+
+	printf("Starting Test 17...\n");
+	dinamite_hashtable_set_layout(DINAMITE_HT_HLL);
+
+	for(uint64_t n = 10; n <= TEST17_MAX; n *= 4) {
+		dinamite_hashtable_reset(0);
+		for(int rep = 0; rep < 2; rep++)
+			for(uint64_t i = 1; i <= n; i++)
+				dinamite_hashtable_put(i * 8, 0);
+		snprintf(what, sizeof(what), "%lld values", (long long)n);
+		test17_close(what, dinamite_hashtable_distinct(0), n);
+	}
+	dinamite_hashtable_get_stats(0, &stats);
+	dinamite_hashtable_begin_iterate(0);
+	if(stats.hts_memory > 8192 ||
+	   dinamite_hashtable_getnext(0, &value) == 0)
+		printf("test17: the sketch holds %lld bytes or returns "
+		       "values\n", (long long)stats.hts_memory);
+
+	/* Threads 0 and 1 overlap by half, thread 2 is exact */
+	dinamite_hashtable_clear();
+	gettimeofday(&tv_before, NULL);
+	for(uint64_t i = 0; i < TEST17_MAX; i++)
+		dinamite_hashtable_put(i * 8, 0);
+	hll_us = usec_since(&tv_before);
+	for(uint64_t i = TEST17_MAX / 2; i < TEST17_MAX * 3 / 2; i++)
+		dinamite_hashtable_put(i * 8, 1);
+	test17_close("union of two sketches",
+		     dinamite_hashtable_distinct_all(), TEST17_MAX * 3 / 2);
+
+	dinamite_hashtable_set_layout(DINAMITE_HT_CHAINED);
+	gettimeofday(&tv_before, NULL);
+	for(uint64_t i = TEST17_MAX; i < TEST17_MAX * 2; i++)
+		dinamite_hashtable_put(i * 8, 2);
+	exact_us = usec_since(&tv_before);
+	if(dinamite_hashtable_distinct(2) != TEST17_MAX)
+		printf("test17: the exact table counts %lld values\n",
+		       (long long)dinamite_hashtable_distinct(2));
+	test17_close("union with an exact table",
+		     dinamite_hashtable_distinct_all(), TEST17_MAX * 2);
+
+	dinamite_hashtable_set_layout(DINAMITE_HT_HLL);
+	pthread_create(&thread, NULL, test17_tls_thread, &tls_estimate);
+	pthread_join(thread, NULL);
+	test17_close("thread-local sketch", tls_estimate, 20000);
+
+	printf("%d puts: sketch %lld us, chained %lld us\n", TEST17_MAX,
+	       (long long)hll_us, (long long)exact_us);
+	dinamite_hashtable_clear();
+	dinamite_hashtable_set_layout(DINAMITE_HT_CHAINED);
+	printf("Done.\n");
+}
+
+/*
+ * Membership queries, with and without a Bloom filter in front of the
+ * table, and the cost of first puts, duplicate puts, hits and misses.
+ */
+#define TEST18_VALUES 200000
+
+static double
+test18_ns(struct timeval *tv_before, uint64_t ops) {
+
+	return usec_since(tv_before) * 1000.0 / ops;
+}
+
+void test18(void) {
+
+	static uint64_t batch[TEST18_VALUES];
+	struct timeval tv_before;
+	double put_ns, dup_ns, hit_ns, miss_ns;
+	uint64_t i, hits;
+
+	printf("Starting Test 18...\n");
+	for(int bloom = 0; bloom <= 1; bloom++) {
+		dinamite_hashtable_set_bloom(bloom);
+
+		if(dinamite_hashtable_contains(0, 8) != 0)
+			printf("test18: a missing table contains a value\n");
+
+		gettimeofday(&tv_before, NULL);
+		for(i = 1; i <= TEST18_VALUES; i++)
+			dinamite_hashtable_put(i * 8, 0);
+		put_ns = test18_ns(&tv_before, TEST18_VALUES);
+
+		gettimeofday(&tv_before, NULL);
+		for(i = 1; i <= TEST18_VALUES; i++)
+			dinamite_hashtable_put(i * 8, 0);
+		dup_ns = test18_ns(&tv_before, TEST18_VALUES);
+
+		hits = 0;
+		gettimeofday(&tv_before, NULL);
+		for(i = 1; i <= TEST18_VALUES; i++)
+			hits += dinamite_hashtable_contains(0, i * 8);
+		hit_ns = test18_ns(&tv_before, TEST18_VALUES);
+		if(hits != TEST18_VALUES)
+			printf("test18: found %lld of %d values\n",
+			       (long long)hits, TEST18_VALUES);
+
+		hits = 0;
+		gettimeofday(&tv_before, NULL);
+		for(i = TEST18_VALUES + 1; i <= 2 * TEST18_VALUES; i++)
+			hits += dinamite_hashtable_contains(0, i * 8);
+		miss_ns = test18_ns(&tv_before, TEST18_VALUES);
+		if(hits != 0 || dinamite_hashtable_distinct(0) != TEST18_VALUES)
+			printf("test18: found %lld values that were never "
+			       "put\n", (long long)hits);
+
+		/*
+		 * The filter is built by the first contains(), then puts
+		 * keep it up to date, here through a batch that outgrows it.
+		 */
+		if(dinamite_hashtable_contains(1, 16) != 0)
+			printf("test18: an empty table contains a value\n");
+		for(i = 0; i < TEST18_VALUES; i++)
+			batch[i] = (i % (TEST18_VALUES / 2) + 1) * 16;
+		dinamite_hashtable_put_batch(batch, TEST18_VALUES, 1);
+		hits = 0;
+		for(i = 0; i < TEST18_VALUES / 2; i++)
+			hits += dinamite_hashtable_contains(1, batch[i]);
+		if(dinamite_hashtable_distinct(1) != TEST18_VALUES / 2 ||
+		   hits != TEST18_VALUES / 2 ||
+		   dinamite_hashtable_contains(1, 8) != 0)
+			printf("test18: the batch table holds %lld values, "
+			       "found %lld\n",
+			       (long long)dinamite_hashtable_distinct(1),
+			       (long long)hits);
+
+		dinamite_hashtable_reset(0);
+		if(dinamite_hashtable_contains(0, 8) != 0)
+			printf("test18: a reset table contains a value\n");
+		dinamite_hashtable_put(8, 0);
+		if(dinamite_hashtable_contains(0, 8) != 1)
+			printf("test18: lost a value put after a reset\n");
+
+		printf("bloom %s: first put %.1f ns, duplicate put %.1f ns, "
+		       "hit %.1f ns, miss %.1f ns\n", bloom ? "on " : "off",
+		       put_ns, dup_ns, hit_ns, miss_ns);
+		dinamite_hashtable_clear();
+	}
+	dinamite_hashtable_set_bloom(0);
+	printf("Done.\n");
+}
+
+/*
+ * Map mode: count the accesses to each address and remember when it was
+ * first seen, with one upsert per access, and read it all back. Then
+ * compare upserts with puts into a set, for new keys and for repeats.
+ */
+#define TEST19_KEYS 100000
+#define TEST19_ACCESSES (4 * TEST19_KEYS)
+
+typedef struct test19_payload {
+	uint64_t count;
+	uint64_t first_seen;
+	uint32_t size;
+} test19_payload_t;
+
+/* A thread's own map, released when the thread exits */
+static void *
+test19_tls_thread(void *arg) {
+
+	test19_payload_t *p;
+	uint64_t i, key, keys = 0;
+	int *errors = (int *) arg, inserted;
+	void *payload;
+
+	for(i = 0; i < 2 * TEST19_KEYS; i++) {
+		p = (test19_payload_t *) dinamite_hashtable_tls_map_upsert(
+			(i % TEST19_KEYS) * 8, &inserted);
+		if(inserted != (i < TEST19_KEYS))
+			(*errors)++;
+		p->count++;
+	}
+	if(dinamite_hashtable_map_set_payload(8) == 0)
+		printf("test19: changed the payload size of a live "
+		       "thread-local map\n");
+
+	dinamite_hashtable_tls_map_begin_iterate();
+	while(dinamite_hashtable_tls_map_getnext(&key, &payload) == 0) {
+		if(((test19_payload_t *) payload)->count != 2 ||
+		   payload != dinamite_hashtable_tls_map_find(key))
+			(*errors)++;
+		keys++;
+	}
+	if(keys != TEST19_KEYS ||
+	   dinamite_hashtable_tls_map_size() != TEST19_KEYS ||
+	   dinamite_hashtable_tls_map_find(8 * TEST19_KEYS) != NULL)
+		(*errors)++;
+	return NULL;
+}
+
+void test19(void) {
+
+	test19_payload_t *p;
+	pthread_t thread;
+	struct timeval tv_before;
+	uint64_t i, key, keys = 0, accesses = 0;
+	uint64_t map_new_us = 0, map_old_us, set_new_us = 0, set_old_us;
+	int inserted, errors = 0;
+	void *payload;
+
+	printf("Starting Test 19...\n");
+	dinamite_hashtable_map_set_payload(sizeof(test19_payload_t));
+
+	gettimeofday(&tv_before, NULL);
+	for(i = 0; i < TEST19_ACCESSES; i++) {
+		if(i == TEST19_KEYS) {
+			map_new_us = usec_since(&tv_before);
+			gettimeofday(&tv_before, NULL);
+		}
+		p = (test19_payload_t *) dinamite_hashtable_map_upsert(
+			(i % TEST19_KEYS) * 8, 0, &inserted);
+		if(inserted) {
+			p->first_seen = i;
+			p->size = i % 64;
+		}
+		p->count++;
+	}
+	map_old_us = usec_since(&tv_before);
+
+	if(dinamite_hashtable_map_set_payload(8) == 0)
+		printf("test19: changed the payload size of live maps\n");
+	if(dinamite_hashtable_map_size(0) != TEST19_KEYS ||
+	   dinamite_hashtable_map_find(8 * TEST19_KEYS, 0) != NULL ||
+	   dinamite_hashtable_map_find(8, 1) != NULL)
+		printf("test19: the map has %lld keys, expecting %d\n",
+		       (long long)dinamite_hashtable_map_size(0), TEST19_KEYS);
+
+	/* Key zero was upserted first, so its payload says so */
+	dinamite_hashtable_map_begin_iterate(0);
+	while(dinamite_hashtable_map_getnext(0, &key, &payload) == 0) {
+		p = (test19_payload_t *) payload;
+		if(p->count != TEST19_ACCESSES / TEST19_KEYS ||
+		   p->first_seen != key / 8 || p->size != key / 8 % 64 ||
+		   payload != dinamite_hashtable_map_find(key, 0))
+			errors++;
+		keys++;
+		accesses += p->count;
+	}
+	if(keys != TEST19_KEYS || accesses != TEST19_ACCESSES || errors)
+		printf("test19: iterated over %lld keys and %lld accesses, "
+		       "%d wrong payloads\n", (long long)keys,
+		       (long long)accesses, errors);
+
+	gettimeofday(&tv_before, NULL);
+	for(i = 0; i < TEST19_ACCESSES; i++) {
+		if(i == TEST19_KEYS) {
+			set_new_us = usec_since(&tv_before);
+			gettimeofday(&tv_before, NULL);
+		}
+		dinamite_hashtable_put((i % TEST19_KEYS) * 8, 0);
+	}
+	set_old_us = usec_since(&tv_before);
+
+	printf("%d keys: map upsert %.1f ns new, %.1f ns repeated; "
+	       "set put %.1f ns new, %.1f ns repeated\n", TEST19_KEYS,
+	       map_new_us * 1000.0 / TEST19_KEYS,
+	       map_old_us * 1000.0 / (TEST19_ACCESSES - TEST19_KEYS),
+	       set_new_us * 1000.0 / TEST19_KEYS,
+	       set_old_us * 1000.0 / (TEST19_ACCESSES - TEST19_KEYS));
+
+	dinamite_hashtable_map_clear();
+	errors = 0;
+	pthread_create(&thread, NULL, test19_tls_thread, &errors);
+	pthread_join(thread, NULL);
+	if(errors)
+		printf("test19: %d errors in the thread-local map\n", errors);
+	if(dinamite_hashtable_tls_map_find(8) != NULL ||
+	   dinamite_hashtable_map_set_payload(sizeof(uint64_t)) != 0)
+		printf("test19: the thread-local map outlived its thread\n");
 	dinamite_hashtable_clear();
-	test4();
+	printf("Done.\n");
+}
+
+/*
+ * Streaming: every value a table inserts reaches the consumer once, with
+ * its thread ID, and duplicates do not; a slow consumer makes the puts drop
+ * values rather than wait; the stream file reads back the same. Then time
+ * first puts with streaming off and on.
+ */
+#define TEST20_VALUES 10000
+#define TEST20_TIMED (16 * TEST20_VALUES)
+
+typedef struct test20_sink {
+	uint64_t count[3];
+	uint64_t sum[3];
+	int bad_thread;
+	int slow;
+} test20_sink_t;
+
+static void
+test20_consume(void *arg, int threadID, const uint64_t *values, size_t n) {
+
+	test20_sink_t *sink = (test20_sink_t *) arg;
+
+	if(threadID < 0 || threadID > 2) {
+		sink->bad_thread++;
+		return;
+	}
+	for(size_t i = 0; i < n; i++)
+		sink->sum[threadID] += values[i];
+	sink->count[threadID] += n;
+	if(sink->slow)
+		usleep(1000);
+}
+
+static uint64_t
+test20_timed_puts(int threadID) {
+
+	struct timeval tv_before;
+
+	gettimeofday(&tv_before, NULL);
+	for(uint64_t i = 1; i <= TEST20_TIMED; i++)
+		dinamite_hashtable_put(i * 8, threadID);
+	return usec_since(&tv_before);
+}
+
+void test20(void) {
+
+	static uint64_t batch[TEST20_VALUES];
+	char path[] = "/tmp/ht_test_stream.XXXXXX";
+	uint64_t streamed0, dropped0, streamed, dropped, i, expect;
+	uint64_t off_us, on_us, count = 0, sum = 0;
+	test20_sink_t sink;
+	int32_t header[2];
+	FILE *file;
+	int fd;
+
+	printf("Starting Test 20...\n");
+	dinamite_hashtable_stream_stats(&streamed0, &dropped0);
+
+	/* Each value once, from puts and from batches */
+	memset(&sink, 0, sizeof(sink));
+	if(dinamite_hashtable_stream_start(test20_consume, &sink) != 0) {
+		printf("test20: could not start streaming\n");
+		return;
+	}
+	if(dinamite_hashtable_stream_start(test20_consume, &sink) == 0)
+		printf("test20: started streaming twice\n");
+	for(int round = 0; round < 2; round++)
+		for(i = 1; i <= TEST20_VALUES; i++)
+			dinamite_hashtable_put(i * 8, 0);
+	for(i = 0; i < TEST20_VALUES; i++)
+		batch[i] = (i % (TEST20_VALUES / 2) + 1) * 16;
+	dinamite_hashtable_put_batch(batch, TEST20_VALUES, 1);
+	dinamite_hashtable_stream_stop();
+
+	expect = (uint64_t)TEST20_VALUES * (TEST20_VALUES + 1) / 2;
+	if(sink.bad_thread || sink.count[0] != TEST20_VALUES ||
+	   sink.sum[0] != 8 * expect || sink.count[1] != TEST20_VALUES / 2 ||
+	   sink.sum[1] != 16 * ((uint64_t)TEST20_VALUES / 2 *
+				(TEST20_VALUES / 2 + 1) / 2))
+		printf("test20: streamed %lld and %lld values, expecting "
+		       "%d and %d\n", (long long)sink.count[0],
+		       (long long)sink.count[1], TEST20_VALUES,
+		       TEST20_VALUES / 2);
+
+	/* Nothing is streamed once we stop */
+	dinamite_hashtable_put(8 * (TEST20_VALUES + 1), 0);
+	if(sink.count[0] != TEST20_VALUES)
+		printf("test20: streamed a value after stopping\n");
+
+	/* A consumer that cannot keep up */
+	memset(&sink, 0, sizeof(sink));
+	sink.slow = 1;
+	dinamite_hashtable_stream_start(test20_consume, &sink);
+	for(i = 1; i <= TEST20_TIMED; i++)
+		dinamite_hashtable_put(i * 8, 2);
+	dinamite_hashtable_stream_stop();
+	dinamite_hashtable_stream_stats(&streamed, &dropped);
+	streamed -= streamed0;
+	dropped -= dropped0;
+	if(sink.count[2] + dropped != TEST20_TIMED || dropped == 0 ||
+	   streamed != sink.count[0] + sink.count[1] + sink.count[2] +
+	   TEST20_VALUES + TEST20_VALUES / 2 ||
+	   dinamite_hashtable_distinct(2) != TEST20_TIMED)
+		printf("test20: streamed %lld and dropped %lld of %d values\n",
+		       (long long)sink.count[2], (long long)dropped,
+		       TEST20_TIMED);
+	dinamite_hashtable_clear();
+
+	/* The stream file */
+	if( (fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return;
+	}
+	close(fd);
+	if(dinamite_hashtable_stream_to_file(path) != 0) {
+		printf("test20: could not stream to %s\n", path);
+		unlink(path);
+		return;
+	}
+	for(i = 1; i <= TEST20_VALUES; i++)
+		dinamite_hashtable_put(i * 8, 1);
+	if(dinamite_hashtable_stream_stop() != 0)
+		printf("test20: failed to write %s\n", path);
+
+	if( (file = fopen(path, "r")) == NULL) {
+		perror("fopen");
+		unlink(path);
+		return;
+	}
+	while(fread(header, sizeof(header), 1, file) == 1) {
+		if(header[0] != 1)
+			printf("test20: record of thread %d\n", header[0]);
+		for(int32_t j = 0; j < header[1]; j++) {
+			uint64_t value;
+
+			if(fread(&value, sizeof(value), 1, file) != 1)
+				break;
+			sum += value;
+			count++;
+		}
+	}
+	fclose(file);
+	unlink(path);
+	if(count != TEST20_VALUES || sum != 8 * expect)
+		printf("test20: read %lld values back from the stream file\n",
+		       (long long)count);
+	dinamite_hashtable_clear();
+
+	/* What streaming adds to a first put */
+	off_us = test20_timed_puts(0);
+	dinamite_hashtable_clear();
+	memset(&sink, 0, sizeof(sink));
+	dinamite_hashtable_stream_start(test20_consume, &sink);
+	on_us = test20_timed_puts(0);
+	dinamite_hashtable_stream_stop();
+	dinamite_hashtable_stream_stats(&streamed, &dropped);
+	dinamite_hashtable_clear();
+
+	printf("first put: %.1f ns without streaming, %.1f ns with it "
+	       "(%lld of %d dropped)\n", off_us * 1000.0 / TEST20_TIMED,
+	       on_us * 1000.0 / TEST20_TIMED,
+	       (long long)(TEST20_TIMED - sink.count[0]), TEST20_TIMED);
+	printf("Done.\n");
+}
+
+/*
+ * NUMA placement: tables filled by their own threads report the node of
+ * the thread and no page on another node, also after the main thread
+ * finished their resizes. Then drain them all, node by node, and check that
+ * every value comes back once, with its thread ID, and that the tables are
+ * reset. On a machine with a single node this covers the calls and the
+ * fallbacks; the placement itself can only differ with several nodes.
+ */
+#define TEST21_THREADS 3
+#define TEST21_VALUES 50000
+
+typedef struct test21_arg {
+	int thread_id;
+	unsigned node;
+} test21_arg_t;
+
+static void *
+test21_thread(void *arg) {
+
+	test21_arg_t *a = (test21_arg_t *) arg;
+	unsigned cpu;
+
+	syscall(SYS_getcpu, &cpu, &a->node, NULL);
+	for(uint64_t i = 1; i <= TEST21_VALUES; i++)
+		dinamite_hashtable_put(i * 8 * (a->thread_id + 1), a->thread_id);
+	return NULL;
+}
+
+static uint64_t test21_count[TEST21_THREADS + 1];
+static uint64_t test21_sum[TEST21_THREADS + 1];
+
+static void
+test21_drain(void *arg, int threadID, const uint64_t *values, size_t n) {
+
+	uint64_t sum = 0;
+
+	if(threadID < 0 || threadID > TEST21_THREADS)
+		threadID = TEST21_THREADS;
+	for(size_t i = 0; i < n; i++)
+		sum += values[i];
+	__atomic_fetch_add(&test21_sum[threadID], sum, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&test21_count[threadID], n, __ATOMIC_RELAXED);
+}
+
+void test21(void) {
+
+	pthread_t threads[TEST21_THREADS];
+	test21_arg_t args[TEST21_THREADS];
+	dinamite_ht_stats_t stats;
+	struct timeval tv_before;
+	uint64_t expect = (uint64_t)TEST21_VALUES * (TEST21_VALUES + 1) / 2;
+	uint64_t drain_us;
+	int t;
+
+	printf("Starting Test 21...\n");
+
+	dinamite_hashtable_put(8, TEST21_THREADS);
+	dinamite_hashtable_get_stats(TEST21_THREADS, &stats);
+	if(stats.hts_node != -1 || stats.hts_remote_pages != 0)
+		printf("test21: a table that is not placed says it is on node "
+		       "%d\n", stats.hts_node);
+
+	dinamite_hashtable_set_numa(1);
+	for(t = 0; t < TEST21_THREADS; t++) {
+		args[t].thread_id = t;
+		pthread_create(&threads[t], NULL, test21_thread, &args[t]);
+	}
+	for(t = 0; t < TEST21_THREADS; t++)
+		pthread_join(threads[t], NULL);
+	dinamite_hashtable_set_numa(0);
+
+	for(t = 0; t < TEST21_THREADS; t++) {
+		dinamite_hashtable_begin_iterate(t);
+		dinamite_hashtable_get_stats(t, &stats);
+		if(stats.hts_node != (int)args[t].node ||
+		   stats.hts_remote_pages != 0 ||
+		   stats.hts_entries != TEST21_VALUES)
+			printf("test21: table %d is on node %d, not %u, with "
+			       "%lld remote pages\n", t, stats.hts_node,
+			       args[t].node,
+			       (long long)stats.hts_remote_pages);
+	}
+
+	memset(test21_count, 0, sizeof(test21_count));
+	memset(test21_sum, 0, sizeof(test21_sum));
+	gettimeofday(&tv_before, NULL);
+	if(dinamite_hashtable_drain_numa(test21_drain, NULL, 1) != 0)
+		printf("test21: the drain failed\n");
+	drain_us = usec_since(&tv_before);
+
+	for(t = 0; t < TEST21_THREADS; t++)
+		if(test21_count[t] != TEST21_VALUES ||
+		   test21_sum[t] != expect * 8 * (t + 1) ||
+		   dinamite_hashtable_distinct(t) != 0)
+			printf("test21: drained %lld values of thread %d, "
+			       "%lld left\n", (long long)test21_count[t], t,
+			       (long long)dinamite_hashtable_distinct(t));
+	if(test21_count[TEST21_THREADS] != 1 ||
+	   test21_sum[TEST21_THREADS] != 8)
+		printf("test21: drained %lld values of the table that is not "
+		       "placed\n", (long long)test21_count[TEST21_THREADS]);
+
+	printf("drained %d values on %d threads in %lld us\n",
+	       TEST21_THREADS * TEST21_VALUES + 1, TEST21_THREADS + 1,
+	       (long long)drain_us);
+	dinamite_hashtable_clear();
+	printf("Done.\n");
+}
+
+int main(void) {
+
+	int layouts[] = {DINAMITE_HT_CHAINED, DINAMITE_HT_SWISS,
+			 DINAMITE_HT_ROARING};
+	const char *names[] = {"chained", "swiss", "roaring"};
+
+	for(int l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+
+		printf("Layout: %s\n", names[l]);
+		dinamite_hashtable_set_layout(layouts[l]);
+
+		test1(0);
+		dinamite_hashtable_clear();
+		test2(0);
+		dinamite_hashtable_clear();
+		test3();
+		dinamite_hashtable_clear();
+		test4();
+		dinamite_hashtable_clear();
+		test5();
+		dinamite_hashtable_clear();
+		test6();
+		test7();
+		dinamite_hashtable_clear();
+		test8();
+		test9();
+		test10();
+		dinamite_hashtable_clear();
+		test11();
+		dinamite_hashtable_clear();
+		test12();
+		test13();
+		test14();
+		test15();
+		test16();
+		test18();
+		test20();
+		test21();
+	}
+
+	test17();
+	test19();
 }
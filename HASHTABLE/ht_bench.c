@@ -0,0 +1,453 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "dinamite_hashtable.h"
+#include "rdtsc.h"
+
+/*
+ * Throughput and latency of the per-thread hashtables on address streams
+ * like the ones DINAMITE traces. Each thread puts its own stream into its
+ * own table (put), puts the same stream again (dup), and then drains its
+ * table with getnext (drain). Throughput is the number of operations of all
+ * threads divided by the wall time of the phase, from the first thread that
+ * starts it to the last one that finishes; latencies are measured
+ * with rdtsc on one operation out of LAT_SAMPLE_EVERY, and reported as
+ * percentiles in cycles.
+ *
+ * The streams:
+ *   heap   - word-sized fields of malloc'd objects of 16 to 256 bytes
+ *   page   - one address per page of a large mapping
+ *   zipf   - a Zipfian choice among ZIPF_HOT heap pointers, so most puts
+ *            are repeats
+ *   unique - random 8-byte aligned 48-bit addresses, nearly all distinct
+ *
+ * The output is CSV on stdout, one line per layout, stream, thread count
+ * and phase, so that the runs of different commits can be compared line by
+ * line. Usage:
+ *
+ *   ht_bench [-n values per thread] [-t max threads] [-l layout]
+ *            [-s stream] [-c label]
+ *
+ * The label goes in the first column, to tell commits apart.
+ */
+#define MAX_THREADS 127
+#define DEFAULT_VALUES (1 << 15)
+#define LAT_SAMPLE_EVERY 16
+#define ZIPF_HOT 4096
+#define ZIPF_S 0.99
+#define NUM_LAYOUTS 4
+
+enum { STREAM_HEAP, STREAM_PAGE, STREAM_ZIPF, STREAM_UNIQUE, NUM_STREAMS };
+enum { PHASE_PUT, PHASE_DUP, PHASE_DRAIN, NUM_PHASES };
+
+static const char *stream_names[] = {"heap", "page", "zipf", "unique"};
+static const char *phase_names[] = {"put", "dup", "drain"};
+static const char *layout_names[] = {"chained", "swiss", "roaring", "hll"};
+static const int thread_counts[] = {1, 2, 4, 8, 16, 32, 64, 127};
+
+typedef struct {
+	pthread_t tid;
+	int thread_id;
+	int stream;
+	uint64_t *values;
+	void **objects;           /* Heap and zipf streams, freed afterwards */
+	size_t num_objects;
+	uint64_t ops[NUM_PHASES];
+	uint64_t start[NUM_PHASES], end[NUM_PHASES];   /* In microseconds */
+	uint64_t *lat[NUM_PHASES];
+	size_t num_lat[NUM_PHASES];
+} thread_data_t;
+
+static pthread_barrier_t barrier;
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate;                /* 0 closed, 1 open, -1 run aborted */
+static size_t num_values = DEFAULT_VALUES;
+static double zipf_cdf[ZIPF_HOT];
+
+/* xorshift64*, one state per thread */
+static uint64_t
+next_random(uint64_t *state) {
+
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void
+init_zipf(void) {
+
+	double sum = 0;
+
+	for(int i = 0; i < ZIPF_HOT; i++) {
+		sum += 1.0 / pow(i + 1, ZIPF_S);
+		zipf_cdf[i] = sum;
+	}
+	for(int i = 0; i < ZIPF_HOT; i++)
+		zipf_cdf[i] /= sum;
+}
+
+static int
+zipf_rank(uint64_t *state) {
+
+	double u = (double)(next_random(state) >> 11) / (1ULL << 53);
+	int lo = 0, hi = ZIPF_HOT - 1;
+
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if(zipf_cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Build the thread's stream before the clock starts. Returns -1 if we run
+ * out of memory.
+ */
+static int
+make_stream(thread_data_t *td) {
+
+	uint64_t state = 0x9E3779B97F4A7C15ULL * (td->thread_id + 1);
+	uint64_t *v;
+	size_t i;
+
+	if( (v = td->values = (uint64_t *) malloc(sizeof(uint64_t) *
+						  num_values)) == NULL)
+		return -1;
+	td->objects = NULL;
+	td->num_objects = 0;
+
+	switch(td->stream) {
+	case STREAM_HEAP:
+		/* Four fields of each object, in allocation order */
+		td->num_objects = (num_values + 3) / 4;
+		if( (td->objects = (void **) calloc(td->num_objects,
+						    sizeof(void *))) == NULL)
+			return -1;
+		for(i = 0; i < td->num_objects; i++)
+			if( (td->objects[i] = malloc(16 + (next_random(&state)
+							    % 16) * 16))
+			    == NULL)
+				return -1;
+		for(i = 0; i < num_values; i++)
+			v[i] = (uint64_t)td->objects[i / 4] + (i % 4) * 8;
+		break;
+	case STREAM_PAGE:
+		for(i = 0; i < num_values; i++)
+			v[i] = 0x7f0000000000ULL +
+				((uint64_t)td->thread_id << 32) + (i << 12) +
+				(next_random(&state) & 0xff8);
+		break;
+	case STREAM_ZIPF:
+		td->num_objects = ZIPF_HOT;
+		if( (td->objects = (void **) calloc(ZIPF_HOT, sizeof(void *)))
+		    == NULL)
+			return -1;
+		for(i = 0; i < ZIPF_HOT; i++)
+			if( (td->objects[i] = malloc(64)) == NULL)
+				return -1;
+		for(i = 0; i < num_values; i++)
+			v[i] = (uint64_t)td->objects[zipf_rank(&state)];
+		break;
+	case STREAM_UNIQUE:
+		for(i = 0; i < num_values; i++)
+			v[i] = next_random(&state) & 0xfffffffffff8ULL;
+		break;
+	}
+
+	for(int p = 0; p < NUM_PHASES; p++) {
+		td->num_lat[p] = 0;
+		td->ops[p] = 0;
+		if( (td->lat[p] = (uint64_t *) malloc(sizeof(uint64_t) *
+						      (num_values /
+						       LAT_SAMPLE_EVERY + 1)))
+		    == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+free_stream(thread_data_t *td) {
+
+	for(size_t i = 0; i < td->num_objects; i++)
+		free(td->objects[i]);
+	free(td->objects);
+	free(td->values);
+	for(int p = 0; p < NUM_PHASES; p++)
+		free(td->lat[p]);
+}
+
+static void
+put_stream(thread_data_t *td, int phase) {
+
+	int id = td->thread_id;
+
+	for(size_t i = 0; i < num_values; i++) {
+		if(i % LAT_SAMPLE_EVERY == 0) {
+			uint64_t before = rdtsc();
+
+			dinamite_hashtable_put(td->values[i], id);
+			td->lat[phase][td->num_lat[phase]++] = rdtsc() - before;
+		}
+		else
+			dinamite_hashtable_put(td->values[i], id);
+	}
+	td->ops[phase] = num_values;
+}
+
+static void
+drain_table(thread_data_t *td) {
+
+	int id = td->thread_id;
+	uint64_t value, n = 0;
+
+	dinamite_hashtable_begin_iterate(id);
+	for(;;) {
+		int ret;
+
+		if(n % LAT_SAMPLE_EVERY == 0) {
+			uint64_t before = rdtsc();
+
+			ret = dinamite_hashtable_getnext(id, &value);
+			if(td->num_lat[PHASE_DRAIN] <
+			   num_values / LAT_SAMPLE_EVERY + 1)
+				td->lat[PHASE_DRAIN][td->num_lat[PHASE_DRAIN]++]
+					= rdtsc() - before;
+		}
+		else
+			ret = dinamite_hashtable_getnext(id, &value);
+		if(ret != 0)
+			break;
+		n++;
+	}
+	td->ops[PHASE_DRAIN] = n;
+}
+
+static uint64_t
+usec_now(void) {
+
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/*
+ * Each thread times its own part of a phase: with more threads than
+ * CPUs, the main thread might not run when the phase starts or ends.
+ */
+static void *
+thread_func(void *arg) {
+
+	thread_data_t *td = (thread_data_t *) arg;
+	int go;
+
+	/*
+	 * Hold every thread at the gate until all of them exist, so that
+	 * none is stuck at the barrier if a later pthread_create() fails.
+	 */
+	pthread_mutex_lock(&gate_lock);
+	while( (go = gate) == 0)
+		pthread_cond_wait(&gate_cond, &gate_lock);
+	pthread_mutex_unlock(&gate_lock);
+	if(go < 0)
+		return NULL;
+
+	for(int p = 0; p < NUM_PHASES; p++) {
+		pthread_barrier_wait(&barrier);
+		td->start[p] = usec_now();
+		if(p == PHASE_DRAIN)
+			drain_table(td);
+		else
+			put_stream(td, p);
+		td->end[p] = usec_now();
+	}
+	return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b) {
+
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+report(const char *label, int layout, int stream, int threads, int phase,
+       thread_data_t *td, uint64_t usec) {
+
+	uint64_t ops = 0, *lat, p[4] = {0, 0, 0, 0};
+	size_t n = 0, k = 0;
+	const double q[4] = {0.5, 0.9, 0.99, 0.999};
+
+	for(int i = 0; i < threads; i++) {
+		ops += td[i].ops[phase];
+		n += td[i].num_lat[phase];
+	}
+	if(n > 0 && (lat = (uint64_t *) malloc(sizeof(uint64_t) * n))
+	   != NULL) {
+		for(int i = 0; i < threads; i++) {
+			memcpy(lat + k, td[i].lat[phase],
+			       sizeof(uint64_t) * td[i].num_lat[phase]);
+			k += td[i].num_lat[phase];
+		}
+		qsort(lat, n, sizeof(uint64_t), cmp_u64);
+		for(int i = 0; i < 4; i++)
+			p[i] = lat[(size_t)(q[i] * (n - 1))];
+		free(lat);
+	}
+
+	printf("%s,%s,%s,%d,%s,%llu,%llu,%.3f,%llu,%llu,%llu,%llu\n", label,
+	       layout_names[layout], stream_names[stream], threads,
+	       phase_names[phase], (unsigned long long)ops,
+	       (unsigned long long)usec,
+	       usec ? (double)ops / usec : 0.0, (unsigned long long)p[0],
+	       (unsigned long long)p[1], (unsigned long long)p[2],
+	       (unsigned long long)p[3]);
+	fflush(stdout);
+}
+
+static int
+run(const char *label, int layout, int stream, int threads) {
+
+	thread_data_t td[MAX_THREADS];
+	int i, created, ret = 0;
+
+	memset(td, 0, sizeof(td));
+	for(i = 0; i < threads; i++) {
+		td[i].thread_id = i;
+		td[i].stream = stream;
+		if(make_stream(&td[i]) != 0) {
+			fprintf(stderr, "Warning: malloc() returned NULL when "
+				"building the %s stream\n",
+				stream_names[stream]);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	dinamite_hashtable_set_layout(layout);
+	pthread_barrier_init(&barrier, NULL, threads);
+	gate = 0;
+	for(created = 0; created < threads; created++) {
+		if( (errno = pthread_create(&td[created].tid, NULL, thread_func,
+					    &td[created])) != 0) {
+			fprintf(stderr, "Warning: could not create thread %d "
+				"of %d: %s\n", created, threads,
+				strerror(errno));
+			ret = -1;
+			break;
+		}
+	}
+	pthread_mutex_lock(&gate_lock);
+	gate = ret ? -1 : 1;
+	pthread_cond_broadcast(&gate_cond);
+	pthread_mutex_unlock(&gate_lock);
+	for(i = 0; i < created; i++)
+		pthread_join(td[i].tid, NULL);
+	pthread_barrier_destroy(&barrier);
+	if(ret != 0)
+		goto out;
+
+	for(int p = 0; p < NUM_PHASES; p++) {
+		uint64_t start = td[0].start[p], end = td[0].end[p];
+
+		for(i = 1; i < threads; i++) {
+			if(td[i].start[p] < start)
+				start = td[i].start[p];
+			if(td[i].end[p] > end)
+				end = td[i].end[p];
+		}
+		report(label, layout, stream, threads, p, td, end - start);
+	}
+
+out:
+	dinamite_hashtable_clear();
+	for(i = 0; i < threads; i++)
+		free_stream(&td[i]);
+	return ret;
+}
+
+static int
+lookup(const char *name, const char **names, int n) {
+
+	for(int i = 0; i < n; i++)
+		if(strcmp(name, names[i]) == 0)
+			return i;
+	return -1;
+}
+
+int main(int argc, char **argv) {
+
+	const char *label = "-";
+	int max_threads = MAX_THREADS, layout = -1, stream = -1, opt;
+
+	while( (opt = getopt(argc, argv, "n:t:l:s:c:")) != -1) {
+		switch(opt) {
+		case 'n':
+			num_values = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'l':
+			layout = lookup(optarg, layout_names, NUM_LAYOUTS);
+			if(layout < 0)
+				goto usage;
+			break;
+		case 's':
+			stream = lookup(optarg, stream_names, NUM_STREAMS);
+			if(stream < 0)
+				goto usage;
+			break;
+		case 'c':
+			label = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if(num_values == 0 || max_threads < 1 || max_threads > MAX_THREADS)
+		goto usage;
+
+	init_zipf();
+	printf("label,layout,stream,threads,phase,ops,usec,mops_per_sec,"
+	       "p50_cycles,p90_cycles,p99_cycles,p999_cycles\n");
+
+	for(int l = 0; l < NUM_LAYOUTS; l++) {
+		if(layout >= 0 && l != layout)
+			continue;
+		for(int s = 0; s < NUM_STREAMS; s++) {
+			if(stream >= 0 && s != stream)
+				continue;
+			for(size_t t = 0; t < sizeof(thread_counts) /
+				    sizeof(thread_counts[0]); t++) {
+				if(thread_counts[t] > max_threads)
+					break;
+				if(run(label, l, s, thread_counts[t]) != 0)
+					return -1;
+			}
+		}
+	}
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-n values per thread] [-t max threads "
+		"(1-%d)] [-l chained|swiss|roaring|hll]\n"
+		"\t[-s heap|page|zipf|unique] [-c label]\n", argv[0],
+		MAX_THREADS);
+	return -1;
+}
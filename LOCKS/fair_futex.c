@@ -1,11 +1,12 @@
 #include <fair_futex.h>
+#include <lock_prof.h>
 #include <limits.h>
 #include <stdio.h>
 
 static long
 sys_futex(void *addr1, int op, int val1, struct timespec *timeout, void *addr2,
 int val2) {
-	return syscall(SYS_futex, addr1, op, val2, timeout, addr2, val2);
+	return syscall(SYS_futex, addr1, op, val1, timeout, addr2, val2);
 }
 
 #define SPIN_CONTROL 8
@@ -19,9 +20,9 @@ fair_futex_init(fair_futex_t *lock) {
 int
 fair_futex_lock(fair_futex_t *lock) {
 
-	uint32_t ticket;
+	uint32_t ticket, depth;
 	uint32_t old_futex;
-	int pause_cnt;
+	uint64_t start;
 
 	/*
 	 * Possibly wrap: if we have more than 64K lockers waiting, the ticket
@@ -30,17 +31,14 @@ fair_futex_lock(fair_futex_t *lock) {
 	 */
 	ticket = __atomic_fetch_add(&lock->fairlock.fair_lock_waiter, 1,
 				      __ATOMIC_SEQ_CST);
+	depth = ticket - lock->fairlock.fair_lock_owner;
+	start = depth != 0 ? lock_prof_now() : 0;
 retry:
 	__sync_synchronize();
 	old_futex = lock->futex;
-	if(old_futex == (uint32_t)ticket / SPIN_CONTROL) {
-//		printf("ticket %d spins (lo: %d)\n", ticket,
-//		       lock->fairlock.fair_lock_owner);
+	if(old_futex == (uint32_t)ticket / SPIN_CONTROL)
 		while (ticket != lock->fairlock.fair_lock_owner) ;
-	}
 	else {
-//		printf("ticket %d sleeps (lo: %d)\n", ticket,
-//		       lock->fairlock.fair_lock_owner);
 		sys_futex((void*)&lock->futex, FUTEX_WAIT, old_futex, 0, 0, 0);
 		goto retry;
 	}
@@ -50,16 +48,24 @@ retry:
 	 * lock see consistent data.
 	 */
 	__sync_synchronize();
-
-//	printf("ticket %d got lock\n", ticket);
+	if(LOCK_PROFILE)
+		lock_prof_acquired(&lock->fairlock, start, depth);
 
 	return ticket;
 }
 
+/*
+ * A free lock has no sleepers, and the futex already holds the group of
+ * the owner's ticket, which is ours, so taking the ticket is enough.
+ */
 int
-fair_futex_unlock(fair_futex_t *lock) {
+fair_futex_trylock(fair_futex_t *lock) {
 
-//	printf("ticket %d unlocking\n", lock->fairlock.fair_lock_owner);
+	return fair_trylock(&lock->fairlock);
+}
+
+int
+fair_futex_unlock(fair_futex_t *lock) {
 
 	/* Only the lock holder ever increments the futex value */
 	uint32_t old_futex = lock->futex;
@@ -68,16 +74,108 @@ fair_futex_unlock(fair_futex_t *lock) {
 	__sync_synchronize();
 
 	/* Only wake if we are changing the value of the futex */
-	if(lock->futex != old_futex) {
-//		printf("ticket %d to wake\n",  lock->fairlock.fair_lock_owner);
+	if(lock->futex != old_futex)
 		sys_futex((void*)&lock->futex, FUTEX_WAKE, INT_MAX, 0, 0, 0);
-//		printf("ticket %d wakes: old fut: %d, fut: %d\n",
-//		       lock->fairlock.fair_lock_owner, old_futex, lock->futex);
+	fair_unlock(&lock->fairlock);
+	return (0);
+}
+
+#define RING_SLOT(lock, group) \
+	(&(lock)->slots[(group) % FAIR_FUTEX_RING_SLOTS])
+
+/*
+ * Only group 0 starts released. The other slots start with UINT32_MAX,
+ * which is not the first group to use them.
+ */
+int
+fair_futex_ring_init(fair_futex_ring_t *lock, unsigned spin_group) {
+
+	int i;
+
+	if(spin_group == 0 || (spin_group & (spin_group - 1)) != 0) {
+		fprintf(stderr, "Warning: the spin group must be a power of "
+			"two, not %u\n", spin_group);
+		return -1;
 	}
-	else {
-//		printf("DISASTER! old fut: %d, fut: %d flo: %d\n",
-//		       old_futex, lock->futex, lock->fairlock.fair_lock_owner);
-//		_exit(-1);
+	lock->spin_shift = __builtin_ctz(spin_group);
+	for(i = 0; i < FAIR_FUTEX_RING_SLOTS; i++) {
+		lock->slots[i].group = UINT32_MAX;
+		lock->slots[i].sleepers = 0;
 	}
+	lock->slots[0].group = 0;
+	fair_init(&lock->fairlock);
+	return 0;
+}
+
+int
+fair_futex_ring_lock(fair_futex_ring_t *lock) {
+
+	uint32_t ticket, group, seen, depth;
+	struct __fair_futex_slot *slot;
+	uint64_t start;
+
+	ticket = __atomic_fetch_add(&lock->fairlock.fair_lock_waiter, 1,
+				      __ATOMIC_SEQ_CST);
+	depth = ticket - lock->fairlock.fair_lock_owner;
+	start = depth != 0 ? lock_prof_now() : 0;
+	group = ticket >> lock->spin_shift;
+	slot = RING_SLOT(lock, group);
+
+	/*
+	 * Sleep until our group is released. Another group that shares the
+	 * slot may wake us too; we then see the wrong group and sleep again.
+	 */
+	while((seen = slot->group) != group) {
+		__atomic_fetch_add(&slot->sleepers, 1, __ATOMIC_SEQ_CST);
+		sys_futex((void*)&slot->group, FUTEX_WAIT, seen, 0, 0, 0);
+		__atomic_fetch_sub(&slot->sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+
+	while (ticket != lock->fairlock.fair_lock_owner) ;
+
+	__sync_synchronize();
+	if(LOCK_PROFILE)
+		lock_prof_acquired(&lock->fairlock, start, depth);
+
+	return ticket;
+}
+
+/*
+ * A free lock has no waiters, and the owner's group is already released,
+ * as for the fair futex.
+ */
+int
+fair_futex_ring_trylock(fair_futex_ring_t *lock) {
+
+	return fair_trylock(&lock->fairlock);
+}
+
+int
+fair_futex_ring_unlock(fair_futex_ring_t *lock) {
+
+	uint32_t next = lock->fairlock.fair_lock_owner + 1;
+	uint32_t group = next >> lock->spin_shift;
+	struct __fair_futex_slot *slot;
+
+	/*
+	 * Pass the lock on first: if we woke the next group before, one of
+	 * them could preempt us and spin for a whole time slice, waiting
+	 * for this very increment. Nobody can pass the new group before we
+	 * release it, so the order stays FIFO.
+	 */
 	fair_unlock(&lock->fairlock);
+
+	if(group != (next - 1) >> lock->spin_shift) {
+		slot = RING_SLOT(lock, group);
+		slot->group = group;
+		/*
+		 * A waiter counts itself before it checks the group in
+		 * FUTEX_WAIT, so if we see no sleepers, it sees our group.
+		 */
+		__sync_synchronize();
+		if(slot->sleepers != 0)
+			sys_futex((void*)&slot->group, FUTEX_WAKE, INT_MAX,
+				  0, 0, 0);
+	}
+	return 0;
 }
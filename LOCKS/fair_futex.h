@@ -11,8 +11,37 @@ typedef struct __fair_futex {
 	volatile uint32_t futex;
 } fair_futex_t;
 
+/*
+ * A variant where waiters sleep on a ring of futex slots, each in its own
+ * cache line, instead of one shared futex word. Tickets are split into
+ * groups of spin_group consecutive tickets, and each group sleeps on its
+ * own slot. The unlock that hands the lock to a new group wakes only that
+ * group, and its members spin until their turn, so the order stays FIFO.
+ * With a group of one, an unlock wakes exactly the next waiter. The slot
+ * counts its sleepers, so an unlock makes no system call when nobody
+ * sleeps there.
+ */
+#define FAIR_FUTEX_RING_SLOTS 128
+
+struct __fair_futex_slot {
+	volatile uint32_t group;      /* The group last released */
+	volatile uint32_t sleepers;   /* Waiters in or entering FUTEX_WAIT */
+} __attribute__((aligned(64)));
+
+typedef struct __fair_futex_ring {
+	fair_lock_t fairlock;
+	uint32_t spin_shift;          /* log2 of the group size */
+	struct __fair_futex_slot slots[FAIR_FUTEX_RING_SLOTS];
+} fair_futex_ring_t;
+
 void fair_futex_init(fair_futex_t *lock);
 int fair_futex_lock(fair_futex_t *lock);
+int fair_futex_trylock(fair_futex_t *lock);
 int fair_futex_unlock(fair_futex_t *lock);
 
+int fair_futex_ring_init(fair_futex_ring_t *lock, unsigned spin_group);
+int fair_futex_ring_lock(fair_futex_ring_t *lock);
+int fair_futex_ring_trylock(fair_futex_ring_t *lock);
+int fair_futex_ring_unlock(fair_futex_ring_t *lock);
+
 #endif
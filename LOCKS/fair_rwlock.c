@@ -0,0 +1,200 @@
+#include <fair_rwlock.h>
+#include <lock_prof.h>
+#include <errno.h>
+#include <sched.h>
+
+/* Pauses before a waiter yields the CPU to the threads ahead of it */
+#define SPINCOUNT 100
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __sync_synchronize()
+#endif
+
+void
+fair_rw_init(fair_rwlock_t *lock) {
+	lock->u.lock = 0;
+}
+
+/*
+ * __fair_rw_wait --
+ *	Wait for a ticket to be served.
+ */
+static void
+__fair_rw_wait(volatile uint16_t *serving, uint16_t ticket)
+{
+	int pause_cnt;
+
+	for (pause_cnt = 0; ticket != *serving;) {
+		if (++pause_cnt < SPINCOUNT)
+			cpu_relax();
+		else {
+			sched_yield();
+			pause_cnt = 0;
+		}
+	}
+}
+
+/* The ticket a locker takes: the old value of next */
+static uint16_t
+__fair_rw_ticket(fair_rwlock_t *lock)
+{
+	return (__atomic_fetch_add(&lock->u.s.next, 1, __ATOMIC_SEQ_CST));
+}
+
+/*
+ * fair_readlock --
+ *	Get a shared lock.
+ */
+int
+fair_readlock(fair_rwlock_t *lock)
+{
+	uint16_t ticket, depth;
+	uint64_t start;
+
+	/*
+	 * Possibly wrap: if we have more than 64K lockers waiting, the ticket
+	 * value will wrap and two lockers will simultaneously be granted the
+	 * lock.
+	 */
+	ticket = __fair_rw_ticket(lock);
+	depth = ticket - lock->u.s.readers;
+	start = depth != 0 ? lock_prof_now() : 0;
+	__fair_rw_wait(&lock->u.s.readers, ticket);
+
+	/*
+	 * We are the only locker that can bump readers now: let the next
+	 * locker in if it is a reader. Writers only move on when we unlock.
+	 */
+	++lock->u.s.readers;
+
+	/*
+	 * Applications depend on a barrier here so that operations holding the
+	 * lock see consistent data.
+	 */
+	__sync_synchronize();
+	if (LOCK_PROFILE)
+		lock_prof_acquired(lock, start, depth);
+
+	return (0);
+}
+
+/*
+ * fair_try_readlock --
+ *	Get a shared lock only if no writer holds the lock or waits for it,
+ *	taking the next ticket and letting it in in one atomic step.
+ */
+int
+fair_try_readlock(fair_rwlock_t *lock)
+{
+	fair_rwlock_t new, old;
+
+	old.u.lock = lock->u.lock;
+	if (old.u.s.readers != old.u.s.next)
+		return (EBUSY);
+
+	new.u.lock = old.u.lock;
+	new.u.s.readers = new.u.s.next = old.u.s.next + 1;
+	if (!__sync_bool_compare_and_swap(&lock->u.lock, old.u.lock,
+	    new.u.lock))
+		return (EBUSY);
+
+	if (LOCK_PROFILE)
+		lock_prof_acquired(lock, 0, 0);
+	return (0);
+}
+
+/*
+ * fair_readunlock --
+ *	Release a shared lock. Readers leave in any order, so this must be
+ *	atomic; the writer waiting behind all of us gets in once the last one
+ *	has left.
+ */
+int
+fair_readunlock(fair_rwlock_t *lock)
+{
+	if (LOCK_PROFILE)
+		lock_prof_released(lock);
+	__atomic_fetch_add(&lock->u.s.writers, 1, __ATOMIC_SEQ_CST);
+
+	return (0);
+}
+
+/*
+ * fair_writelock --
+ *	Get an exclusive lock.
+ */
+int
+fair_writelock(fair_rwlock_t *lock)
+{
+	uint16_t ticket, depth;
+	uint64_t start;
+
+	ticket = __fair_rw_ticket(lock);
+	depth = ticket - lock->u.s.writers;
+	start = depth != 0 ? lock_prof_now() : 0;
+	__fair_rw_wait(&lock->u.s.writers, ticket);
+
+	__sync_synchronize();
+	if (LOCK_PROFILE)
+		lock_prof_acquired(lock, start, depth);
+
+	return (0);
+}
+
+/*
+ * fair_try_writelock --
+ *	Get an exclusive lock only if nobody holds the lock or waits for it.
+ */
+int
+fair_try_writelock(fair_rwlock_t *lock)
+{
+	fair_rwlock_t new, old;
+
+	old.u.lock = lock->u.lock;
+	if (old.u.s.writers != old.u.s.next)
+		return (EBUSY);
+
+	new.u.lock = old.u.lock;
+	new.u.s.next++;
+	if (!__sync_bool_compare_and_swap(&lock->u.lock, old.u.lock,
+	    new.u.lock))
+		return (EBUSY);
+
+	if (LOCK_PROFILE)
+		lock_prof_acquired(lock, 0, 0);
+	return (0);
+}
+
+/*
+ * fair_writeunlock --
+ *	Release an exclusive lock, passing it to the next locker, whichever
+ *	kind it is.
+ */
+int
+fair_writeunlock(fair_rwlock_t *lock)
+{
+	fair_rwlock_t copy;
+
+	if (LOCK_PROFILE)
+		lock_prof_released(lock);
+
+	/*
+	 * Ensure that all updates made while the lock was held are visible to
+	 * the next thread to acquire the lock.
+	 */
+	__sync_synchronize();
+
+	/*
+	 * We have exclusive access, so nobody else changes writers or readers:
+	 * bump both, and store them together, so that a reader and a writer
+	 * waiting for the next ticket never see only one of them move.
+	 */
+	copy.u.lock = lock->u.lock;
+	++copy.u.s.writers;
+	++copy.u.s.readers;
+	lock->u.i.wr = copy.u.i.wr;
+
+	return (0);
+}
@@ -0,0 +1,45 @@
+#ifndef __FAIR_RWLOCK_H
+#define __FAIR_RWLOCK_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+/*
+ * A fair reader-writer lock, with the same ticket scheme as the fair lock.
+ * Every locker, reader or writer, takes a ticket from next and waits for
+ * its turn, so the lock is FIFO and writers never starve. A reader's turn
+ * comes when readers reaches its ticket; it bumps readers right away, so
+ * that the readers queued behind it get in too. A writer's turn comes when
+ * writers reaches its ticket, that is when everyone ahead of it, readers
+ * included, has unlocked.
+ *
+ * The fields are available as a union to allow for atomically setting
+ * the state of the entire lock. The tickets are 16 bits, so there can be
+ * at most 64K lockers at once.
+ */
+struct __fair_rwlock {
+	union {
+		volatile uint64_t lock;
+		struct {
+			volatile uint32_t wr;     /* Writers and readers */
+		} i;
+		struct {
+			volatile uint16_t writers; /* Now serving for writers */
+			volatile uint16_t readers; /* Now serving for readers */
+			volatile uint16_t next;    /* Next available ticket */
+			volatile uint16_t notused;
+		} s;
+	} u;
+};
+
+typedef struct __fair_rwlock fair_rwlock_t;
+
+void fair_rw_init(fair_rwlock_t *lock);
+int fair_readlock(fair_rwlock_t *lock);
+int fair_try_readlock(fair_rwlock_t *lock);
+int fair_readunlock(fair_rwlock_t *lock);
+int fair_writelock(fair_rwlock_t *lock);
+int fair_try_writelock(fair_rwlock_t *lock);
+int fair_writeunlock(fair_rwlock_t *lock);
+
+#endif
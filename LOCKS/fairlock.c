@@ -1,24 +1,64 @@
 #include <fairlock.h>
+#include <lock_prof.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+#include <rdtsc.h>
 
-#define SPINCOUNT 1000
-#define MILLION 1000000
+/*
+ * The spin budget, roughly what parking and being woken up costs, and the
+ * pauses per ticket of distance between two looks at the owner.
+ */
+#define SPIN_BUDGET_CYCLES 20000
+#define BACKOFF_PAUSES 16
+#define BACKOFF_MAX_PAUSES 128
 
-#define NULL 0
+/* Sample the hold time of one acquisition in HOLD_SAMPLE */
+#define HOLD_SAMPLE 8
 
-static void
-__sleep(uint64_t seconds, uint64_t micro_seconds)
-{
-	struct timeval t;
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __sync_synchronize()
+#endif
 
-	t.tv_sec = (time_t)(seconds + micro_seconds / MILLION);
-	t.tv_usec = (suseconds_t)(micro_seconds % MILLION);
+/*
+ * Each waiter parks with the bit of its ticket, so that an unlock wakes
+ * the next owner, and the waiters a multiple of 32 tickets behind it, which
+ * go back to sleep.
+ */
+#define TICKET_BIT(ticket) (1U << ((ticket) % 32))
 
-	(void)select(0, NULL, NULL, NULL, &t);
+static long
+sys_futex(volatile uint32_t *addr, int op, uint32_t val, uint32_t bitset) {
+	return syscall(SYS_futex, addr, op, val, NULL, NULL, bitset);
 }
 
 void
 fair_init(fair_lock_t *lock) {
 	lock->u.lock = 0;
+	lock->parked = 0;
+	lock->avg_hold = 0;
+	lock->acquired_at = 0;
+}
+
+/*
+ * __fair_park --
+ *	Sleep until the unlock that makes our ticket the owner wakes us. We
+ *	count ourselves before the futex checks that the owner is still the
+ *	one we saw, so an unlock that misses our count has already moved the
+ *	owner, and we do not sleep.
+ */
+static void
+__fair_park(fair_lock_t *lock, uint32_t ticket, uint32_t seen)
+{
+	__atomic_fetch_add(&lock->parked, 1, __ATOMIC_SEQ_CST);
+	if (lock->fair_lock_owner == seen)
+		(void)sys_futex(&lock->fair_lock_owner,
+		    FUTEX_WAIT_BITSET_PRIVATE, seen, TICKET_BIT(ticket));
+	__atomic_fetch_sub(&lock->parked, 1, __ATOMIC_SEQ_CST);
 }
 
 /*
@@ -28,30 +68,41 @@ fair_init(fair_lock_t *lock) {
 int
 fair_lock(fair_lock_t *lock)
 {
-	uint16_t ticket;
-	int pause_cnt;
+	uint32_t ticket, owner, distance, depth;
+	uint64_t start = 0;
+	uint32_t i;
 
 	/*
-	 * Possibly wrap: if we have more than 64K lockers waiting, the ticket
+	 * Possibly wrap: if we have more than 4G lockers waiting, the ticket
 	 * value will wrap and two lockers will simultaneously be granted the
 	 * lock.
 	 */
 	ticket = __atomic_fetch_add(&lock->fair_lock_waiter, 1,
 				      __ATOMIC_SEQ_CST);
 
-	for (pause_cnt = 0; ticket != lock->fair_lock_owner;) {
-		/*
-		 * We failed to get the lock; pause before retrying and if we've
-		 * paused enough, sleep so we don't burn CPU to no purpose. This
-		 * situation happens if there are more threads than cores in the
-		 * system and we're thrashing on shared resources.
-		 */
-#if 0
-		if (++pause_cnt < SPINCOUNT)
-			;
-		else
-			__sleep(0, 10);
-#endif
+	depth = ticket - lock->fair_lock_owner;
+	if (depth != 0) {
+		start = rdtsc();
+		while (ticket != (owner = lock->fair_lock_owner)) {
+			/*
+			 * We failed to get the lock. The threads ahead of us
+			 * will take about distance * avg_hold cycles; if that
+			 * is more than the spin budget, or we already spent
+			 * it, sleep so we don't burn CPU to no purpose. This
+			 * situation happens if there are more threads than
+			 * cores in the system and we're thrashing on shared
+			 * resources.
+			 */
+			distance = ticket - owner;
+			if ((uint64_t)distance * lock->avg_hold >
+			    SPIN_BUDGET_CYCLES ||
+			    rdtsc() - start > SPIN_BUDGET_CYCLES)
+				__fair_park(lock, ticket, owner);
+			else
+				for (i = 0; i < distance * BACKOFF_PAUSES &&
+				    i < BACKOFF_MAX_PAUSES; i++)
+					cpu_relax();
+		}
 	}
 
 	/*
@@ -60,6 +111,36 @@ fair_lock(fair_lock_t *lock)
 	 */
 	__sync_synchronize();
 
+	if (ticket % HOLD_SAMPLE == 0)
+		lock->acquired_at = rdtsc();
+	if (LOCK_PROFILE)
+		lock_prof_acquired(lock, start, depth);
+
+	return (0);
+}
+
+/*
+ * fair_trylock --
+ *	Get a lock only if nobody holds it or waits for it, taking the next
+ *	ticket and checking the owner in one atomic step.
+ */
+int
+fair_trylock(fair_lock_t *lock)
+{
+	fair_lock_t new, old;
+
+	old.u.lock = lock->u.lock;
+	if (old.fair_lock_owner != old.fair_lock_waiter)
+		return (EBUSY);
+
+	new.u.lock = old.u.lock;
+	new.fair_lock_waiter++;
+	if (!__sync_bool_compare_and_swap(&lock->u.lock, old.u.lock,
+	    new.u.lock))
+		return (EBUSY);
+
+	if (LOCK_PROFILE)
+		lock_prof_acquired(lock, 0, 0);
 	return (0);
 }
 
@@ -70,6 +151,10 @@ fair_lock(fair_lock_t *lock)
 int
 fair_unlock(fair_lock_t *lock)
 {
+	uint32_t owner;
+
+	if (LOCK_PROFILE)
+		lock_prof_released(lock);
 
 	/*
 	 * Ensure that all updates made while the lock was held are visible to
@@ -77,10 +162,24 @@ fair_unlock(fair_lock_t *lock)
 	 */
 	__sync_synchronize();
 
+	/* Fold a sampled hold time into the average, by eighths */
+	if (lock->acquired_at != 0) {
+		int64_t hold = (int64_t)(rdtsc() - lock->acquired_at);
+
+		lock->avg_hold += (hold - (int64_t)lock->avg_hold) / 8;
+		lock->acquired_at = 0;
+	}
+
 	/*
 	 * We have exclusive access - the update does not need to be atomic.
 	 */
-	++lock->fair_lock_owner;
+	owner = ++lock->fair_lock_owner;
+
+	/* Wake the next owner if it is parked; see __fair_park */
+	__sync_synchronize();
+	if (lock->parked != 0)
+		(void)sys_futex(&lock->fair_lock_owner,
+		    FUTEX_WAKE_BITSET_PRIVATE, INT_MAX, TICKET_BIT(owner));
 
 	return (0);
 }
@@ -10,6 +10,13 @@
  * necessary. Implements a ticket-based back off spin lock.
  * The fields are available as a union to allow for atomically setting
  * the state of the entire lock.
+ *
+ * A waiter backs off in proportion to its distance from the owner, and
+ * parks on a futex on the owner word once it has spun for longer than a
+ * park and wakeup would cost, or right away if its expected wait, its
+ * distance times the average hold time, is longer than that. The holder
+ * samples hold times in TSC cycles to keep the average; only the holder
+ * writes it.
  */
 struct __fair_lock {
 	union {
@@ -21,11 +28,15 @@ struct __fair_lock {
 	} u;
 #define	fair_lock_owner u.s.owner
 #define	fair_lock_waiter u.s.waiter
+	volatile uint32_t parked;         /* Waiters asleep on the owner */
+	volatile uint32_t avg_hold;       /* Cycles, moving average */
+	uint64_t acquired_at;             /* TSC at acquire, if sampled */
 };
 
 typedef struct __fair_lock fair_lock_t;
 
 int fair_lock(fair_lock_t *lock);
+int fair_trylock(fair_lock_t *lock);
 int fair_unlock(fair_lock_t *lock);
 void fair_init(fair_lock_t *lock);
 
@@ -0,0 +1,230 @@
+#include <lock_prof.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct __lock_prof_stats {
+	const void *lock;         /* NULL if the entry is free */
+	uint64_t acquires;
+	uint64_t contended;       /* Acquisitions that waited */
+	uint64_t wait_cycles;
+	uint64_t hold_cycles;
+	uint64_t acquired_at;     /* While this thread holds the lock */
+	uint64_t wait_hist[LOCK_PROF_BUCKETS];
+	uint64_t hold_hist[LOCK_PROF_BUCKETS];
+	uint64_t depth_hist[LOCK_PROF_BUCKETS];
+} lock_prof_stats_t;
+
+typedef struct __lock_prof_thread {
+	lock_prof_stats_t locks[LOCK_PROF_MAX_LOCKS];
+	uint64_t dropped;         /* Acquisitions of locks that did not fit */
+	struct __lock_prof_thread *next;
+} lock_prof_thread_t;
+
+/*
+ * All tables, for the dump. A reset frees them and bumps the generation,
+ * which tells each thread that its table pointer is stale.
+ */
+static pthread_mutex_t prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+static lock_prof_thread_t *prof_threads;
+static volatile unsigned prof_generation = 1;
+
+static __thread lock_prof_thread_t *my_prof;
+static __thread unsigned my_generation;
+static __thread lock_prof_stats_t *my_last;   /* The last lock we used */
+
+static inline unsigned
+__bucket(uint64_t value) {
+
+	unsigned b;
+
+	if(value == 0)
+		return 0;
+	b = 64 - __builtin_clzll(value);
+	return b < LOCK_PROF_BUCKETS ? b : LOCK_PROF_BUCKETS - 1;
+}
+
+static lock_prof_thread_t *
+__thread_alloc(void) {
+
+	lock_prof_thread_t *pt;
+
+	if( (pt = (lock_prof_thread_t *) calloc(1, sizeof(*pt))) == NULL) {
+		fprintf(stderr, "Warning: could not allocate a lock "
+			"profile\n");
+		return NULL;
+	}
+	pthread_mutex_lock(&prof_mutex);
+	pt->next = prof_threads;
+	prof_threads = pt;
+	my_generation = prof_generation;
+	pthread_mutex_unlock(&prof_mutex);
+	return pt;
+}
+
+/* The calling thread's entry for the lock, or NULL if there is no room */
+static lock_prof_stats_t *
+__lookup(const void *lock) {
+
+	lock_prof_thread_t *pt;
+	unsigned i, n;
+
+	if(my_generation == prof_generation && my_last != NULL &&
+	   my_last->lock == lock)
+		return my_last;
+
+	if(my_prof == NULL || my_generation != prof_generation) {
+		my_last = NULL;
+		if( (my_prof = __thread_alloc()) == NULL)
+			return NULL;
+	}
+	pt = my_prof;
+
+	i = ((uintptr_t)lock >> 4) % LOCK_PROF_MAX_LOCKS;
+	for(n = 0; n < LOCK_PROF_MAX_LOCKS; n++) {
+		lock_prof_stats_t *ls = &pt->locks[i];
+
+		if(ls->lock == NULL)
+			ls->lock = lock;
+		if(ls->lock == lock)
+			return (my_last = ls);
+		i = (i + 1) % LOCK_PROF_MAX_LOCKS;
+	}
+	pt->dropped++;
+	return NULL;
+}
+
+void
+lock_prof_acquired(const void *lock, uint64_t wait_start, uint32_t depth) {
+
+	lock_prof_stats_t *ls;
+	uint64_t now = rdtsc(), wait;
+
+	if( (ls = __lookup(lock)) == NULL)
+		return;
+	wait = wait_start != 0 ? now - wait_start : 0;
+	ls->acquires++;
+	if(depth != 0)
+		ls->contended++;
+	ls->wait_cycles += wait;
+	ls->wait_hist[__bucket(wait)]++;
+	ls->depth_hist[__bucket(depth)]++;
+	ls->acquired_at = now;
+}
+
+void
+lock_prof_released(const void *lock) {
+
+	lock_prof_stats_t *ls;
+	uint64_t hold;
+
+	if( (ls = __lookup(lock)) == NULL || ls->acquired_at == 0)
+		return;
+	hold = rdtsc() - ls->acquired_at;
+	ls->hold_cycles += hold;
+	ls->hold_hist[__bucket(hold)]++;
+	ls->acquired_at = 0;
+}
+
+static void
+__dump_hist(FILE *out, const char *what, const uint64_t *hist) {
+
+	int i;
+
+	fprintf(out, "  %s:", what);
+	for(i = 0; i < LOCK_PROF_BUCKETS; i++) {
+		if(hist[i] == 0)
+			continue;
+		if(i == 0)
+			fprintf(out, " 0:%" PRIu64, hist[i]);
+		else if(i == LOCK_PROF_BUCKETS - 1)
+			fprintf(out, " >=2^%d:%" PRIu64, i - 1, hist[i]);
+		else
+			fprintf(out, " <2^%d:%" PRIu64, i, hist[i]);
+	}
+	fprintf(out, "\n");
+}
+
+/* Add up each lock's entries over all threads, and print them */
+void
+lock_prof_dump(FILE *out) {
+
+	lock_prof_stats_t *merged = NULL;
+	lock_prof_thread_t *pt;
+	size_t num_merged = 0, num_threads = 0, i, j;
+	uint64_t dropped = 0;
+	int b;
+
+	pthread_mutex_lock(&prof_mutex);
+	for(pt = prof_threads; pt != NULL; pt = pt->next)
+		num_threads++;
+	if(num_threads != 0 &&
+	   (merged = (lock_prof_stats_t *) calloc(num_threads *
+		LOCK_PROF_MAX_LOCKS, sizeof(*merged))) == NULL) {
+		pthread_mutex_unlock(&prof_mutex);
+		fprintf(stderr, "Warning: could not allocate memory to dump "
+			"the lock profile\n");
+		return;
+	}
+
+	for(pt = prof_threads; pt != NULL; pt = pt->next) {
+		dropped += pt->dropped;
+		for(i = 0; i < LOCK_PROF_MAX_LOCKS; i++) {
+			lock_prof_stats_t *ls = &pt->locks[i], *m;
+
+			if(ls->lock == NULL)
+				continue;
+			for(j = 0; j < num_merged; j++)
+				if(merged[j].lock == ls->lock)
+					break;
+			m = &merged[j];
+			if(j == num_merged) {
+				m->lock = ls->lock;
+				num_merged++;
+			}
+			m->acquires += ls->acquires;
+			m->contended += ls->contended;
+			m->wait_cycles += ls->wait_cycles;
+			m->hold_cycles += ls->hold_cycles;
+			for(b = 0; b < LOCK_PROF_BUCKETS; b++) {
+				m->wait_hist[b] += ls->wait_hist[b];
+				m->hold_hist[b] += ls->hold_hist[b];
+				m->depth_hist[b] += ls->depth_hist[b];
+			}
+		}
+	}
+	pthread_mutex_unlock(&prof_mutex);
+
+	for(j = 0; j < num_merged; j++) {
+		lock_prof_stats_t *m = &merged[j];
+
+		fprintf(out, "Lock %p: %" PRIu64 " acquisitions, %" PRIu64
+			" contended (%.1f%%), wait %.0f cycles, "
+			"hold %.0f cycles on average\n", m->lock, m->acquires,
+			m->contended, 100.0 * m->contended / m->acquires,
+			(double)m->wait_cycles / m->acquires,
+			(double)m->hold_cycles / m->acquires);
+		__dump_hist(out, "wait cycles", m->wait_hist);
+		__dump_hist(out, "hold cycles", m->hold_hist);
+		__dump_hist(out, "queue depth", m->depth_hist);
+	}
+	if(dropped != 0)
+		fprintf(out, "Acquisitions of locks beyond %d per thread: %"
+			PRIu64 "\n", LOCK_PROF_MAX_LOCKS, dropped);
+	free(merged);
+}
+
+void
+lock_prof_reset(void) {
+
+	lock_prof_thread_t *pt, *next;
+
+	pthread_mutex_lock(&prof_mutex);
+	for(pt = prof_threads; pt != NULL; pt = next) {
+		next = pt->next;
+		free(pt);
+	}
+	prof_threads = NULL;
+	prof_generation++;
+	pthread_mutex_unlock(&prof_mutex);
+}
@@ -0,0 +1,54 @@
+#ifndef __LOCK_PROF_H
+#define __LOCK_PROF_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <rdtsc.h>
+
+/*
+ * Contention profiling for the fair locks. Build with -DLOCK_PROFILE=1
+ * (make PROFILE=1) and every acquisition records, per lock:
+ *  - how long the thread waited, in TSC cycles;
+ *  - how long it held the lock, in TSC cycles;
+ *  - the queue depth it found, as its ticket minus the owner.
+ * Otherwise the calls compile away.
+ *
+ * The counts go into a table of the calling thread, found through
+ * thread-local storage, so recording takes no atomics and shares no cache
+ * lines. A thread profiles up to LOCK_PROF_MAX_LOCKS locks; it only counts
+ * acquisitions of the others. lock_prof_dump() adds up the tables of all
+ * threads, those that exited included, and prints log-scale histograms:
+ * bucket 0 counts zeros and bucket i counts values in [2^(i-1), 2^i).
+ * Numbers dumped while the threads run are approximate.
+ */
+#ifndef LOCK_PROFILE
+#define LOCK_PROFILE 0
+#endif
+
+#define LOCK_PROF_MAX_LOCKS 32
+#define LOCK_PROF_BUCKETS 40
+
+/* The start of a wait, or 0 if we are not profiling */
+static inline uint64_t
+lock_prof_now(void) {
+	return LOCK_PROFILE ? rdtsc() : 0;
+}
+
+/*
+ * A thread got the lock, after waiting since wait_start (0 if it did not
+ * wait) behind depth tickets.
+ */
+void lock_prof_acquired(const void *lock, uint64_t wait_start,
+			uint32_t depth);
+void lock_prof_released(const void *lock);
+
+void lock_prof_dump(FILE *out);
+
+/*
+ * Forget all counts and free the tables. No other thread may take or
+ * release a profiled lock while this runs.
+ */
+void lock_prof_reset(void);
+
+#endif
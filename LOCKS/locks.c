@@ -2,15 +2,27 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <inttypes.h>
 #include <pthread.h>
 
+#include <fairlock.h>
+#include <fair_futex.h>
+#include <fair_rwlock.h>
+#include <queuelock.h>
+#include <lock_prof.h>
+
 #define MILLION 1000000
 #define MAX_THREADS 96
+#define MAX_RUNS 32               /* Thread counts or ratios per sweep */
 #define EXPERIMENT_DURATION_SECONDS 10
 
 static unsigned ratio = 2;
+static unsigned duration = EXPERIMENT_DURATION_SECONDS;
+static int try_first;
+static int write_pct = 100;
 
 #define CS_DURATION 1
 #define NON_CS_DURATION CS_DURATION * ratio
@@ -18,75 +30,325 @@ static unsigned ratio = 2;
 typedef struct {
 	pthread_t tid;
 	unsigned iters_completed;
+	unsigned uncontended;     /* Acquisitions where trylock succeeded */
+	unsigned seed;            /* Picks reads and writes */
 } thread_data_t;
 
-#define USE_PTHREAD_MUTEX 0
-#define USE_FAIR_LOCK 0
-
-#if USE_PTHREAD_MUTEX
+/*
+ * The locks under test, picked at run time with -l. trylock returns 0 if
+ * it took the lock; it is NULL for locks that have none. destroy, if set,
+ * releases what init allocated, between experiments. Reader-writer locks
+ * also have the shared versions, which are NULL for the others; those
+ * take all their locks exclusive, whatever the mix of reads and writes.
+ */
+typedef struct {
+	const char *name;
+	const char *desc;
+	void (*init)(void);
+	void (*lock)(void);
+	void (*unlock)(void);
+	int (*trylock)(void);
+	void (*destroy)(void);
+	void (*rdlock)(void);
+	void (*rdunlock)(void);
+	int (*rdtrylock)(void);
+} lock_ops_t;
 
 static pthread_mutex_t mutex;
 
 static void
-init_lock(void) {
+mutex_init(void) {
 
 	pthread_mutex_init(&mutex, NULL);
-
 }
+
 static void
-acquire_lock(void) {
+mutex_lock(void) {
 
 	pthread_mutex_lock(&mutex);
 }
 
 static void
-release_lock(void) {
+mutex_unlock(void) {
 
 	pthread_mutex_unlock(&mutex);
 }
 
-#elif USE_FAIR_LOCK
-#include <fairlock.h>
+static int
+mutex_trylock(void) {
+
+	return pthread_mutex_trylock(&mutex);
+}
 
-fair_lock_t fairlock;
+static void
+mutex_destroy(void) {
+
+	pthread_mutex_destroy(&mutex);
+}
+
+static fair_lock_t fairlock;
 
 static void
-init_lock(void) {
+fairlock_init(void) {
+
 	fair_init(&fairlock);
 }
 
 static void
-acquire_lock(void) {
+fairlock_lock(void) {
 
 	fair_lock(&fairlock);
 }
 
 static void
-release_lock(void) {
+fairlock_unlock(void) {
 
 	fair_unlock(&fairlock);
 }
 
-#else
-#include <fair_futex.h>
-fair_futex_t fair_futex;
+static int
+fairlock_trylock(void) {
+
+	return fair_trylock(&fairlock);
+}
+
+static fair_futex_t fair_futex;
 
 static void
-init_lock(void) {
+futex_init(void) {
+
 	fair_futex_init(&fair_futex);
 }
 
 static void
-acquire_lock(void) {
+futex_lock(void) {
+
 	fair_futex_lock(&fair_futex);
 }
 
 static void
-release_lock(void) {
+futex_unlock(void) {
+
 	fair_futex_unlock(&fair_futex);
 }
 
-#endif
+static int
+futex_trylock(void) {
+
+	return fair_futex_trylock(&fair_futex);
+}
+
+/* The futex ring, waking groups of 8 tickets like the fair futex, or 1 */
+static fair_futex_ring_t futex_ring;
+
+static void
+ring_init(void) {
+
+	fair_futex_ring_init(&futex_ring, 8);
+}
+
+static void
+ring1_init(void) {
+
+	fair_futex_ring_init(&futex_ring, 1);
+}
+
+static void
+ring_lock(void) {
+
+	fair_futex_ring_lock(&futex_ring);
+}
+
+static void
+ring_unlock(void) {
+
+	fair_futex_ring_unlock(&futex_ring);
+}
+
+static int
+ring_trylock(void) {
+
+	return fair_futex_ring_trylock(&futex_ring);
+}
+
+static fair_rwlock_t fair_rwlock;
+
+static void
+fair_rw_init_lock(void) {
+
+	fair_rw_init(&fair_rwlock);
+}
+
+static void
+fair_rw_writelock(void) {
+
+	fair_writelock(&fair_rwlock);
+}
+
+static void
+fair_rw_writeunlock(void) {
+
+	fair_writeunlock(&fair_rwlock);
+}
+
+static int
+fair_rw_trywritelock(void) {
+
+	return fair_try_writelock(&fair_rwlock);
+}
+
+static void
+fair_rw_readlock(void) {
+
+	fair_readlock(&fair_rwlock);
+}
+
+static void
+fair_rw_readunlock(void) {
+
+	fair_readunlock(&fair_rwlock);
+}
+
+static int
+fair_rw_tryreadlock(void) {
+
+	return fair_try_readlock(&fair_rwlock);
+}
+
+static pthread_rwlock_t rwlock;
+
+static void
+rwlock_init(void) {
+
+	pthread_rwlock_init(&rwlock, NULL);
+}
+
+static void
+rwlock_wrlock(void) {
+
+	pthread_rwlock_wrlock(&rwlock);
+}
+
+static void
+rwlock_unlock(void) {
+
+	pthread_rwlock_unlock(&rwlock);
+}
+
+static int
+rwlock_trywrlock(void) {
+
+	return pthread_rwlock_trywrlock(&rwlock);
+}
+
+static void
+rwlock_rdlock(void) {
+
+	pthread_rwlock_rdlock(&rwlock);
+}
+
+static int
+rwlock_tryrdlock(void) {
+
+	return pthread_rwlock_tryrdlock(&rwlock);
+}
+
+static void
+rwlock_destroy(void) {
+
+	pthread_rwlock_destroy(&rwlock);
+}
+
+static mcs_lock_t mcslock;
+
+static void
+mcslock_init(void) {
+
+	mcs_init(&mcslock);
+}
+
+static void
+mcslock_lock(void) {
+
+	mcs_lock(&mcslock);
+}
+
+static void
+mcslock_unlock(void) {
+
+	mcs_unlock(&mcslock);
+}
+
+static int
+mcslock_trylock(void) {
+
+	return mcs_trylock(&mcslock);
+}
+
+static clh_lock_t clhlock;
+
+static void
+clhlock_init(void) {
+
+	if(clh_init(&clhlock) != 0) {
+		perror("clh_init");
+		exit(-1);
+	}
+}
+
+static void
+clhlock_lock(void) {
+
+	clh_lock(&clhlock);
+}
+
+static void
+clhlock_unlock(void) {
+
+	clh_unlock(&clhlock);
+}
+
+static void
+clhlock_destroy(void) {
+
+	clh_destroy(&clhlock);
+}
+
+static const lock_ops_t lock_table[] = {
+	{ .name = "mutex", .desc = "pthread mutex", .init = mutex_init,
+	  .lock = mutex_lock, .unlock = mutex_unlock,
+	  .trylock = mutex_trylock, .destroy = mutex_destroy },
+	{ .name = "fair", .desc = "fair lock", .init = fairlock_init,
+	  .lock = fairlock_lock, .unlock = fairlock_unlock,
+	  .trylock = fairlock_trylock },
+	{ .name = "futex", .desc = "fair futex", .init = futex_init,
+	  .lock = futex_lock, .unlock = futex_unlock,
+	  .trylock = futex_trylock },
+	{ .name = "ring", .desc = "fair futex ring", .init = ring_init,
+	  .lock = ring_lock, .unlock = ring_unlock, .trylock = ring_trylock },
+	{ .name = "ring1", .desc = "fair futex ring, groups of 1",
+	  .init = ring1_init, .lock = ring_lock, .unlock = ring_unlock,
+	  .trylock = ring_trylock },
+	{ .name = "mcs", .desc = "MCS lock", .init = mcslock_init,
+	  .lock = mcslock_lock, .unlock = mcslock_unlock,
+	  .trylock = mcslock_trylock },
+	{ .name = "clh", .desc = "CLH lock", .init = clhlock_init,
+	  .lock = clhlock_lock, .unlock = clhlock_unlock,
+	  .destroy = clhlock_destroy },
+	{ .name = "fair-rw", .desc = "fair rwlock", .init = fair_rw_init_lock,
+	  .lock = fair_rw_writelock, .unlock = fair_rw_writeunlock,
+	  .trylock = fair_rw_trywritelock, .rdlock = fair_rw_readlock,
+	  .rdunlock = fair_rw_readunlock, .rdtrylock = fair_rw_tryreadlock },
+	{ .name = "pthread-rw", .desc = "pthread rwlock", .init = rwlock_init,
+	  .lock = rwlock_wrlock, .unlock = rwlock_unlock,
+	  .trylock = rwlock_trywrlock, .destroy = rwlock_destroy,
+	  .rdlock = rwlock_rdlock, .rdunlock = rwlock_unlock,
+	  .rdtrylock = rwlock_tryrdlock },
+};
+
+#define NUM_LOCKS (sizeof(lock_table) / sizeof(lock_table[0]))
+
+static const lock_ops_t *ops;
 
 static void
 get_time_or_exit(struct timeval *tv) {
@@ -122,84 +384,94 @@ work (uint64_t target_duration_us) {
 
 /*
  * The threads keep alternating between critical and non-critical sections
- * for the desired duration of the experiment.
+ * for the desired duration of the experiment. With -t, they try the lock
+ * first, to count how often they find it free. With -w, only that percent
+ * of the critical sections write; the others take reader-writer locks
+ * shared.
  */
 static void *
 thread_func(void *arg) {
 
 	int i;
 	struct timeval tv_begin, tv_now;
+	thread_data_t *td = (thread_data_t *) arg;
 
 	get_time_or_exit(&tv_begin);
 
 	for(i = 0; ; i++) {
 
-		acquire_lock();
+		int write = ops->rdlock == NULL ||
+			rand_r(&td->seed) % 100 < write_pct;
+
+		if(write) {
+			if(try_first && ops->trylock() == 0)
+				td->uncontended++;
+			else
+				ops->lock();
+		}
+		else {
+			if(try_first && ops->rdtrylock() == 0)
+				td->uncontended++;
+			else
+				ops->rdlock();
+		}
 		{
 			work(CS_DURATION);
 		}
-		release_lock();
+		if(write)
+			ops->unlock();
+		else
+			ops->rdunlock();
 
 		work(NON_CS_DURATION);
 
 		get_time_or_exit(&tv_now);
 
-		if(tv_now.tv_sec - tv_begin.tv_sec >
-		   EXPERIMENT_DURATION_SECONDS)
+		if(tv_now.tv_sec - tv_begin.tv_sec > duration)
 			break;
 	}
 
-	((thread_data_t*)arg)->iters_completed = i;
+	td->iters_completed = i;
 
 	return 0;
 }
 
+static void
+run_experiment(int threads) {
 
-int main(int argc, char **argv) {
-
-	int i, threads = 8;
-	unsigned total_iters_completed;
+	int i;
+	unsigned total_iters_completed = 0, total_uncontended = 0;
 	struct timeval tv_begin, tv_end;
+	struct rusage ru_begin, ru_end;
 	thread_data_t *thread_data;
 
-	if(argc > 1) {
-		threads = atoi(argv[1]);
-		if(threads < 1 || threads > MAX_THREADS) {
-			fprintf(stderr, "Invalid number of threads\n");
-			exit(-1);
-		}
-	}
-
-	if(argc > 2)
-		ratio = atoi(argv[2]);
-
 	printf("Threads: %d\n", threads);
 	printf("Ratio: %d\n", ratio);
-	printf("Target duration: %d\n", EXPERIMENT_DURATION_SECONDS);
-#if USE_PTHREAD_MUTEX
-	printf("Lock type: pthread mutex\n");
-#elif USE_FAIR_LOCK
-	printf("Lock type: fair lock\n");
-#else
-	printf("Lock type: fair futex\n");
-#endif
+	printf("Target duration: %d\n", duration);
+	printf("Lock type: %s\n", ops->desc);
+	if(ops->rdlock != NULL)
+		printf("Writes: %d%%\n", write_pct);
 
 	/* Allocate an array where each thread will report
 	 * the number of critical sections that it completed.
 	 */
-	thread_data = (thread_data_t *) malloc(sizeof(thread_data_t) * threads);
+	thread_data = (thread_data_t *) calloc(threads, sizeof(thread_data_t));
 	if(thread_data == NULL) {
 		perror("malloc");
 		exit(-1);
 	}
 
-	init_lock();
+	ops->init();
+	getrusage(RUSAGE_SELF, &ru_begin);
 	get_time_or_exit(&tv_begin);
 
 	for(i = 0; i < threads; i++) {
 
-		int ret = pthread_create(&thread_data[i].tid, NULL,
-					 thread_func, &thread_data[i]);
+		int ret;
+
+		thread_data[i].seed = i + 1;
+		ret = pthread_create(&thread_data[i].tid, NULL,
+				     thread_func, &thread_data[i]);
 		if(ret) {
 			perror("pthread_create");
 			exit(-1);
@@ -214,14 +486,178 @@ int main(int argc, char **argv) {
 			exit(-1);
 		}
 		total_iters_completed += thread_data[i].iters_completed;
+		total_uncontended += thread_data[i].uncontended;
 	}
 
 	get_time_or_exit(&tv_end);
+	getrusage(RUSAGE_SELF, &ru_end);
+	if(ops->destroy != NULL)
+		ops->destroy();
+	free(thread_data);
 
 	unsigned long actual_duration = tv_end.tv_sec - tv_begin.tv_sec;
 	printf("Actual duration: %ld\n", actual_duration);
 	printf("Iterations completed: %d\n", total_iters_completed);
 	printf("Iterations per second: %ld\n", total_iters_completed /
 	       actual_duration);
+	printf("Context switches: %ld voluntary, %ld involuntary\n",
+	       ru_end.ru_nvcsw - ru_begin.ru_nvcsw,
+	       ru_end.ru_nivcsw - ru_begin.ru_nivcsw);
+	if(try_first)
+		printf("Uncontended acquisitions: %.1f%%\n",
+		       total_iters_completed == 0 ? 0.0 :
+		       100.0 * total_uncontended / total_iters_completed);
+	if(LOCK_PROFILE) {
+		lock_prof_dump(stdout);
+		lock_prof_reset();
+	}
+	fflush(stdout);
+}
+
+static void
+usage(const char *prog) {
+
+	unsigned i;
+
+	fprintf(stderr, "Usage: %s [-l lock[,lock...]] [-d seconds] [-t] "
+		"[-w percent] "
+		"[threads[,threads...] [ratio[,ratio...]]]\n", prog);
+	fprintf(stderr, "  -l  locks to run, or all (default: futex):");
+	for(i = 0; i < NUM_LOCKS; i++)
+		fprintf(stderr, " %s", lock_table[i].name);
+	fprintf(stderr, "\n  -d  seconds per experiment (default: %d)\n"
+		"  -t  try the lock first, and report how often it was free\n"
+		"  -w  percent of critical sections that write, for "
+		"reader-writer locks (default: 100)\n",
+		EXPERIMENT_DURATION_SECONDS);
+	exit(-1);
+}
+
+/* Parse a comma-separated list of numbers in [min, max] */
+static int
+parse_numbers(const char *arg, unsigned *vals, unsigned min, unsigned max) {
+
+	char *end;
+	int n = 0;
+
+	for(;;) {
+		unsigned long v = strtoul(arg, &end, 10);
+
+		if(end == arg || v < min || v > max || n == MAX_RUNS)
+			return -1;
+		vals[n++] = v;
+		if(*end == '\0')
+			return n;
+		if(*end != ',')
+			return -1;
+		arg = end + 1;
+	}
+}
+
+/* Parse a comma-separated list of lock names, or all */
+static int
+parse_locks(const char *arg, const lock_ops_t **locks) {
+
+	const char *name = arg;
+	int n = 0;
+	unsigned i;
+
+	if(strcmp(arg, "all") == 0) {
+		for(i = 0; i < NUM_LOCKS; i++)
+			locks[n++] = &lock_table[i];
+		return n;
+	}
+
+	while(*name != '\0') {
+		size_t len = strcspn(name, ",");
 
+		for(i = 0; i < NUM_LOCKS; i++)
+			if(strlen(lock_table[i].name) == len &&
+			   strncmp(lock_table[i].name, name, len) == 0)
+				break;
+		if(i == NUM_LOCKS || n == NUM_LOCKS) {
+			fprintf(stderr, "Unknown lock: %.*s\n", (int)len, name);
+			return -1;
+		}
+		locks[n++] = &lock_table[i];
+		name += len;
+		if(*name == ',')
+			name++;
+	}
+	return n;
+}
+
+/*
+ * Run every combination of the given locks, thread counts and ratios, one
+ * experiment after the other, in a single process.
+ */
+int main(int argc, char **argv) {
+
+	const lock_ops_t *locks[NUM_LOCKS];
+	unsigned thread_counts[MAX_RUNS] = { 8 }, ratios[MAX_RUNS] = { 2 };
+	int num_locks = 1, num_threads = 1, num_ratios = 1;
+	int l, t, r, opt;
+
+	locks[0] = &lock_table[2];
+
+	while((opt = getopt(argc, argv, "l:d:tw:")) != -1) {
+		switch(opt) {
+		case 'l':
+			if( (num_locks = parse_locks(optarg, locks)) <= 0)
+				usage(argv[0]);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			if(duration < 1) {
+				fprintf(stderr, "Invalid duration\n");
+				exit(-1);
+			}
+			break;
+		case 't':
+			try_first = 1;
+			break;
+		case 'w':
+			write_pct = atoi(optarg);
+			if(write_pct < 0 || write_pct > 100) {
+				fprintf(stderr, "Invalid write percent\n");
+				exit(-1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if(optind < argc &&
+	   (num_threads = parse_numbers(argv[optind++], thread_counts, 1,
+					MAX_THREADS)) < 0) {
+		fprintf(stderr, "Invalid number of threads\n");
+		exit(-1);
+	}
+	if(optind < argc &&
+	   (num_ratios = parse_numbers(argv[optind++], ratios, 0,
+				       1000000)) < 0) {
+		fprintf(stderr, "Invalid ratio\n");
+		exit(-1);
+	}
+	if(optind < argc)
+		usage(argv[0]);
+
+	if(try_first)
+		for(l = 0; l < num_locks; l++)
+			if(locks[l]->trylock == NULL) {
+				fprintf(stderr, "The %s has no trylock\n",
+					locks[l]->desc);
+				exit(-1);
+			}
+
+	for(l = 0; l < num_locks; l++)
+		for(r = 0; r < num_ratios; r++)
+			for(t = 0; t < num_threads; t++) {
+				ops = locks[l];
+				ratio = ratios[r];
+				run_experiment(thread_counts[t]);
+			}
+
+	return 0;
 }
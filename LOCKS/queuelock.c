@@ -0,0 +1,209 @@
+#include <queuelock.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __sync_synchronize()
+#endif
+
+/*
+ * Each thread's pool of nodes. An MCS node is only used while its thread
+ * waits for or holds the lock, so it goes back to the pool at unlock. A CLH
+ * node outlives that: the successor spins on it, so at unlock the thread
+ * takes its predecessor's node instead, which nobody looks at anymore.
+ * That is why the CLH pool holds pointers. The nodes of a thread that
+ * exits are not freed; like the thread's stack, they are few.
+ */
+static __thread queuelock_node_t mcs_pool[QUEUELOCK_MAX_HELD];
+static __thread queuelock_node_t *clh_pool[QUEUELOCK_MAX_HELD];
+
+static queuelock_node_t *
+__clh_node_alloc(void) {
+
+	void *node;
+
+	if(posix_memalign(&node, sizeof(queuelock_node_t),
+			  sizeof(queuelock_node_t)) != 0)
+		return NULL;
+	((queuelock_node_t *)node)->locked = 0;
+	return (queuelock_node_t *)node;
+}
+
+/* A free node from the thread's MCS pool, ready to queue */
+static queuelock_node_t *
+__mcs_node_get(void) {
+
+	queuelock_node_t *node;
+	int i;
+
+	for(i = 0; i < QUEUELOCK_MAX_HELD; i++)
+		if(!mcs_pool[i].in_use) {
+			node = &mcs_pool[i];
+			node->in_use = 1;
+			node->next = NULL;
+			node->locked = 1;
+			return node;
+		}
+	fprintf(stderr, "Warning: a thread holds more than %d queue "
+		"locks\n", QUEUELOCK_MAX_HELD);
+	return NULL;
+}
+
+void
+mcs_init(mcs_lock_t *lock) {
+	lock->tail = NULL;
+	lock->holder = NULL;
+}
+
+/*
+ * mcs_lock --
+ *	Get the lock, waiting in line behind the current tail.
+ */
+int
+mcs_lock(mcs_lock_t *lock)
+{
+	queuelock_node_t *node, *pred;
+
+	if( (node = __mcs_node_get()) == NULL)
+		return (-1);
+
+	pred = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if(pred != NULL) {
+		__atomic_store_n(&pred->next, node, __ATOMIC_RELEASE);
+		while(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+			cpu_relax();
+	}
+
+	lock->holder = node;
+	return (0);
+}
+
+/*
+ * mcs_trylock --
+ *	Get the lock only if nobody holds it or waits for it.
+ */
+int
+mcs_trylock(mcs_lock_t *lock)
+{
+	queuelock_node_t *node, *expected = NULL;
+
+	if( (node = __mcs_node_get()) == NULL)
+		return (-1);
+
+	if(!__atomic_compare_exchange_n(&lock->tail, &expected, node, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		node->in_use = 0;
+		return (EBUSY);
+	}
+
+	lock->holder = node;
+	return (0);
+}
+
+/*
+ * mcs_unlock --
+ *	Release the lock to the next thread in line, if there is one.
+ */
+int
+mcs_unlock(mcs_lock_t *lock)
+{
+	queuelock_node_t *node = lock->holder, *next;
+
+	next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if(next == NULL) {
+		queuelock_node_t *expected = node;
+
+		/* Nobody behind us: the lock is free */
+		if(__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+					       __ATOMIC_RELEASE,
+					       __ATOMIC_RELAXED)) {
+			node->in_use = 0;
+			return (0);
+		}
+		/* Somebody is linking in behind us; wait for the link */
+		while((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))
+		      == NULL)
+			cpu_relax();
+	}
+
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+	node->in_use = 0;
+	return (0);
+}
+
+/* The lock starts with a released node at the tail */
+int
+clh_init(clh_lock_t *lock) {
+
+	if( (lock->tail = __clh_node_alloc()) == NULL)
+		return (-1);
+	lock->holder = NULL;
+	lock->holder_pred = NULL;
+	lock->holder_slot = NULL;
+	return (0);
+}
+
+/*
+ * clh_lock --
+ *	Get the lock, waiting for the thread ahead of us to release it.
+ */
+int
+clh_lock(clh_lock_t *lock)
+{
+	queuelock_node_t *node, *pred, **slot = NULL;
+	int i;
+
+	for(i = 0; i < QUEUELOCK_MAX_HELD; i++)
+		if(clh_pool[i] == NULL || !clh_pool[i]->in_use) {
+			slot = &clh_pool[i];
+			break;
+		}
+	if(slot == NULL) {
+		fprintf(stderr, "Warning: a thread holds more than %d queue "
+			"locks\n", QUEUELOCK_MAX_HELD);
+		return (-1);
+	}
+	if(*slot == NULL && (*slot = __clh_node_alloc()) == NULL)
+		return (-1);
+
+	node = *slot;
+	node->in_use = 1;
+	node->locked = 1;
+
+	pred = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	while(__atomic_load_n(&pred->locked, __ATOMIC_ACQUIRE))
+		cpu_relax();
+
+	lock->holder = node;
+	lock->holder_pred = pred;
+	lock->holder_slot = slot;
+	return (0);
+}
+
+/*
+ * clh_unlock --
+ *	Release the lock, and take over our predecessor's node.
+ */
+int
+clh_unlock(clh_lock_t *lock)
+{
+	queuelock_node_t *node = lock->holder;
+	queuelock_node_t *pred = lock->holder_pred;
+	queuelock_node_t **slot = lock->holder_slot;
+
+	pred->in_use = 0;
+	*slot = pred;
+	__atomic_store_n(&node->locked, 0, __ATOMIC_RELEASE);
+	return (0);
+}
+
+/* Free the node at the tail; the lock must be free */
+void
+clh_destroy(clh_lock_t *lock) {
+
+	free(lock->tail);
+	lock->tail = NULL;
+}
@@ -0,0 +1,60 @@
+#ifndef __QUEUELOCK_H
+#define __QUEUELOCK_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+/*
+ * Queue locks: each waiter spins on a flag in its own cache line, so an
+ * unlock only disturbs the next waiter, rather than every waiter as with
+ * the shared owner word of the fair lock. Both are FIFO.
+ *
+ * In the MCS lock, waiters form a linked list; a waiter spins on its own
+ * node and the holder hands the lock to its successor by clearing the
+ * successor's flag. In the CLH lock, each waiter spins on the node of its
+ * predecessor, and the holder releases the lock by clearing its own node,
+ * which the successor then recycles.
+ *
+ * The nodes come from a small per-thread pool, so the locks have the same
+ * init/lock/unlock shape as the fair lock. A thread can hold up to
+ * QUEUELOCK_MAX_HELD queue locks at once, released in any order.
+ *
+ * Only the MCS lock has a trylock, which returns EBUSY if the lock is
+ * taken. A CLH trylock would have to check that the tail node is released
+ * and swap it out in one step, but the node can be recycled and queued
+ * again in between.
+ */
+#define QUEUELOCK_MAX_HELD 16
+
+struct __queuelock_node {
+	struct __queuelock_node * volatile next;   /* MCS only */
+	volatile uint32_t locked;
+	uint32_t in_use;            /* Taken from the thread's pool */
+} __attribute__((aligned(64)));
+
+typedef struct __queuelock_node queuelock_node_t;
+
+typedef struct __mcs_lock {
+	queuelock_node_t * volatile tail;
+	/* Only the holder reads and writes the rest */
+	queuelock_node_t *holder __attribute__((aligned(64)));
+} mcs_lock_t;
+
+typedef struct __clh_lock {
+	queuelock_node_t * volatile tail;
+	queuelock_node_t *holder __attribute__((aligned(64)));
+	queuelock_node_t *holder_pred;
+	queuelock_node_t **holder_slot;   /* In the holder's pool */
+} clh_lock_t;
+
+void mcs_init(mcs_lock_t *lock);
+int mcs_lock(mcs_lock_t *lock);
+int mcs_trylock(mcs_lock_t *lock);
+int mcs_unlock(mcs_lock_t *lock);
+
+int clh_init(clh_lock_t *lock);
+int clh_lock(clh_lock_t *lock);
+int clh_unlock(clh_lock_t *lock);
+void clh_destroy(clh_lock_t *lock);
+
+#endif
@@ -1,13 +1,14 @@
-#!/bin/sh
-
+#!/bin/bash
+# Usage: run-many.sh ratio [lock ...]
+# Runs each lock (all of them by default) at 1 to 96 threads. WRITES sets
+# the percent of critical sections that write, for reader-writer locks.
 DATE=`date +"%d"."%m"-"%T"`
 OUTPUT=./output-$DATE
-
+RATIO=$1
+[ $# -gt 0 ] && shift
+LOCKS=${*:-"mutex fair futex ring ring1 mcs clh fair-rw pthread-rw"}
 echo $OUTPUT
-
-for t in 1 2 4 8 16;
-do
-    ./locks $t $1 | tee $OUTPUT-$t-threads
-done
-
-grep 'per second' $OUTPUT* | awk '{print $4}'
+./locks -l ${LOCKS// /,} -w ${WRITES:-100} 1,2,4,8,16,32,64,96 $RATIO | tee $OUTPUT
+grep -E '^(Threads|Lock type|Iterations per second):' $OUTPUT |
+    awk -F': ' '/^Threads/ {t = $2} /^Lock type/ {l = $2}
+        /^Iterations/ {print l, t, $2}'